@@ -1,5 +1,8 @@
 #include "apis.h"
 
+//subproblems at least this big poll for cancellation (smaller ones finish in well under a millisecond)
+#define FIB_STOP_POLL_MIN 24
+
 int64_t fib(int64_t n)
 {
     if (n <= 1) {
@@ -7,3 +10,24 @@ int64_t fib(int64_t n)
     }
     return fib(n - 1) + fib(n - 2);
 }
+
+bool fib_cancellable(int64_t n, APIStopCheck should_stop, void* ctx, int64_t& result)
+{
+    if (n < FIB_STOP_POLL_MIN) {
+        result = fib(n);
+        return true;
+    }
+
+    if (should_stop(ctx)) {
+        return false;
+    }
+
+    int64_t r1 = 0;
+    int64_t r2 = 0;
+    if (!fib_cancellable(n - 1, should_stop, ctx, r1) || !fib_cancellable(n - 2, should_stop, ctx, r2)) {
+        return false;
+    }
+
+    result = r1 + r2;
+    return true;
+}
@@ -2,4 +2,12 @@
 
 #include <stdint.h>
 
+//Polled by long running APIs -- returns true when the caller no longer wants the result
+typedef bool (*APIStopCheck)(void* ctx);
+
 int64_t fib(int64_t n);
+
+/**
+ * Cooperative variant of fib -- checks should_stop at the top of each large subproblem and returns false (without a result) if asked to stop
+ **/
+bool fib_cancellable(int64_t n, APIStopCheck should_stop, void* ctx, int64_t& result);
@@ -8,8 +8,17 @@ RSHookServer g_server;
 
 void sigint_handler(int signo)
 {
-    g_server.shutdown();
-    exit(0);
+    g_server.request_shutdown();
+}
+
+void sigusr1_handler(int signo)
+{
+    g_server.request_cache_snapshot();
+}
+
+void sigusr2_handler(int signo)
+{
+    g_server.request_trace_dump();
 }
 
 bool setup_listening_socket(int port, int& sock)
@@ -51,6 +60,15 @@ int main(int argc, char **argv)
     //setup signal handler for graceful shutdown
     signal(SIGINT, sigint_handler);
 
+    //on-demand cache snapshot
+    signal(SIGUSR1, sigusr1_handler);
+
+    //on-demand ring trace dump (when built with ENABLE_RING_TRACE)
+    signal(SIGUSR2, sigusr2_handler);
+
+    //returns once SIGINT has been seen -- the snapshot and the rest of shutdown run here, on the runloop's thread
     g_server.runloop();
+    g_server.shutdown();
+
     return 0;
 }
@@ -0,0 +1,352 @@
+#include "accesslog.h"
+
+#include <fcntl.h>
+#include <sys/time.h>
+
+static char* s_log_append(char* pos, const char* str)
+{
+    while(*str != '\0') {
+        *pos++ = *str++;
+    }
+    return pos;
+}
+
+static char* s_log_append_uint(char* pos, uint64_t value)
+{
+    char digits[20];
+    size_t count = 0;
+    do {
+        digits[count++] = (char)('0' + (value % 10));
+        value /= 10;
+    } while(value != 0);
+
+    while(count != 0) {
+        *pos++ = digits[--count];
+    }
+    return pos;
+}
+
+static char* s_log_append_int(char* pos, int64_t value)
+{
+    if(value < 0) {
+        *pos++ = '-';
+        return s_log_append_uint(pos, (uint64_t)(-value));
+    }
+    return s_log_append_uint(pos, (uint64_t)value);
+}
+
+//JSON string contents -- stops before going over max output bytes so a hostile path cannot overrun the record
+static char* s_log_append_escaped(char* pos, const char* str, size_t max)
+{
+    static const char* hex = "0123456789abcdef";
+
+    char* end = pos + max;
+    for(; *str != '\0'; ++str) {
+        uint8_t c = (uint8_t)*str;
+        if(c == '"' || c == '\\') {
+            if(pos + 2 > end) {
+                break;
+            }
+            *pos++ = '\\';
+            *pos++ = (char)c;
+        }
+        else if(c < 0x20 || c == 0x7F) {
+            if(pos + 6 > end) {
+                break;
+            }
+            pos = s_log_append(pos, "\\u00");
+            *pos++ = hex[c >> 4];
+            *pos++ = hex[c & 0xF];
+        }
+        else {
+            if(pos + 1 > end) {
+                break;
+            }
+            *pos++ = (char)c;
+        }
+    }
+    return pos;
+}
+
+static uint64_t s_log_span(uint64_t from, uint64_t to)
+{
+    return (from != 0 && to > from) ? (to - from) : 0;
+}
+
+static bool s_log_writeall(int fd, const char* data, size_t size, uint64_t offset)
+{
+    while(size != 0) {
+        ssize_t written = pwrite(fd, data, size, (off_t)offset);
+        if(written < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+
+        data += written;
+        size -= (size_t)written;
+        offset += (uint64_t)written;
+    }
+    return true;
+}
+
+bool AccessLog::open(const char* path)
+{
+    this->m_fd = ::open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if(this->m_fd == -1) {
+        return false;
+    }
+
+    //keep appending to the log from the last run (rotation takes care of the size)
+    off_t end = lseek(this->m_fd, 0, SEEK_END);
+    this->m_file_offset = (end > 0) ? (uint64_t)end : 0;
+    this->m_path = path;
+
+    struct timeval now;
+    gettimeofday(&now, nullptr);
+    this->m_base_us = s_now_us();
+    this->m_base_realtime_us = ((uint64_t)now.tv_sec * 1000000) + (uint64_t)now.tv_usec;
+
+    for(size_t i = 0; i < ACCESS_LOG_BUFFER_COUNT; ++i) {
+        AccessLogBuffer& buffer = this->m_buffers[i];
+        buffer.m_data = (char*)malloc(ACCESS_LOG_BUFFER_SIZE);
+        buffer.m_used = 0;
+        buffer.m_written = 0;
+        buffer.m_records = 0;
+        buffer.m_fd = -1;
+        buffer.m_offset = 0;
+        buffer.m_state = AccessLogBufferState::Free;
+    }
+
+    this->m_tick_ts.tv_sec = ACCESS_LOG_FLUSH_MS / 1000;
+    this->m_tick_ts.tv_nsec = (ACCESS_LOG_FLUSH_MS % 1000) * 1000000;
+    this->m_tick_armed = false;
+
+    this->m_stats = { 0, 0, 0, 0 };
+
+    return this->m_activate();
+}
+
+void AccessLog::close()
+{
+    if(this->m_active != -1 && this->m_buffers[this->m_active].m_used != 0) {
+        this->m_queue((uint32_t)this->m_active);
+    }
+    this->m_active = -1;
+
+    for(size_t i = 0; i < ACCESS_LOG_BUFFER_COUNT; ++i) {
+        AccessLogBuffer& buffer = this->m_buffers[i];
+        if(buffer.m_state == AccessLogBufferState::Queued) {
+            if(s_log_writeall(buffer.m_fd, buffer.m_data + buffer.m_written, buffer.m_used - buffer.m_written, buffer.m_offset + buffer.m_written)) {
+                this->m_stats.bytes += buffer.m_used - buffer.m_written;
+            }
+            else {
+                this->m_stats.dropped += buffer.m_records;
+            }
+
+            int fd = buffer.m_fd;
+            buffer.m_fd = -1;
+            buffer.m_state = AccessLogBufferState::Free;
+            this->m_release_fd(fd);
+        }
+
+        //a write the ring never gave back may still read the buffer (and its file stays open)
+        if(buffer.m_state != AccessLogBufferState::InFlight) {
+            free(buffer.m_data);
+            buffer.m_data = nullptr;
+        }
+    }
+
+    if(this->m_fd != -1) {
+        ::close(this->m_fd);
+        this->m_fd = -1;
+    }
+}
+
+bool AccessLog::m_activate()
+{
+    for(int32_t i = 0; i < ACCESS_LOG_BUFFER_COUNT; ++i) {
+        AccessLogBuffer& buffer = this->m_buffers[i];
+        if(buffer.m_state == AccessLogBufferState::Free) {
+            buffer.m_used = 0;
+            buffer.m_written = 0;
+            buffer.m_records = 0;
+            buffer.m_state = AccessLogBufferState::Active;
+
+            this->m_active = i;
+            return true;
+        }
+    }
+
+    this->m_active = -1;
+    return false;
+}
+
+void AccessLog::m_queue(uint32_t idx)
+{
+    AccessLogBuffer& buffer = this->m_buffers[idx];
+
+    if(this->m_file_offset != 0 && this->m_file_offset + buffer.m_used > ACCESS_LOG_ROTATE_BYTES) {
+        this->m_rotate();
+    }
+
+    if(this->m_fd == -1) {
+        //rotation could not open a new file -- the log is off from here on
+        this->m_stats.dropped += buffer.m_records;
+        buffer.m_state = AccessLogBufferState::Free;
+        return;
+    }
+
+    buffer.m_fd = this->m_fd;
+    buffer.m_offset = this->m_file_offset;
+    buffer.m_state = AccessLogBufferState::Queued;
+    this->m_file_offset += buffer.m_used;
+}
+
+void AccessLog::m_rotate()
+{
+    //shift name.N-1 -> name.N ... name -> name.1 (the oldest falls off) -- writes already assigned to the old file still land in it
+    for(int i = ACCESS_LOG_ROTATE_KEEP; i > 1; --i) {
+        std::string from = this->m_path + "." + std::to_string(i - 1);
+        std::string to = this->m_path + "." + std::to_string(i);
+        rename(from.c_str(), to.c_str());
+    }
+    rename(this->m_path.c_str(), (this->m_path + ".1").c_str());
+
+    int old_fd = this->m_fd;
+    this->m_fd = ::open(this->m_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    this->m_file_offset = 0;
+    this->m_stats.rotations++;
+
+    this->m_release_fd(old_fd);
+}
+
+void AccessLog::m_release_fd(int fd)
+{
+    if(fd == -1 || fd == this->m_fd) {
+        return;
+    }
+
+    for(size_t i = 0; i < ACCESS_LOG_BUFFER_COUNT; ++i) {
+        const AccessLogBuffer& buffer = this->m_buffers[i];
+        if(buffer.m_fd == fd && (buffer.m_state == AccessLogBufferState::Queued || buffer.m_state == AccessLogBufferState::InFlight)) {
+            return;
+        }
+    }
+
+    ::close(fd);
+}
+
+void AccessLog::m_append(const AccessLogEntry& entry)
+{
+    if(this->m_active == -1 && !this->m_activate()) {
+        this->m_stats.dropped++;
+        return;
+    }
+
+    AccessLogBuffer& buffer = this->m_buffers[this->m_active];
+    char* pos = buffer.m_data + buffer.m_used;
+
+    //wall clock from the monotonic stamp -- no clock read per record
+    uint64_t ts_us = this->m_base_realtime_us + s_log_span(this->m_base_us, entry.end_us);
+    uint64_t read_us = (entry.read_us != 0) ? entry.read_us : entry.write_us;
+
+    pos = s_log_append(pos, "{\"ts\":");
+    pos = s_log_append_uint(pos, ts_us / 1000000);
+    *pos++ = '.';
+    uint64_t frac = ts_us % 1000000;
+    for(uint64_t div = 100000; div != 0; div /= 10) {
+        *pos++ = (char)('0' + ((frac / div) % 10));
+    }
+
+    pos = s_log_append(pos, ",\"route\":\"");
+    pos = s_log_append_escaped(pos, (entry.route != nullptr) ? entry.route : "", ACCESS_LOG_ROUTE_MAX);
+    pos = s_log_append(pos, "\",\"status\":");
+    pos = s_log_append_int(pos, entry.status);
+    pos = s_log_append(pos, ",\"bytes\":");
+    pos = s_log_append_int(pos, entry.bytes);
+    pos = s_log_append(pos, ",\"total_us\":");
+    pos = s_log_append_uint(pos, s_log_span(entry.start_us, entry.end_us));
+    pos = s_log_append(pos, ",\"read_us\":");
+    pos = s_log_append_uint(pos, s_log_span(entry.start_us, read_us));
+    pos = s_log_append(pos, ",\"handle_us\":");
+    pos = s_log_append_uint(pos, s_log_span(read_us, entry.write_us));
+    pos = s_log_append(pos, ",\"write_us\":");
+    pos = s_log_append_uint(pos, s_log_span(entry.write_us, entry.end_us));
+    pos = s_log_append(pos, "}\n");
+
+    buffer.m_used = (size_t)(pos - buffer.m_data);
+    buffer.m_records++;
+    this->m_stats.records++;
+
+    if(ACCESS_LOG_BUFFER_SIZE - buffer.m_used < ACCESS_LOG_RECORD_MAX) {
+        this->m_queue((uint32_t)this->m_active);
+        this->m_activate();
+    }
+}
+
+bool AccessLog::nextWrite(AccessLogWrite& write)
+{
+    for(uint32_t i = 0; i < ACCESS_LOG_BUFFER_COUNT; ++i) {
+        AccessLogBuffer& buffer = this->m_buffers[i];
+        if(buffer.m_state == AccessLogBufferState::Queued) {
+            buffer.m_state = AccessLogBufferState::InFlight;
+
+            write.tag = i;
+            write.fd = buffer.m_fd;
+            write.data = buffer.m_data + buffer.m_written;
+            write.size = buffer.m_used - buffer.m_written;
+            write.offset = buffer.m_offset + buffer.m_written;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void AccessLog::writeComplete(uint32_t tag, int32_t res)
+{
+    AccessLogBuffer& buffer = this->m_buffers[tag];
+
+    if(res <= 0) {
+        this->m_stats.dropped += buffer.m_records;
+    }
+    else {
+        buffer.m_written += (size_t)res;
+        this->m_stats.bytes += (uint64_t)res;
+
+        if(buffer.m_written < buffer.m_used) {
+            //short write -- the rest goes out with the next submission
+            buffer.m_state = AccessLogBufferState::Queued;
+            return;
+        }
+    }
+
+    int fd = buffer.m_fd;
+    buffer.m_fd = -1;
+    buffer.m_state = AccessLogBufferState::Free;
+    this->m_release_fd(fd);
+
+    if(this->m_active == -1 && this->m_fd != -1) {
+        this->m_activate();
+    }
+}
+
+bool AccessLog::hasInFlight() const
+{
+    for(size_t i = 0; i < ACCESS_LOG_BUFFER_COUNT; ++i) {
+        if(this->m_buffers[i].m_state == AccessLogBufferState::InFlight) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void AccessLog::flush()
+{
+    if(this->m_active != -1 && this->m_buffers[this->m_active].m_used != 0) {
+        this->m_queue((uint32_t)this->m_active);
+        this->m_activate();
+    }
+}
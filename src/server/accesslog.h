@@ -0,0 +1,166 @@
+#pragma once
+
+#include "common.h"
+
+#include <string>
+
+#define ENABLE_ACCESS_LOG 1
+
+#define ACCESS_LOG_FILE_NAME "rshook-access.log"
+
+#define ACCESS_LOG_BUFFER_SIZE ((size_t)1 << 18)
+#define ACCESS_LOG_BUFFER_COUNT 4
+#define ACCESS_LOG_RECORD_MAX 512 //a buffer is handed to the ring once it cannot hold another record of this size
+#define ACCESS_LOG_ROUTE_MAX 256 //longer routes are truncated in the record
+
+#define ACCESS_LOG_FLUSH_MS 1000 //a partly filled buffer is written at most this long after its first record
+#define ACCESS_LOG_DRAIN_MS 1000 //at shutdown the runloop keeps going at most this long for the log writes on the ring to land
+
+#define ACCESS_LOG_ROTATE_BYTES ((uint64_t)1 << 26)
+#define ACCESS_LOG_ROTATE_KEEP 4 //rotated files are name.1 (newest) to name.KEEP
+
+#define ACCESS_LOG_TICK_TAG 0xFF //user data tag for the flush timer (buffer indices are the other tags)
+
+enum class AccessLogBufferState : uint8_t
+{
+    Free,
+    Active, //records are being appended
+    Queued, //waiting for a write to be submitted (full, flushed by the timer, or resubmitting after a short write)
+    InFlight
+};
+
+class AccessLogBuffer
+{
+public:
+    char* m_data;
+    size_t m_used;
+    size_t m_written;
+    uint64_t m_records;
+
+    int m_fd; //file (and offset in it) the buffer was assigned to when it was queued -- rotation does not move queued buffers
+    uint64_t m_offset;
+
+    AccessLogBufferState m_state;
+};
+
+//One write to hand to the ring -- tag goes back to writeComplete with the result
+class AccessLogWrite
+{
+public:
+    uint32_t tag;
+    int fd;
+    const char* data;
+    size_t size;
+    uint64_t offset;
+};
+
+class AccessLogEntry
+{
+public:
+    const char* route;
+    int status;
+    int64_t bytes; //sent, or the negated errno when the response write failed
+
+    uint64_t start_us; //accepted
+    uint64_t read_us; //request read off the socket
+    uint64_t write_us; //response write submitted
+    uint64_t end_us; //response write completed
+};
+
+class AccessLogStats
+{
+public:
+    uint64_t records;
+    uint64_t dropped; //all buffers were busy (or a write failed) so the records were lost
+    uint64_t bytes;
+    uint64_t rotations;
+};
+
+/**
+ * JSON lines access log owned by a runloop -- records are formatted into the active buffer and whole buffers go to the file as
+ * single ring writes, so the only cost on the request path is the formatting. The runloop drives the ring side: it submits
+ * what nextWrite hands out, routes the completions back to writeComplete, and arms the flush timer when needsTick says so.
+ *
+ * Nothing here blocks the runloop -- when every buffer is busy (the disk is not keeping up) records are dropped and counted.
+ * The exceptions are rotation (a couple of renames and an open every ACCESS_LOG_ROTATE_BYTES) and close, which writes out
+ * whatever is left synchronously at shutdown.
+ **/
+class AccessLog
+{
+private:
+    std::string m_path;
+    int m_fd;
+    uint64_t m_file_offset; //end of what has been assigned to the current file
+
+    uint64_t m_base_us;
+    uint64_t m_base_realtime_us;
+
+    AccessLogBuffer m_buffers[ACCESS_LOG_BUFFER_COUNT];
+    int32_t m_active;
+
+    bool m_tick_armed;
+    struct __kernel_timespec m_tick_ts;
+
+    AccessLogStats m_stats;
+
+    bool m_activate();
+    void m_queue(uint32_t idx);
+    void m_rotate();
+    void m_release_fd(int fd);
+    void m_append(const AccessLogEntry& entry);
+
+public:
+    AccessLog(): m_path(), m_fd(-1), m_file_offset(0), m_base_us(0), m_base_realtime_us(0), m_buffers(), m_active(-1), m_tick_armed(false), m_tick_ts(), m_stats() { ; }
+    ~AccessLog() { ; }
+
+    bool open(const char* path);
+
+    //write out everything not yet on the ring synchronously -- in-flight writes must have completed (or been given up on)
+    void close();
+
+    bool isOpen() const
+    {
+        return this->m_fd != -1;
+    }
+
+    void record(const AccessLogEntry& entry)
+    {
+        if(this->m_fd == -1) {
+            return;
+        }
+
+        this->m_append(entry);
+    }
+
+    //next queued buffer to submit (false when there are none)
+    bool nextWrite(AccessLogWrite& write);
+    void writeComplete(uint32_t tag, int32_t res);
+
+    bool hasInFlight() const;
+
+    //the active buffer has records and no timer is armed to flush it -- the caller submits a timeout for armTick (tagged ACCESS_LOG_TICK_TAG)
+    bool needsTick() const
+    {
+        return !this->m_tick_armed && this->m_active != -1 && this->m_buffers[this->m_active].m_used != 0;
+    }
+
+    struct __kernel_timespec* armTick()
+    {
+        this->m_tick_armed = true;
+        return &this->m_tick_ts;
+    }
+
+    //queue the partly filled active buffer
+    void flush();
+
+    void tickComplete()
+    {
+        this->m_tick_armed = false;
+        this->flush();
+    }
+
+    const AccessLogStats& getStats() const
+    {
+        return this->m_stats;
+    }
+};
@@ -0,0 +1,121 @@
+#pragma once
+
+#include "common.h"
+
+#define ENABLE_ADMISSION_CONTROL 1
+
+#define ADMISSION_MAX_RESIDENT_BYTES (((size_t)1) << 30)
+#define ADMISSION_MAX_INFLIGHT_EVENTS 12288
+#define ADMISSION_MAX_PENDING_JOBS 512
+#define ADMISSION_MIN_SQ_SPACE 32
+
+/**
+ * Limits past which new work is shed -- defaults come from the defines above and can be replaced before the runloop starts
+ **/
+class AdmissionWatermarks
+{
+public:
+    size_t max_resident_bytes;
+    size_t max_inflight_events;
+    size_t max_pending_jobs;
+    size_t min_sq_space;
+
+    AdmissionWatermarks(): max_resident_bytes(ADMISSION_MAX_RESIDENT_BYTES), max_inflight_events(ADMISSION_MAX_INFLIGHT_EVENTS), max_pending_jobs(ADMISSION_MAX_PENDING_JOBS), min_sq_space(ADMISSION_MIN_SQ_SPACE) { ; }
+};
+
+enum class AdmissionDecision
+{
+    Admit,
+    ShedMemory,
+    ShedInflight,
+    ShedSubmissionQueue,
+    ShedJobs
+};
+
+class AdmissionStats
+{
+public:
+    size_t admitted;
+    size_t shed_memory;
+    size_t shed_inflight;
+    size_t shed_sq;
+    size_t shed_jobs;
+};
+
+/**
+ * Per runloop admission controller.
+ * Allocator occupancy is sampled once per completion batch (it only moves when slabs are mapped/trimmed) while the
+ * in-flight event, job, and SQ counts are passed in live since they are already at hand and cost nothing to read.
+ **/
+class AdmissionController
+{
+private:
+    AdmissionWatermarks m_watermarks;
+    size_t m_resident_bytes;
+    AdmissionStats m_stats;
+
+public:
+    AdmissionController(): m_watermarks(), m_resident_bytes(0), m_stats{0, 0, 0, 0, 0} { ; }
+
+    void configure(const AdmissionWatermarks& watermarks)
+    {
+        this->m_watermarks = watermarks;
+    }
+
+    size_t getMinSQSpace() const
+    {
+        return this->m_watermarks.min_sq_space;
+    }
+
+    void refresh(size_t resident_bytes)
+    {
+        this->m_resident_bytes = resident_bytes;
+    }
+
+    /**
+     * Decide on a new connection before anything is allocated for it
+     **/
+    AdmissionDecision admitConnection(size_t inflight_events, size_t sq_space)
+    {
+#if ENABLE_ADMISSION_CONTROL
+        if(this->m_resident_bytes > this->m_watermarks.max_resident_bytes) {
+            this->m_stats.shed_memory++;
+            return AdmissionDecision::ShedMemory;
+        }
+
+        if(inflight_events >= this->m_watermarks.max_inflight_events) {
+            this->m_stats.shed_inflight++;
+            return AdmissionDecision::ShedInflight;
+        }
+
+        //the caller flushes before asking so a low count here means the kernel is not taking submissions, not just a burst
+        if(sq_space < this->m_watermarks.min_sq_space) {
+            this->m_stats.shed_sq++;
+            return AdmissionDecision::ShedSubmissionQueue;
+        }
+#endif
+
+        this->m_stats.admitted++;
+        return AdmissionDecision::Admit;
+    }
+
+    /**
+     * Decide on handing a compute job to the worker threads (the request itself has already been admitted)
+     **/
+    AdmissionDecision admitJob(size_t pending_jobs)
+    {
+#if ENABLE_ADMISSION_CONTROL
+        if(pending_jobs >= this->m_watermarks.max_pending_jobs) {
+            this->m_stats.shed_jobs++;
+            return AdmissionDecision::ShedJobs;
+        }
+#endif
+
+        return AdmissionDecision::Admit;
+    }
+
+    const AdmissionStats& getStats() const
+    {
+        return this->m_stats;
+    }
+};
@@ -1,30 +1,524 @@
 #include "alloc.h"
 
-constexpr size_t s_alignedsize(size_t size)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#define ALLOC_OS_PAGE_SIZE 4096
+
+//Exhausted placeholder so every m_current entry is always a valid slab
+static AllocSlab s_exhausted_slab = {};
+
+static size_t s_pageround(size_t size)
+{
+    return (size + (ALLOC_OS_PAGE_SIZE - 1)) & ~((size_t)ALLOC_OS_PAGE_SIZE - 1);
+}
+
+void* AllocPageSource::mapAligned(size_t size)
+{
+    //over-map so we can trim to slab alignment
+    size_t mapsize = size + ALLOC_SLAB_SIZE;
+    char* base = (char*)mmap(nullptr, mapsize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(base == MAP_FAILED) {
+        assert(false);
+        return nullptr;
+    }
+
+    char* aligned = (char*)(((uintptr_t)base + (ALLOC_SLAB_SIZE - 1)) & ~(ALLOC_SLAB_SIZE - 1));
+    size_t head = aligned - base;
+    size_t tail = mapsize - head - size;
+
+    if(head != 0) {
+        munmap(base, head);
+    }
+    if(tail != 0) {
+        munmap(aligned + size, tail);
+    }
+
+    return aligned;
+}
+
+void AllocPageSource::bindToNode(void* addr, size_t size, int32_t node)
+{
+    if(!this->m_bind_nodes || node == ALLOC_NODE_ANY) {
+        return;
+    }
+
+    //preferred (not strict) so a full node falls back to a remote one instead of failing the fault
+    unsigned long nodemask = ((unsigned long)1) << node;
+    syscall(SYS_mbind, addr, size, MPOL_PREFERRED, &nodemask, sizeof(nodemask) * 8, 0);
+}
+
+static size_t s_nodeidx(int32_t node)
+{
+    return (node == ALLOC_NODE_ANY) ? 0 : ((size_t)node % ALLOC_MAX_NUMA_NODES);
+}
+
+AllocSlab* AllocPageSource::allocSlab()
+{
+    int32_t node = s_alloc_numa_node;
+    size_t nidx = s_nodeidx(node);
+
+    std::lock_guard<std::mutex> lock(this->m_lock);
+
+    this->m_resident_bytes += ALLOC_SLAB_SIZE;
+
+    if(this->m_released[nidx] != nullptr) {
+        AllocSlab* slab = this->m_released[nidx];
+        this->m_released[nidx] = slab->m_next;
+
+        return slab;
+    }
+
+    if(this->m_region_bump[nidx] == this->m_region_end[nidx]) {
+        size_t regionsize = ALLOC_SLAB_SIZE * ALLOC_REGION_SLABS;
+        char* region = (char*)AllocPageSource::mapAligned(regionsize);
+
+#if ENABLE_ALLOC_HUGEPAGES
+        madvise(region, regionsize, MADV_HUGEPAGE);
+#endif
+        //bind before anything faults the pages in
+        this->bindToNode(region, regionsize, node);
+
+        this->m_region_bump[nidx] = region;
+        this->m_region_end[nidx] = region + regionsize;
+        this->m_mapped_bytes += regionsize;
+    }
+
+    AllocSlab* slab = (AllocSlab*)this->m_region_bump[nidx];
+    this->m_region_bump[nidx] += ALLOC_SLAB_SIZE;
+    slab->m_node = (int32_t)nidx;
+
+    return slab;
+}
+
+void AllocPageSource::releaseSlab(AllocSlab* slab)
+{
+    //drop everything but the header page -- it holds the link while the slab sits on the released list
+    madvise(((char*)slab) + ALLOC_OS_PAGE_SIZE, ALLOC_SLAB_SIZE - ALLOC_OS_PAGE_SIZE, MADV_DONTNEED);
+
+    std::lock_guard<std::mutex> lock(this->m_lock);
+
+    //back on the list for the node it is bound to (which may not be the releasing thread's)
+    size_t nidx = (size_t)slab->m_node;
+    slab->m_next = this->m_released[nidx];
+    this->m_released[nidx] = slab;
+
+    this->m_resident_bytes -= ALLOC_SLAB_SIZE;
+}
+
+void* AllocPageSource::allocLarge(size_t size)
+{
+    size_t mapsize = s_pageround(size + ALLOC_SLAB_HEADER_SIZE);
+    AllocSlab* slab = (AllocSlab*)AllocPageSource::mapAligned(mapsize);
+    this->bindToNode(slab, mapsize, s_alloc_numa_node);
+
+    slab->initialize(AllocSlabKind::Large, 0, size);
+    slab->m_state = AllocSlabState::Full;
+    slab->m_used = 1;
+    slab->m_mapsize = mapsize;
+    slab->m_node = (int32_t)s_nodeidx(s_alloc_numa_node);
+
+    {
+        std::lock_guard<std::mutex> lock(this->m_lock);
+        this->m_mapped_bytes += mapsize;
+        this->m_resident_bytes += mapsize;
+    }
+
+    return ((char*)slab) + ALLOC_SLAB_HEADER_SIZE;
+}
+
+void AllocPageSource::freeLarge(AllocSlab* slab)
+{
+    size_t mapsize = slab->m_mapsize;
+    munmap(slab, mapsize);
+
+    std::lock_guard<std::mutex> lock(this->m_lock);
+    this->m_mapped_bytes -= mapsize;
+    this->m_resident_bytes -= mapsize;
+}
+
+//Heap records of exited threads waiting to be adopted
+static std::mutex s_orphan_lock;
+static AllocRemoteQueue* s_orphans = nullptr;
+
+ServerAllocator::ServerAllocator(): m_current(), m_partial(), m_empty(), m_remote(nullptr), m_last_trim(0)
+{
+    for(size_t i = 0; i < ALLOC_BIN_COUNT; ++i) {
+        this->m_current[i] = &s_exhausted_slab;
+    }
+}
+
+ServerAllocator::~ServerAllocator()
+{
+    if(this->m_remote == nullptr) {
+        return;
+    }
+
+    //park our slabs (and any frees still in flight to them) on the record for the next thread to adopt
+    this->m_collect_remote();
+
+    for(size_t i = 0; i < ALLOC_BIN_COUNT; ++i) {
+        this->m_remote->m_current[i] = this->m_current[i];
+        this->m_remote->m_partial[i] = this->m_partial[i];
+    }
+    this->m_remote->m_empty = this->m_empty;
+
+    std::lock_guard<std::mutex> lock(s_orphan_lock);
+    this->m_remote->m_next_orphan = s_orphans;
+    s_orphans = this->m_remote;
+}
+
+void ServerAllocator::m_adopt()
+{
+    {
+        std::lock_guard<std::mutex> lock(s_orphan_lock);
+        this->m_remote = s_orphans;
+        if(this->m_remote != nullptr) {
+            s_orphans = this->m_remote->m_next_orphan;
+        }
+    }
+
+    if(this->m_remote == nullptr) {
+        this->m_remote = new AllocRemoteQueue();
+        return;
+    }
+
+    for(size_t i = 0; i < ALLOC_BIN_COUNT; ++i) {
+        this->m_current[i] = this->m_remote->m_current[i];
+        this->m_partial[i] = this->m_remote->m_partial[i];
+    }
+    this->m_empty = this->m_remote->m_empty;
+
+    this->m_collect_remote();
+}
+
+void ServerAllocator::m_free_remote(AllocSlab* slab, void* ptr)
+{
+    void* head = slab->m_remote_free.load(std::memory_order_relaxed);
+    do {
+        FREE_LIST_SET_NEXT(ptr, head);
+    } while(!slab->m_remote_free.compare_exchange_weak(head, ptr, std::memory_order_acq_rel, std::memory_order_relaxed));
+
+    //only the free that makes the list non-empty tells the owner -- the owner empties the list after taking the slab off its queue
+    if(head == nullptr) {
+        slab->m_owner->pushSlab(slab);
+    }
+}
+
+void ServerAllocator::m_collect_remote()
+{
+    AllocSlab* slab = this->m_remote->m_slabs.exchange(nullptr, std::memory_order_acquire);
+    while(slab != nullptr) {
+        AllocSlab* next = slab->m_remote_next;
+
+        //acq_rel so our read of m_remote_next happens before a remote free that re-queues the slab
+        void* remote = slab->m_remote_free.exchange(nullptr, std::memory_order_acq_rel);
+        while(remote != nullptr) {
+            void* rnext = FREE_LIST_GET_NEXT(remote);
+
+            FREE_LIST_SET_NEXT(remote, slab->m_freelist);
+            slab->m_freelist = remote;
+            slab->m_used--;
+
+            remote = rnext;
+        }
+
+        if(slab->m_state != AllocSlabState::Current) {
+            this->m_free_slow(slab);
+        }
+
+        slab = next;
+    }
+}
+
+void* ServerAllocator::m_allocatep2_slow(size_t bin)
 {
-    size_t rsize = std::max<size_t>(16, size);
-    size_t pv = std::ceil(std::log2(rsize));
+    if(this->m_remote == nullptr) {
+        this->m_adopt();
+    }
+    else {
+        this->m_collect_remote();
+    }
 
-    return (size_t)std::pow(2, pv);
+    AllocSlab* slab = this->m_current[bin];
+    if(slab != &s_exhausted_slab) {
+        void* res = slab->carve();
+        if(res != nullptr) {
+            return res;
+        }
+
+        //the current slab is completely handed out -- it is picked up again by m_free_slow once something is returned to it
+        slab->m_state = AllocSlabState::Full;
+    }
+
+    slab = this->m_partial[bin].pop();
+    if(slab == nullptr) {
+        slab = this->m_empty.pop();
+        if(slab == nullptr) {
+            slab = s_page_source.allocSlab();
+        }
+
+        slab->initialize(AllocSlabKind::Small, (uint32_t)bin, (size_t)1 << bin);
+        slab->m_owner = this->m_remote;
+    }
+
+    slab->m_state = AllocSlabState::Current;
+    this->m_current[bin] = slab;
+
+    return slab->carve();
+}
+
+void ServerAllocator::m_free_slow(AllocSlab* slab)
+{
+    if(slab->m_kind == AllocSlabKind::Large) {
+        s_page_source.freeLarge(slab);
+        return;
+    }
+
+    if(slab->m_state == AllocSlabState::Full) {
+        slab->m_state = AllocSlabState::Partial;
+        this->m_partial[slab->m_bin].push(slab);
+    }
+
+    if(slab->m_used == 0 && slab->m_state == AllocSlabState::Partial) {
+        this->m_partial[slab->m_bin].remove(slab);
+
+        slab->m_state = AllocSlabState::Empty;
+        slab->m_empty_since = s_now_ms();
+        this->m_empty.push(slab);
+    }
+}
+
+void ServerAllocator::m_trim_slow(uint64_t now)
+{
+    this->m_last_trim = now;
+
+    if(this->m_remote == nullptr) {
+        return;
+    }
+    this->m_collect_remote();
+
+    AllocSlab* slab = this->m_empty.head();
+    while(slab != nullptr) {
+        AllocSlab* next = slab->m_next;
+        if(now - slab->m_empty_since >= ALLOC_SLAB_QUIET_MS) {
+            this->m_empty.remove(slab);
+            s_page_source.releaseSlab(slab);
+        }
+        slab = next;
+    }
+}
+
+void* RequestArena::m_allocate_slow(size_t size)
+{
+    //big allocations (e.g. file contents) get a dedicated block so we do not waste the rest of a chunk
+    bool dedicated = size > (REQUEST_ARENA_CHUNK_SIZE / 2);
+    size_t blocksize = dedicated ? (size + REQUEST_ARENA_ALIGN) : REQUEST_ARENA_CHUNK_SIZE;
+
+    uint8_t* block = s_allocator.allocatebytesp2(blocksize);
+    FREE_LIST_SET_NEXT(block, this->m_overflow);
+    ((size_t*)block)[1] = blocksize;
+    this->m_overflow = block;
+
+    uint8_t* res = block + REQUEST_ARENA_ALIGN;
+    if(!dedicated) {
+        this->m_bump = res + size;
+        this->m_end = block + blocksize;
+    }
+
+    return res;
+}
+
+void RequestArena::reset()
+{
+    void* curr = this->m_overflow;
+    while(curr != nullptr) {
+        void* next = FREE_LIST_GET_NEXT(curr);
+        s_allocator.freebytesp2((uint8_t*)curr, ((size_t*)curr)[1]);
+        curr = next;
+    }
+
+    this->m_overflow = nullptr;
 }
 
-void* ServerAllocator::m_allocatep2_slow(size_t size)
+static thread_local AIOThreadCache s_aio_thread_cache;
+
+AIOThreadCache::~AIOThreadCache()
 {
-    /** 
-     * Temp using malloc for slow path until we implement custom backing allocation 
-     **/
-    size_t processed_size = s_alignedsize(size);
-    return aligned_alloc(16, processed_size);
+    s_aio_allocator.releaseThreadCache(*this);
 }
 
-void* AIOAllocator::m_allocate_slow()
+AIOAllocator::AIOAllocator(): m_full(), m_empty(), m_slab_lock(), m_slabs(), m_magazine_hits(0), m_depot_hits(0), m_slow_allocs(0), m_magazine_frees(0), m_depot_frees(0)
 {
-    /** 
-     * Temp using malloc for slow path until we implement custom backing allocation 
-     **/
-    return aligned_alloc(16, AIO_BUFFER_SIZE); //default aio buffer size
+    ;
+}
+
+uint8_t* AIOAllocator::allocAIOBuffer(size_t size)
+{
+    AIOThreadCache& tc = s_aio_thread_cache;
+    size_t cls = AIOAllocator::classOf(size);
+
+    AIOMagazine* mag = tc.m_loaded[cls];
+    if(mag != nullptr && mag->m_count != 0) {
+        tc.m_magazine_hits++;
+        return (uint8_t*)mag->m_buffers[--mag->m_count];
+    }
+
+    return (uint8_t*)this->m_allocate_slow(tc, cls);
+}
+
+void AIOAllocator::freeAIOBuffer(uint8_t* ptr)
+{
+    if(ptr == nullptr) {
+        return;
+    }
+
+    AIOThreadCache& tc = s_aio_thread_cache;
+    size_t cls = ALLOC_SLAB_OF(ptr)->m_bin - AIO_BUFFER_MIN_BIN;
+
+    AIOMagazine* mag = tc.m_loaded[cls];
+    if(mag != nullptr && mag->m_count != AIO_MAGAZINE_SIZE) {
+        tc.m_magazine_frees++;
+        mag->m_buffers[mag->m_count++] = ptr;
+        return;
+    }
+
+    this->m_free_slow(tc, cls, ptr);
 }
 
+AIOMagazine* AIOAllocator::newMagazine(size_t cls)
+{
+    AIOMagazine* mag = this->m_empty[cls].pop();
+    if(mag == nullptr) {
+        mag = s_allocator.allocate<AIOMagazine>();
+    }
+
+    mag->m_next.store(nullptr, std::memory_order_relaxed);
+    mag->m_count = 0;
+    return mag;
+}
+
+void AIOAllocator::flushCounts(AIOThreadCache& tc)
+{
+    this->m_magazine_hits.fetch_add(tc.m_magazine_hits, std::memory_order_relaxed);
+    this->m_magazine_frees.fetch_add(tc.m_magazine_frees, std::memory_order_relaxed);
+
+    tc.m_magazine_hits = 0;
+    tc.m_magazine_frees = 0;
+}
+
+void* AIOAllocator::m_allocate_slow(AIOThreadCache& tc, size_t cls)
+{
+    this->flushCounts(tc);
+
+    //previous magazine has buffers -- swap it in
+    AIOMagazine* prev = tc.m_previous[cls];
+    if(prev != nullptr && prev->m_count != 0) {
+        tc.m_previous[cls] = tc.m_loaded[cls];
+        tc.m_loaded[cls] = prev;
+
+        this->m_magazine_hits.fetch_add(1, std::memory_order_relaxed);
+        return prev->m_buffers[--prev->m_count];
+    }
+
+    //exchange an empty magazine for a full one from the depot
+    AIOMagazine* full = this->m_full[cls].pop();
+    if(full != nullptr) {
+        if(prev != nullptr) {
+            this->m_empty[cls].push(prev);
+        }
+        tc.m_previous[cls] = tc.m_loaded[cls];
+        tc.m_loaded[cls] = full;
+
+        this->m_depot_hits.fetch_add(1, std::memory_order_relaxed);
+        return full->m_buffers[--full->m_count];
+    }
+
+    //nothing cached anywhere so carve a new buffer
+    this->m_slow_allocs.fetch_add(1, std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> lock(this->m_slab_lock);
+
+    AllocSlab* slab = this->m_slabs[cls];
+    void* res = (slab != nullptr) ? slab->carve() : nullptr;
+    if(res == nullptr) {
+        slab = s_page_source.allocSlab();
+        slab->initialize(AllocSlabKind::AIO, (uint32_t)(cls + AIO_BUFFER_MIN_BIN), (size_t)1 << (cls + AIO_BUFFER_MIN_BIN));
+        this->m_slabs[cls] = slab;
+
+        res = slab->carve();
+    }
+
+    return res;
+}
+
+void AIOAllocator::m_free_slow(AIOThreadCache& tc, size_t cls, void* ptr)
+{
+    this->flushCounts(tc);
+
+    //previous magazine has room -- swap it in
+    AIOMagazine* prev = tc.m_previous[cls];
+    if(prev != nullptr && prev->m_count != AIO_MAGAZINE_SIZE) {
+        tc.m_previous[cls] = tc.m_loaded[cls];
+        tc.m_loaded[cls] = prev;
+
+        this->m_magazine_frees.fetch_add(1, std::memory_order_relaxed);
+        prev->m_buffers[prev->m_count++] = ptr;
+        return;
+    }
+
+    //hand the full previous magazine to the depot and start on an empty one
+    if(prev != nullptr) {
+        this->m_full[cls].push(prev);
+    }
+    tc.m_previous[cls] = tc.m_loaded[cls];
+
+    AIOMagazine* mag = this->newMagazine(cls);
+    tc.m_loaded[cls] = mag;
+
+    this->m_depot_frees.fetch_add(1, std::memory_order_relaxed);
+    mag->m_buffers[mag->m_count++] = ptr;
+}
+
+void AIOAllocator::releaseThreadCache(AIOThreadCache& tc)
+{
+    this->flushCounts(tc);
+
+    for(size_t i = 0; i < AIO_BUFFER_CLASS_COUNT; ++i) {
+        AIOMagazine* mags[2] = { tc.m_loaded[i], tc.m_previous[i] };
+        for(size_t j = 0; j < 2; ++j) {
+            if(mags[j] == nullptr) {
+                continue;
+            }
+
+            //partially filled magazines are fine in the full stack -- consumers only look at m_count
+            if(mags[j]->m_count != 0) {
+                this->m_full[i].push(mags[j]);
+            }
+            else {
+                this->m_empty[i].push(mags[j]);
+            }
+        }
+
+        tc.m_loaded[i] = nullptr;
+        tc.m_previous[i] = nullptr;
+    }
+}
+
+AIOAllocatorStats AIOAllocator::getStats() const
+{
+    AIOAllocatorStats stats;
+    stats.magazine_hits = this->m_magazine_hits.load(std::memory_order_relaxed);
+    stats.depot_hits = this->m_depot_hits.load(std::memory_order_relaxed);
+    stats.slow_allocs = this->m_slow_allocs.load(std::memory_order_relaxed);
+    stats.magazine_frees = this->m_magazine_frees.load(std::memory_order_relaxed);
+    stats.depot_frees = this->m_depot_frees.load(std::memory_order_relaxed);
+
+    return stats;
+}
 
+AllocPageSource s_page_source;
+thread_local int32_t s_alloc_numa_node = ALLOC_NODE_ANY;
 AIOAllocator s_aio_allocator;
-ServerAllocator s_allocator;
+thread_local ServerAllocator s_allocator;
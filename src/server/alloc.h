@@ -2,37 +2,351 @@
 
 #include "common.h"
 
+#include <mutex>
+#include <atomic>
+
 #define FREE_LIST_GET_NEXT(L) (*(void**)(L))
 #define FREE_LIST_SET_NEXT(L, P) ((*(void**)(L)) = P)
 
 #define AIO_BUFFER_SIZE 8192
 
+//AIO buffer classes are powers of two in [AIO_BUFFER_MIN_BIN, AIO_BUFFER_MAX_BIN]
+#define AIO_BUFFER_MIN_BIN 12
+#define AIO_BUFFER_MAX_BIN 15
+#define AIO_BUFFER_CLASS_COUNT (AIO_BUFFER_MAX_BIN - AIO_BUFFER_MIN_BIN + 1)
+#define AIO_MAGAZINE_SIZE 32
+
+#define REQUEST_ARENA_CHUNK_SIZE 16384
+#define REQUEST_ARENA_ALIGN 16
+
+#define AIO_TAGGED_PTR_BITS 48
+#define AIO_TAGGED_PTR_MASK (((uint64_t)1 << AIO_TAGGED_PTR_BITS) - 1)
+
+#define ENABLE_ALLOC_HUGEPAGES 0
+
+//Slab memory is kept per NUMA node and a thread allocates from the node set by its placement (see topology.h)
+#define ALLOC_MAX_NUMA_NODES 8
+#define ALLOC_NODE_ANY -1
+
+//Slabs are carved out of large mmap regions and are aligned to their size so the owning slab of any pointer is found by masking
+#define ALLOC_SLAB_SIZE ((size_t)1 << 18)
+#define ALLOC_SLAB_HEADER_SIZE 128
+#define ALLOC_REGION_SLABS 64
+
+#define ALLOC_MIN_BIN 4
+#define ALLOC_SMALL_BIN_MAX 14
+#define ALLOC_BIN_COUNT (ALLOC_SMALL_BIN_MAX + 1)
+#define ALLOC_REFILL_BATCH 32
+
+//Empty slabs are handed back to the OS once they have been idle this long
+#define ALLOC_SLAB_QUIET_MS 2000
+#define ALLOC_TRIM_INTERVAL_MS 500
+
+#define ALLOC_SLAB_OF(P) ((AllocSlab*)((uintptr_t)(P) & ~(ALLOC_SLAB_SIZE - 1)))
+
 constexpr size_t s_binidx(size_t size)
 {
     return std::ceil(std::log2(size));
 }
 
-class ServerAllocator
+constexpr size_t s_smallbinidx(size_t size)
+{
+    return std::max<size_t>(ALLOC_MIN_BIN, s_binidx(size));
+}
+
+enum class AllocSlabKind : uint32_t
+{
+    Small,
+    AIO,
+    Large
+};
+
+enum class AllocSlabState : uint32_t
+{
+    Current,
+    Partial,
+    Full,
+    Empty
+};
+
+class AllocRemoteQueue;
+
+/**
+ * Header at the base of every slab -- objects of a single size class follow it
+ **/
+class AllocSlab
+{
+public:
+    AllocSlabKind m_kind;
+    AllocSlabState m_state;
+    uint32_t m_bin;
+    uint32_t m_used;
+
+    size_t m_objsize;
+    void* m_freelist;
+
+    //never used space is carved lazily so fresh slabs do not fault in pages until needed
+    char* m_bump;
+    char* m_end;
+
+    AllocSlab* m_prev;
+    AllocSlab* m_next;
+
+    uint64_t m_empty_since;
+    size_t m_mapsize; //Large only
+    int32_t m_node; //set by the page source (survives release since the header page stays resident)
+
+    //frees from threads other than the owner are pushed here and spliced back in by the owner
+    AllocRemoteQueue* m_owner;
+    std::atomic<void*> m_remote_free;
+    AllocSlab* m_remote_next;
+
+    void initialize(AllocSlabKind kind, uint32_t bin, size_t objsize)
+    {
+        this->m_kind = kind;
+        this->m_state = AllocSlabState::Current;
+        this->m_bin = bin;
+        this->m_used = 0;
+
+        this->m_objsize = objsize;
+        this->m_freelist = nullptr;
+
+        this->m_bump = ((char*)this) + ALLOC_SLAB_HEADER_SIZE;
+        this->m_end = ((char*)this) + ALLOC_SLAB_SIZE;
+
+        this->m_prev = nullptr;
+        this->m_next = nullptr;
+
+        this->m_empty_since = 0;
+        this->m_mapsize = ALLOC_SLAB_SIZE;
+
+        this->m_owner = nullptr;
+        this->m_remote_free.store(nullptr, std::memory_order_relaxed);
+        this->m_remote_next = nullptr;
+    }
+
+    void* carve()
+    {
+        if(this->m_freelist == nullptr) {
+            //move a batch of never used objects onto the free list so the following allocations stay on the fast path
+            for(size_t i = 0; i < ALLOC_REFILL_BATCH && this->m_bump + this->m_objsize <= this->m_end; ++i) {
+                FREE_LIST_SET_NEXT(this->m_bump, this->m_freelist);
+                this->m_freelist = this->m_bump;
+                this->m_bump += this->m_objsize;
+            }
+
+            if(this->m_freelist == nullptr) {
+                return nullptr;
+            }
+        }
+
+        void* res = this->m_freelist;
+        this->m_freelist = FREE_LIST_GET_NEXT(res);
+
+        this->m_used++;
+        return res;
+    }
+};
+static_assert(sizeof(AllocSlab) <= ALLOC_SLAB_HEADER_SIZE, "Slab header too large");
+
+class AllocSlabList
 {
 private:
-    void* m_allocs[31] = { nullptr };
+    AllocSlab* m_head;
 
-    void* m_allocatep2_slow(size_t size);
 public:
-    template<typename T>
-    T* allocate()
+    AllocSlabList(): m_head(nullptr) { ; }
+
+    bool empty() const { return this->m_head == nullptr; }
+    AllocSlab* head() const { return this->m_head; }
+
+    void push(AllocSlab* slab)
+    {
+        slab->m_prev = nullptr;
+        slab->m_next = this->m_head;
+        if(this->m_head != nullptr) {
+            this->m_head->m_prev = slab;
+        }
+        this->m_head = slab;
+    }
+
+    void remove(AllocSlab* slab)
+    {
+        if(slab->m_prev != nullptr) {
+            slab->m_prev->m_next = slab->m_next;
+        }
+        else {
+            this->m_head = slab->m_next;
+        }
+
+        if(slab->m_next != nullptr) {
+            slab->m_next->m_prev = slab->m_prev;
+        }
+
+        slab->m_prev = nullptr;
+        slab->m_next = nullptr;
+    }
+
+    AllocSlab* pop()
+    {
+        AllocSlab* slab = this->m_head;
+        if(slab != nullptr) {
+            this->remove(slab);
+        }
+
+        return slab;
+    }
+};
+
+/**
+ * Backing page source shared by all allocators -- maps large regions, hands out slab sized pieces, and returns released slab memory to the OS.
+ * Only used on slow paths so a simple lock is fine.
+ **/
+class AllocPageSource
+{
+private:
+    std::mutex m_lock;
+
+    //one region and released list per node so a slab is only ever reused on the node its pages are bound to
+    char* m_region_bump[ALLOC_MAX_NUMA_NODES];
+    char* m_region_end[ALLOC_MAX_NUMA_NODES];
+
+    //slabs whose pages have been returned to the OS (only the header page stays resident for the link)
+    AllocSlab* m_released[ALLOC_MAX_NUMA_NODES];
+
+    size_t m_mapped_bytes;
+    size_t m_resident_bytes;
+
+    bool m_bind_nodes; //only worth an mbind call when there is more than one node
+
+    static void* mapAligned(size_t size);
+    void bindToNode(void* addr, size_t size, int32_t node);
+
+public:
+    AllocPageSource(): m_lock(), m_region_bump{nullptr}, m_region_end{nullptr}, m_released{nullptr}, m_mapped_bytes(0), m_resident_bytes(0), m_bind_nodes(false) { ; }
+
+    //called once by placement before threads start allocating
+    void enableNodeBinding(size_t node_count)
+    {
+        this->m_bind_nodes = (node_count > 1);
+    }
+
+    AllocSlab* allocSlab();
+    void releaseSlab(AllocSlab* slab);
+
+    void* allocLarge(size_t size);
+    void freeLarge(AllocSlab* slab);
+
+    size_t getMappedBytes() const { return this->m_mapped_bytes; }
+    size_t getResidentBytes() const { return this->m_resident_bytes; }
+};
+
+extern AllocPageSource s_page_source;
+
+//NUMA node the current thread allocates from (ALLOC_NODE_ANY until the thread is placed)
+extern thread_local int32_t s_alloc_numa_node;
+
+/**
+ * Per owner (thread heap) record that other threads use to hand back objects from its slabs.
+ * Records outlive their thread -- on thread exit the heap state is parked here and adopted by the next thread that starts allocating.
+ **/
+class AllocRemoteQueue
+{
+public:
+    //slabs whose remote free list went from empty to non-empty (linked through m_remote_next)
+    std::atomic<AllocSlab*> m_slabs;
+
+    //heap state saved while the record is orphaned
+    AllocSlab* m_current[ALLOC_BIN_COUNT];
+    AllocSlabList m_partial[ALLOC_BIN_COUNT];
+    AllocSlabList m_empty;
+
+    AllocRemoteQueue* m_next_orphan;
+
+    AllocRemoteQueue(): m_slabs(nullptr), m_current(), m_partial(), m_empty(), m_next_orphan(nullptr) { ; }
+
+    void pushSlab(AllocSlab* slab)
+    {
+        AllocSlab* head = this->m_slabs.load(std::memory_order_relaxed);
+        do {
+            slab->m_remote_next = head;
+        } while(!this->m_slabs.compare_exchange_weak(head, slab, std::memory_order_release, std::memory_order_relaxed));
+    }
+};
+
+/**
+ * Thread local heap -- allocation and same thread frees never synchronize.
+ * Frees of objects owned by another thread's heap go on the owning slab's lock free remote list and the owner splices them back on its slow path.
+ **/
+class ServerAllocator
+{
+private:
+    //slab each size class is currently allocating from (a shared exhausted sentinel until first use so the fast path has no null check)
+    AllocSlab* m_current[ALLOC_BIN_COUNT];
+    AllocSlabList m_partial[ALLOC_BIN_COUNT];
+    AllocSlabList m_empty;
+
+    //stable identity of this heap -- lazily claimed on the first slow path
+    AllocRemoteQueue* m_remote;
+
+    uint64_t m_last_trim;
+
+    void* m_allocatep2_slow(size_t bin);
+    void m_free_slow(AllocSlab* slab);
+    void m_free_remote(AllocSlab* slab, void* ptr);
+    void m_collect_remote();
+    void m_trim_slow(uint64_t now);
+    void m_adopt();
+
+    void* m_allocate_small(size_t bin)
     {
-        constexpr size_t bin = s_binidx(sizeof(T));
+        AllocSlab* slab = this->m_current[bin];
 
-        void* res = this->m_allocs[bin];
+        void* res = slab->m_freelist;
         if(res != nullptr) {
-            this->m_allocs[bin] = FREE_LIST_GET_NEXT(res);
+            slab->m_freelist = FREE_LIST_GET_NEXT(res);
+            slab->m_used++;
         }
         else {
-            res = this->m_allocatep2_slow(sizeof(T));
+            res = this->m_allocatep2_slow(bin);
+        }
+
+        return res;
+    }
+
+    void m_free(void* ptr)
+    {
+        AllocSlab* slab = ALLOC_SLAB_OF(ptr);
+        if(slab->m_kind == AllocSlabKind::Large) {
+            this->m_free_slow(slab);
+            return;
+        }
+
+        if(slab->m_owner != this->m_remote) {
+            this->m_free_remote(slab, ptr);
+            return;
+        }
+
+        FREE_LIST_SET_NEXT(ptr, slab->m_freelist);
+        slab->m_freelist = ptr;
+        slab->m_used--;
+
+        if(slab->m_state != AllocSlabState::Current) {
+            this->m_free_slow(slab);
         }
+    }
+
+public:
+    ServerAllocator();
+    ~ServerAllocator();
 
-        return (T*)res;
+    template<typename T>
+    T* allocate()
+    {
+        constexpr size_t bin = s_smallbinidx(sizeof(T));
+        static_assert(bin <= ALLOC_SMALL_BIN_MAX, "Use allocatebytesp2 for large objects");
+
+        return (T*)this->m_allocate_small(bin);
     }
 
     template<typename T>
@@ -42,25 +356,17 @@ public:
             return;
         }
 
-        constexpr size_t bin = s_binidx(sizeof(T));
-
-        FREE_LIST_SET_NEXT(ptr, this->m_allocs[bin]);
-        this->m_allocs[bin] = ptr;
+        this->m_free(ptr);
     }
 
     uint8_t* allocatebytesp2(size_t size)
     {
-        size_t bin = s_binidx(size);
-
-        void* res = this->m_allocs[bin];
-        if(res != nullptr) {
-            this->m_allocs[bin] = FREE_LIST_GET_NEXT(res);
-        }
-        else {
-            res = this->m_allocatep2_slow(size);
+        size_t bin = s_smallbinidx(size);
+        if(bin > ALLOC_SMALL_BIN_MAX) {
+            return (uint8_t*)s_page_source.allocLarge(size);
         }
 
-        return (uint8_t*)res;
+        return (uint8_t*)this->m_allocate_small(bin);
     }
 
     char* strcopyp2(const char* str, size_t size)
@@ -90,70 +396,221 @@ public:
         return res;
     }
 
+    /**
+     * The size is kept for symmetry with allocatebytesp2 -- the owning slab records the real size class
+     **/
     void freebytesp2(uint8_t* ptr, size_t size)
     {
         if(ptr == nullptr) {
             return;
         }
-        
-        size_t bin = s_binidx(size);
 
-        FREE_LIST_SET_NEXT(ptr, this->m_allocs[bin]);
-        this->m_allocs[bin] = ptr;
+        this->m_free(ptr);
+    }
+
+    /**
+     * Return slabs that have been empty for the quiet period to the OS (cheap to call often -- only does work every ALLOC_TRIM_INTERVAL_MS)
+     **/
+    void trim(uint64_t now)
+    {
+        if(now - this->m_last_trim < ALLOC_TRIM_INTERVAL_MS) {
+            return;
+        }
+
+        this->m_trim_slow(now);
     }
 };
 
-class AIOAllocator
+/**
+ * Request scoped bump arena -- everything a request needs (its events, read buffer, route copy, response headers) is carved from here
+ * and the whole thing is returned in one step when the request completes. The owner object lives at the start of the first chunk.
+ **/
+class RequestArena
 {
 private:
-    void* m_allocs;
-    std::mutex g_pages_mutex;
+    uint8_t* m_bump;
+    uint8_t* m_end;
+
+    //extra chunks (and dedicated blocks for big allocations) chained through their first word -- the block size is in the second
+    void* m_overflow;
+
+    void* m_allocate_slow(size_t size);
 
-    void* m_allocate_slow();
 public:
-    AIOAllocator(): m_allocs(nullptr), g_pages_mutex()
-    { 
-        ; 
+    RequestArena(uint8_t* bump, uint8_t* end): m_bump(bump), m_end(end), m_overflow(nullptr) { ; }
+
+    static size_t alignedSize(size_t size)
+    {
+        return (size + (REQUEST_ARENA_ALIGN - 1)) & ~((size_t)REQUEST_ARENA_ALIGN - 1);
     }
-    
-    ~AIOAllocator()
-    { 
-        void* current = this->m_allocs;
-        while(current != nullptr) {
-            void* next = FREE_LIST_GET_NEXT(current);
-            free(current);
-            current = next;
+
+    void* allocate(size_t size)
+    {
+        size_t asize = RequestArena::alignedSize(size);
+        if(this->m_bump + asize <= this->m_end) {
+            void* res = this->m_bump;
+            this->m_bump += asize;
+            return res;
         }
+
+        return this->m_allocate_slow(asize);
     }
 
-    uint8_t* allocAIOBuffer()
+    template<typename T>
+    T* allocate()
     {
-        std::lock_guard<std::mutex> lock(this->g_pages_mutex);
+        return (T*)this->allocate(sizeof(T));
+    }
 
-        void* res = this->m_allocs;
-        if(res != nullptr) {
-            this->m_allocs = FREE_LIST_GET_NEXT(res);
-        }
-        else {
-            res = this->m_allocate_slow();
+    char* strcopy(const char* str, size_t size)
+    {
+        if(str == nullptr) {
+            return nullptr;
         }
 
-        return (uint8_t*)res;
+        char* res = (char*)this->allocate(size + 1);
+        memcpy(res, str, size);
+        res[size] = '\0';
+
+        return res;
+    }
+
+    /**
+     * Free the overflow chunks -- the first chunk belongs to the owner and is freed by it
+     **/
+    void reset();
+};
+
+/**
+ * Fixed capacity stack of AIO buffers of one size class -- the unit of exchange between thread caches and the global depot
+ **/
+class AIOMagazine
+{
+public:
+    std::atomic<AIOMagazine*> m_next; //may be read by a racing pop after reuse so it is atomic (relaxed)
+    size_t m_count;
+    void* m_buffers[AIO_MAGAZINE_SIZE];
+};
+
+/**
+ * ABA safe lock free stack of magazines -- the top 16 bits of the head carry a version tag.
+ * Magazines are never freed while the allocator lives so a stale read of m_next is harmless (the tag makes the CAS fail).
+ **/
+class AIOMagazineStack
+{
+private:
+    std::atomic<uint64_t> m_head;
+
+    static AIOMagazine* ptrOf(uint64_t head) { return (AIOMagazine*)(head & AIO_TAGGED_PTR_MASK); }
+    static uint64_t tagOf(uint64_t head) { return head >> AIO_TAGGED_PTR_BITS; }
+    static uint64_t pack(AIOMagazine* mag, uint64_t tag) { return ((uint64_t)(uintptr_t)mag) | (tag << AIO_TAGGED_PTR_BITS); }
+
+public:
+    AIOMagazineStack(): m_head(0) { ; }
+
+    void push(AIOMagazine* mag)
+    {
+        uint64_t head = this->m_head.load(std::memory_order_relaxed);
+        uint64_t nhead;
+        do {
+            mag->m_next.store(AIOMagazineStack::ptrOf(head), std::memory_order_relaxed);
+            nhead = AIOMagazineStack::pack(mag, AIOMagazineStack::tagOf(head) + 1);
+        } while(!this->m_head.compare_exchange_weak(head, nhead, std::memory_order_release, std::memory_order_relaxed));
     }
 
-    void freeAIOBuffer(uint8_t* ptr)
+    AIOMagazine* pop()
     {
-        if(ptr == nullptr) {
-            return;
+        uint64_t head = this->m_head.load(std::memory_order_acquire);
+        while(AIOMagazineStack::ptrOf(head) != nullptr) {
+            AIOMagazine* mag = AIOMagazineStack::ptrOf(head);
+            uint64_t nhead = AIOMagazineStack::pack(mag->m_next.load(std::memory_order_relaxed), AIOMagazineStack::tagOf(head) + 1);
+            if(this->m_head.compare_exchange_weak(head, nhead, std::memory_order_acquire, std::memory_order_acquire)) {
+                return mag;
+            }
         }
 
-        std::lock_guard<std::mutex> lock(this->g_pages_mutex);
+        return nullptr;
+    }
+};
+
+/**
+ * Hit counts per layer -- thread caches fold their counts in when they go to the depot so these trail the live values slightly
+ **/
+class AIOAllocatorStats
+{
+public:
+    uint64_t magazine_hits;
+    uint64_t depot_hits;
+    uint64_t slow_allocs;
+
+    uint64_t magazine_frees;
+    uint64_t depot_frees;
+};
 
-        FREE_LIST_SET_NEXT(ptr, this->m_allocs);
-        this->m_allocs = ptr;
+/**
+ * Per thread front end -- a loaded and a previous magazine per size class (so alternating alloc/free at a boundary does not thrash the depot)
+ **/
+class AIOThreadCache
+{
+public:
+    AIOMagazine* m_loaded[AIO_BUFFER_CLASS_COUNT];
+    AIOMagazine* m_previous[AIO_BUFFER_CLASS_COUNT];
+
+    uint64_t m_magazine_hits;
+    uint64_t m_magazine_frees;
+
+    AIOThreadCache(): m_loaded(), m_previous(), m_magazine_hits(0), m_magazine_frees(0) { ; }
+    ~AIOThreadCache();
+};
+
+class AIOAllocator
+{
+private:
+    AIOMagazineStack m_full[AIO_BUFFER_CLASS_COUNT];
+    AIOMagazineStack m_empty[AIO_BUFFER_CLASS_COUNT];
+
+    //backing slabs are only touched when the depot has nothing -- warmup or growth
+    std::mutex m_slab_lock;
+    AllocSlab* m_slabs[AIO_BUFFER_CLASS_COUNT];
+
+    std::atomic<uint64_t> m_magazine_hits;
+    std::atomic<uint64_t> m_depot_hits;
+    std::atomic<uint64_t> m_slow_allocs;
+    std::atomic<uint64_t> m_magazine_frees;
+    std::atomic<uint64_t> m_depot_frees;
+
+    static size_t classOf(size_t size)
+    {
+        size_t bin = std::max<size_t>(AIO_BUFFER_MIN_BIN, s_binidx(size));
+        assert(bin <= AIO_BUFFER_MAX_BIN);
+
+        return bin - AIO_BUFFER_MIN_BIN;
+    }
+
+    AIOMagazine* newMagazine(size_t cls);
+    void* m_allocate_slow(AIOThreadCache& tc, size_t cls);
+    void m_free_slow(AIOThreadCache& tc, size_t cls, void* ptr);
+    void flushCounts(AIOThreadCache& tc);
+
+public:
+    AIOAllocator();
+
+    ~AIOAllocator()
+    {
+        //slabs are owned by the page source
+        ;
     }
+
+    /**
+     * Buffers come in power of two classes from AIO_BUFFER_MIN_BIN to AIO_BUFFER_MAX_BIN (default is AIO_BUFFER_SIZE)
+     **/
+    uint8_t* allocAIOBuffer(size_t size = AIO_BUFFER_SIZE);
+    void freeAIOBuffer(uint8_t* ptr);
+
+    void releaseThreadCache(AIOThreadCache& tc);
+
+    AIOAllocatorStats getStats() const;
 };
 
 extern AIOAllocator s_aio_allocator;
-extern ServerAllocator s_allocator;
-
+extern thread_local ServerAllocator s_allocator;
@@ -0,0 +1,93 @@
+#include "capture.h"
+
+#include <fcntl.h>
+#include <sys/time.h>
+
+static bool s_capture_writeall(int fd, const void* data, size_t size)
+{
+    const uint8_t* pos = (const uint8_t*)data;
+    while(size != 0) {
+        ssize_t written = write(fd, pos, size);
+        if(written < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+
+        pos += written;
+        size -= (size_t)written;
+    }
+    return true;
+}
+
+bool RequestCapture::open(const char* path)
+{
+    this->m_fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(this->m_fd == -1) {
+        return false;
+    }
+
+    struct timeval now;
+    gettimeofday(&now, nullptr);
+
+    RequestCaptureFileHeader header = { REQUEST_CAPTURE_MAGIC, REQUEST_CAPTURE_VERSION, ((uint64_t)now.tv_sec * 1000000) + (uint64_t)now.tv_usec };
+    if(!s_capture_writeall(this->m_fd, &header, sizeof(header))) {
+        ::close(this->m_fd);
+        this->m_fd = -1;
+        return false;
+    }
+
+    this->m_base_us = s_now_us();
+    this->m_buffer = (uint8_t*)malloc(REQUEST_CAPTURE_BUFFER_SIZE);
+    this->m_used = 0;
+    this->m_records = 0;
+
+    return true;
+}
+
+void RequestCapture::close()
+{
+    if(this->m_fd == -1) {
+        return;
+    }
+
+    this->m_flush();
+    ::close(this->m_fd);
+    this->m_fd = -1;
+
+    free(this->m_buffer);
+    this->m_buffer = nullptr;
+}
+
+bool RequestCapture::m_flush()
+{
+    bool ok = s_capture_writeall(this->m_fd, this->m_buffer, this->m_used);
+    this->m_used = 0;
+
+    return ok;
+}
+
+void RequestCapture::m_append(uint64_t arrival_us, const char* data, size_t size)
+{
+    size_t total = sizeof(RequestCaptureRecord) + size;
+    if(this->m_used + total > REQUEST_CAPTURE_BUFFER_SIZE) {
+        if(!this->m_flush()) {
+            //stop capturing rather than leave a file with holes in it
+            ::close(this->m_fd);
+            this->m_fd = -1;
+
+            free(this->m_buffer);
+            this->m_buffer = nullptr;
+            return;
+        }
+    }
+
+    //requests are bounded by HTTP_MAX_REQUEST_BUFFER_SIZE so one always fits in an empty buffer
+    RequestCaptureRecord rec = { (arrival_us > this->m_base_us) ? (arrival_us - this->m_base_us) : 0, (uint32_t)size, 0 };
+    memcpy(this->m_buffer + this->m_used, &rec, sizeof(rec));
+    memcpy(this->m_buffer + this->m_used + sizeof(rec), data, size);
+
+    this->m_used += total;
+    this->m_records++;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "common.h"
+
+//Opt-in since every request is copied into the capture buffer (and the buffer is written out synchronously when it fills)
+#define ENABLE_REQUEST_CAPTURE 0
+
+#define REQUEST_CAPTURE_FILE_NAME "rshook-capture.bin"
+#define REQUEST_CAPTURE_BUFFER_SIZE ((size_t)1 << 22)
+
+#define REQUEST_CAPTURE_MAGIC 0x50414352 //"RCAP"
+#define REQUEST_CAPTURE_VERSION 1
+
+class RequestCaptureFileHeader
+{
+public:
+    uint32_t magic;
+    uint32_t version;
+    uint64_t start_realtime_us; //wall clock when the capture was opened (arrivals are relative to it)
+};
+
+//followed by size bytes of the raw request as the server read it
+class RequestCaptureRecord
+{
+public:
+    uint64_t arrival_us; //since the capture was opened
+    uint32_t size;
+    uint32_t reserved;
+};
+static_assert(sizeof(RequestCaptureRecord) == 16, "Capture records should stay compact");
+
+/**
+ * Raw request bytes with their arrival times, appended to a file for offline replay (src/tools/replay.cpp).
+ * Records are batched in memory and written when the buffer fills (or on close) -- at REQUEST_CAPTURE_BUFFER_SIZE that is one
+ * write per several thousand requests, which is fine for a diagnostic mode but is why this is off by default.
+ **/
+class RequestCapture
+{
+private:
+    int m_fd;
+    uint64_t m_base_us;
+
+    uint8_t* m_buffer;
+    size_t m_used;
+
+    uint64_t m_records;
+
+    bool m_flush();
+    void m_append(uint64_t arrival_us, const char* data, size_t size);
+
+public:
+    RequestCapture(): m_fd(-1), m_base_us(0), m_buffer(nullptr), m_used(0), m_records(0) { ; }
+    ~RequestCapture() { ; }
+
+    bool open(const char* path);
+    void close();
+
+    void record(uint64_t arrival_us, const char* data, size_t size)
+    {
+        if(this->m_fd == -1 || size == 0) {
+            return;
+        }
+
+        this->m_append(arrival_us, data, size);
+    }
+
+    uint64_t getRecordCount() const
+    {
+        return this->m_records;
+    }
+};
@@ -9,6 +9,7 @@
 #include <cstring>
 #include <cstdio>
 #include <unistd.h>
+#include <time.h>
 
 #include <thread>
 #include <stdatomic.h>
@@ -21,4 +22,14 @@
 
 #define HTTP_MAX_REQUEST_BUFFER_SIZE 8192
 
-size_t s_strlen(const char* str);
\ No newline at end of file
+size_t s_strlen(const char* str);
+
+/**
+ * Coarse monotonic clock in milliseconds -- cheap enough to call on the request path for TTL checks
+ **/
+uint64_t s_now_ms();
+
+/**
+ * Precise monotonic clock in microseconds -- for timing work (not for TTLs)
+ **/
+uint64_t s_now_us();
\ No newline at end of file
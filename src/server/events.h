@@ -2,320 +2,329 @@
 
 #include "common.h"
 #include "alloc.h"
+#include "jobs.h"
+#include "metrics.h"
+#include "trace.h"
+#include "sharedcache.h"
 
-#define RING_EVENT_IO_FILE_STAT 0x1
-#define RING_EVENT_IO_FILE_OPEN 0x2
-#define RING_EVENT_IO_FILE_READ 0x3
 #define RING_EVENT_IO_FILE_CLOSE 0x4
+#define RING_EVENT_IO_COROUTINE 0x8
 
 #define RING_EVENT_IO_CLIENT_READ 0x10
 #define RING_EVENT_IO_CLIENT_WRITE 0x20
 #define RING_EVENT_IO_CLIENT_WRITE_VECTORED 0x30
 
 #define RING_EVENT_JOB_COMPLETE 0x100
+#define RING_EVENT_JOB_SIGNAL 0x200
+#define RING_EVENT_TASK_WAIT 0x400
+
+#define IO_EVENT_SLOT_COUNT 16384
+#define IO_EVENT_SLOT_ALIGN 64
+#define IO_EVENT_SLOT_NONE 0xFFFFFFFF
+
+//user_data layout for slot events -- [generation:32][index:28][op:2][ring event type:2]
+//op separates the stage I/O from a watch (e.g. a hangup poll) that can be in flight on the same slot at the same time
+#define IO_EVENT_SLOT_OP_STAGE 0x0
+#define IO_EVENT_SLOT_OP_WATCH 0x1
+
+#define IO_EVENT_SLOT_USER_DATA_OP(IDX, GEN, OP) ((((uint64_t)(GEN)) << 32) | (((uint64_t)(IDX)) << 4) | (((uint64_t)(OP)) << 2))
+#define IO_EVENT_SLOT_USER_DATA(IDX, GEN) IO_EVENT_SLOT_USER_DATA_OP(IDX, GEN, IO_EVENT_SLOT_OP_STAGE)
+#define IO_EVENT_SLOT_INDEX(UD) ((uint32_t)(((UD) & 0xFFFFFFFF) >> 4))
+#define IO_EVENT_SLOT_GENERATION(UD) ((uint32_t)((UD) >> 32))
+#define IO_EVENT_SLOT_OP(UD) ((uint32_t)(((UD) >> 2) & 0x3))
 
 /**
- * Data structure representing the input to a route handler as extracted from the HTTP request
+ * Data structure representing the input to a route handler as extracted from the HTTP request.
+ * It sits at the start of the request's arena chunk and everything else for the request (buffers, copies) is carved from the arena.
+ * Ownership moves from stage to stage as the request progresses and the final write releases the whole thing in one step.
  **/
 class UserRequest
 {
 public:
     const int32_t client_socket;
     const char* route;
-    
-    const size_t size;
+
+    size_t size;
     const char* argdata;
 
-    UserRequest(int32_t client_socket, const char* route, size_t size, const char* argdata): client_socket(client_socket), route(route), size(size), argdata(argdata) { ; }
-    ~UserRequest() = default;
+    uint64_t start_us; //accepted
+    uint64_t read_us; //request read off the socket
+    uint64_t stage_us; //last ring submission
+    MetricRoute metric_route;
 
-    static UserRequest* create(int32_t client_socket, const char* route, size_t size, const char* argdata) 
-    {
-        return new (s_allocator.allocate<UserRequest>()) UserRequest(client_socket, route, size, argdata);
-    }
+    RequestArena arena;
+
+    UserRequest(int32_t client_socket, uint8_t* arena_start, uint8_t* arena_end): client_socket(client_socket), route(nullptr), size(0), argdata(nullptr), start_us(s_now_us()), read_us(0), stage_us(0), metric_route(MetricRoute::Other), arena(arena_start, arena_end) { ; }
+    ~UserRequest() = default;
 
-    UserRequest* clone() 
+    static UserRequest* create(int32_t client_socket)
     {
-        char* route_copy = s_allocator.strcopyp2(this->route);
-        char* argdata_copy = s_allocator.strcopyp2(this->argdata);
+        uint8_t* chunk = s_allocator.allocatebytesp2(REQUEST_ARENA_CHUNK_SIZE);
+        uint8_t* arena_start = chunk + RequestArena::alignedSize(sizeof(UserRequest));
 
-        return this->create(this->client_socket, route_copy, this->size, argdata_copy);
+        return new (chunk) UserRequest(client_socket, arena_start, chunk + REQUEST_ARENA_CHUNK_SIZE);
     }
 
-    void release() 
+    void release()
     {
-        s_allocator.freebytesp2((uint8_t*)this->route, s_strlen(this->route) + 1);
-        s_allocator.freebytesp2((uint8_t*)this->argdata, this->size);
-
-        s_allocator.freep2<UserRequest>(this);
+        this->arena.reset();
+        s_allocator.freebytesp2((uint8_t*)this, REQUEST_ARENA_CHUNK_SIZE);
     }
 };
 
-class IOEvent
+/**
+ * Per stage state -- a slot holds exactly one of these (selected by io_event_type) and is overwritten when the slot moves to the next stage
+ **/
+class IOUserRequestState
 {
 public:
-    int32_t io_event_type;
-    UserRequest* req;
-
-    IOEvent(int32_t io_event_type, UserRequest* req): io_event_type(io_event_type), req(req) { ; }
-    virtual ~IOEvent() = default;
-
-    virtual void release() = 0;
+    char* http_request_data;
 };
 
-class IOUserRequestEvent : public IOEvent
+/**
+ * A coroutine handler suspended on a ring operation -- everything else it needs lives in its frame
+ **/
+class IOCoroutineState
 {
 public:
-    char* http_request_data;
-
-    IOUserRequestEvent(UserRequest* req, char* http_request_data): IOEvent(RING_EVENT_IO_CLIENT_READ, req), http_request_data(http_request_data) { ; }
-    virtual ~IOUserRequestEvent() = default;
-
-    static IOUserRequestEvent* create(UserRequest* req, char* http_request_data)
-    {
-        return new (s_allocator.allocate<IOUserRequestEvent>()) IOUserRequestEvent(req, http_request_data);
-    }
-
-    void release() override
-    {
-        if(this->req != nullptr) {
-            this->req->release();
-        }
-
-        s_allocator.freebytesp2((uint8_t*)this->http_request_data, HTTP_MAX_REQUEST_BUFFER_SIZE);
-        s_allocator.freep2<IOUserRequestEvent>(this);
-    }
+    void* frame; //coroutine handle address to resume on completion
+    int32_t res;
+    MetricStage stage;
 };
 
-class IOFileStatEvent : public IOEvent
+class IOFileCloseState
 {
 public:
-    const char* file_path;
-    struct statx stat_buf;
-
-    const bool memoize;
-
-    IOFileStatEvent(UserRequest* req, const char* file_path, bool memoize): IOEvent(RING_EVENT_IO_FILE_STAT, req), file_path(file_path), stat_buf(), memoize(memoize) { ; }
-    virtual ~IOFileStatEvent() = default;
-
-    static IOFileStatEvent* create(IOUserRequestEvent* ure, const char* file_path, bool memoize)
-    {
-        auto req = ure->req;
-        ure->req = nullptr; //transfer ownership
-
-        return new (s_allocator.allocate<IOFileStatEvent>()) IOFileStatEvent(req, file_path, memoize);
-    }
-
-    void release() override
-    {
-        if(this->req != nullptr) {
-            this->req->release();
-        }
-    
-        s_allocator.freebytesp2((uint8_t*)this->file_path, s_strlen(this->file_path) + 1);
-        s_allocator.freep2<IOFileStatEvent>(this);
-    }
+    int32_t file_fd;
 };
 
-class IOFileOpenEvent : public IOEvent
+class IOClientWriteState
 {
 public:
-    const char* file_path;
-    struct statx stat_buf;
+    size_t size;
+    const char* msg_data;
+};
 
-    const bool memoize;
+enum class IOClientWriteEventVectoredReleaseFlag : uint8_t
+{
+    None,
+    AIO,
+    SharedBlob //pinned SharedFileCacheBlob body -- unpinned when the write completes
+};
 
-    IOFileOpenEvent(UserRequest* req, const char* file_path, struct statx stat_buf, bool memoize): IOEvent(RING_EVENT_IO_FILE_OPEN, req), file_path(file_path), stat_buf(stat_buf), memoize(memoize) { ; }
-    virtual ~IOFileOpenEvent() = default;
+class IOClientWriteVectoredState
+{
+public:
+    IOClientWriteEventVectoredReleaseFlag iov_release[2];
+    struct iovec iov[2];
+};
 
-    static IOFileOpenEvent* create(IOFileStatEvent* fse, struct statx stat_buf, bool memoize)
-    {
-        auto req = fse->req;
-        auto fpath = fse->file_path;
+/**
+ * A request waiting on the worker pool -- there is no SQE in flight for it, the pending count is held until the job is posted back
+ **/
+class IOJobState
+{
+public:
+    JobDescriptor* job; //in the request arena -- the result buffer is released with the slot
 
-        fse->req = nullptr; //transfer ownership
-        fse->file_path = nullptr;
+    const char* memo_key; //route + canonical arguments for deterministic routes (nullptr otherwise)
+    uint64_t memo_hash;
 
-        return new (s_allocator.allocate<IOFileOpenEvent>()) IOFileOpenEvent(req, fpath, stat_buf, memoize);
-    }
+    bool watching; //hangup poll armed on the client socket
+    bool client_gone; //client hung up -- the job was cancelled and the socket is already closed
+};
 
-    void release() override
-    {
-        if(this->req != nullptr) {
-            this->req->release();
-        }
-        
-        s_allocator.freebytesp2((uint8_t*)this->file_path, s_strlen(this->file_path) + 1);
-        s_allocator.freep2<IOFileOpenEvent>(this);
-    }
+/**
+ * The one long lived read on the job completion eventfd
+ **/
+class IOJobSignalState
+{
+public:
+    uint64_t value;
 };
 
-class IOFileReadEvent : public IOEvent
+/**
+ * A long-poll status request parked on a running task -- the timeout (on the watch op) answers it if the task does not finish first
+ **/
+class IOTaskWaitState
 {
 public:
-    const char* file_path;
-    int32_t file_fd;
+    uint64_t task_id;
+    struct __kernel_timespec timeout; //read by the kernel when the timeout SQE is submitted
+};
 
-    size_t size;
-    char* file_data;
+/**
+ * One in-flight pipeline (usually one request) -- cqe->user_data carries the slot index and generation so stale completions can be spotted.
+ * A slot stays live while it has pending submissions and is released (non-virtually, by stage type) once the last one completes.
+ **/
+class alignas(IO_EVENT_SLOT_ALIGN) IOEventSlot
+{
+public:
+    uint32_t generation;
+    uint32_t index;
 
-    bool memoize;
+    int32_t io_event_type;
+    uint16_t pending;
 
-    IOFileReadEvent(UserRequest* req, const char* file_path, int32_t file_fd, size_t size, char* file_data, bool memoize): IOEvent(RING_EVENT_IO_FILE_READ, req), file_path(file_path), file_fd(file_fd), size(size), file_data(file_data), memoize(memoize) { ; }
-    virtual ~IOFileReadEvent() = default;
+    UserRequest* req;
 
-    static IOFileReadEvent* create(IOFileOpenEvent* foe, int file_descriptor, size_t size, char* file_data, bool memoize)
+    union {
+        IOUserRequestState user_request;
+        IOCoroutineState coroutine;
+        IOFileCloseState file_close;
+        IOClientWriteState write;
+        IOClientWriteVectoredState write_vectored;
+        IOJobState job;
+        IOJobSignalState job_signal;
+        IOTaskWaitState task_wait;
+        uint32_t next_free;
+    } as;
+
+    uint64_t user_data() const
     {
-        auto req = foe->req;
-        auto fpath = foe->file_path;
-        auto ffd = file_descriptor;
-
-        foe->req = nullptr; //transfer ownership
-        foe->file_path = nullptr;
-
-        return new (s_allocator.allocate<IOFileReadEvent>()) IOFileReadEvent(req, fpath, ffd, size, file_data, memoize);
+        return IO_EVENT_SLOT_USER_DATA(this->index, this->generation);
     }
 
-    void release() override
+    uint64_t watch_user_data() const
     {
-        if(this->req != nullptr) {
-            this->req->release();
-        }
-
-        s_allocator.freebytesp2((uint8_t*)this->file_path, s_strlen(this->file_path) + 1);
-        s_allocator.freebytesp2((uint8_t*)this->file_data, this->size + 1); //has a null terminator
-        s_allocator.freep2<IOFileReadEvent>(this);
+        return IO_EVENT_SLOT_USER_DATA_OP(this->index, this->generation, IO_EVENT_SLOT_OP_WATCH);
     }
-};
-
-class IOFileCloseEvent : public IOEvent
-{
-public:
-    const char* file_path;
-
-    IOFileCloseEvent(UserRequest* req, const char* file_path): IOEvent(RING_EVENT_IO_FILE_CLOSE, req), file_path(file_path) { ; }
-    virtual ~IOFileCloseEvent() = default;
 
-    static IOFileCloseEvent* create(IOFileReadEvent* fre)
+    UserRequest* transfer_req()
     {
-        auto req = fre->req;
-        auto fpath = fre->file_path;
+        auto req = this->req;
+        this->req = nullptr; //transfer ownership
 
-        fre->req = nullptr; //transfer ownership
-        fre->file_path = nullptr;
+        return req;
+    }
 
-        return new (s_allocator.allocate<IOFileCloseEvent>()) IOFileCloseEvent(req, fpath);
+    /**
+     * Move the slot on to the next stage -- the caller fills in the state for the new type
+     **/
+    void rearm(int32_t io_event_type)
+    {
+        this->io_event_type = io_event_type;
     }
 
-    void release() override
+    void release()
     {
+        switch(this->io_event_type) {
+            case RING_EVENT_IO_CLIENT_WRITE_VECTORED: {
+                //buffers are either static, cache owned, in the arena, AIO buffers that need to go back to their allocator, or pinned shared cache blobs
+                for (int i = 0; i < 2; i++) {
+                    if(this->as.write_vectored.iov_release[i] == IOClientWriteEventVectoredReleaseFlag::AIO) {
+                        s_aio_allocator.freeAIOBuffer((uint8_t*)this->as.write_vectored.iov[i].iov_base);
+                    }
+                    else if(this->as.write_vectored.iov_release[i] == IOClientWriteEventVectoredReleaseFlag::SharedBlob) {
+                        SharedFileCacheBlob::fromData(this->as.write_vectored.iov[i].iov_base)->unpin();
+                    }
+                }
+                break;
+            }
+            case RING_EVENT_JOB_COMPLETE: {
+                s_aio_allocator.freeAIOBuffer(this->as.job.job->result);
+                break;
+            }
+            default: {
+                //everything else is in the request arena or not owned
+                break;
+            }
+        }
+
         if(this->req != nullptr) {
             this->req->release();
+            this->req = nullptr;
         }
-
-        s_allocator.freebytesp2((uint8_t*)this->file_path, s_strlen(this->file_path) + 1);
-        s_allocator.freep2<IOFileCloseEvent>(this);
     }
 };
+static_assert(sizeof(IOEventSlot) == IO_EVENT_SLOT_ALIGN, "Event slots should be one cache line");
 
-class IOClientWriteEvent : public IOEvent
+/**
+ * Preallocated pool of event slots for one ring
+ **/
+class IOEventSlotTable
 {
-public:
-    size_t size;
-    const char* msg_data;
+private:
+    IOEventSlot* m_slots;
+    uint32_t m_free_head;
+    uint32_t m_inuse;
 
-    IOClientWriteEvent(UserRequest* req, size_t size, const char* msg_data): IOEvent(RING_EVENT_IO_CLIENT_WRITE, req), size(size), msg_data(msg_data) { ; }
-    virtual ~IOClientWriteEvent() = default;
+public:
+    IOEventSlotTable(): m_slots(nullptr), m_free_head(IO_EVENT_SLOT_NONE), m_inuse(0) { ; }
 
-    static IOClientWriteEvent* create(UserRequest* req, size_t size, const char* msg_data)
+    void initialize()
     {
-        return new (s_allocator.allocate<IOClientWriteEvent>()) IOClientWriteEvent(req, size, msg_data);
+        this->m_slots = (IOEventSlot*)s_allocator.allocatebytesp2(IO_EVENT_SLOT_COUNT * sizeof(IOEventSlot));
+        assert(((uintptr_t)this->m_slots) % IO_EVENT_SLOT_ALIGN == 0);
+
+        for(uint32_t i = 0; i < IO_EVENT_SLOT_COUNT; ++i) {
+            IOEventSlot* slot = new (this->m_slots + i) IOEventSlot();
+            slot->generation = 0;
+            slot->index = i;
+            slot->io_event_type = 0;
+            slot->pending = 0;
+            slot->req = nullptr;
+            slot->as.next_free = (i + 1 < IO_EVENT_SLOT_COUNT) ? (i + 1) : IO_EVENT_SLOT_NONE;
+        }
+
+        this->m_free_head = 0;
+        this->m_inuse = 0;
     }
 
-    void release() override
+    /**
+     * Take a free slot for a new pipeline (returns nullptr if the table is exhausted)
+     **/
+    IOEventSlot* acquire(int32_t io_event_type, UserRequest* req)
     {
-        if(this->req != nullptr) {
-            this->req->release();
+        if(this->m_free_head == IO_EVENT_SLOT_NONE) {
+            return nullptr;
         }
-        
-        //msg data in this case is always owned by others
-        s_allocator.freep2<IOClientWriteEvent>(this);
-    }
-};
 
-enum class IOClientWriteEventVectoredReleaseFlag
-{
-    None,
-    Std,
-    AIO
-};
+        IOEventSlot* slot = this->m_slots + this->m_free_head;
+        this->m_free_head = slot->as.next_free;
+        this->m_inuse++;
 
-class IOClientWriteEventVectored : public IOEvent
-{
-public:
-    std::pair<IOClientWriteEventVectoredReleaseFlag, int32_t> iov_release[2];
-    struct iovec iov[2];
+        slot->io_event_type = io_event_type;
+        slot->pending = 0;
+        slot->req = req;
 
-    IOClientWriteEventVectored(UserRequest* req): IOEvent(RING_EVENT_IO_CLIENT_WRITE_VECTORED, req) { ; }
-    virtual ~IOClientWriteEventVectored() = default;
+        return slot;
+    }
 
-    static IOClientWriteEventVectored* create(UserRequest* req)
+    void release(IOEventSlot* slot)
     {
-        return new (s_allocator.allocate<IOClientWriteEventVectored>()) IOClientWriteEventVectored(req);
+        assert(slot->pending == 0);
+        s_trace_event(RingTraceKind::Release, slot->index, slot->generation, slot->io_event_type, 0, 0);
+        slot->release();
+
+        //bump the generation so any late completion carrying the old user_data is ignored
+        slot->generation++;
+        slot->io_event_type = 0;
+        slot->as.next_free = this->m_free_head;
+        this->m_free_head = slot->index;
+        this->m_inuse--;
     }
 
-    void release() override
+    /**
+     * Map a completion back to its slot -- nullptr if the slot has since been released (stale generation)
+     **/
+    IOEventSlot* lookup(uint64_t user_data)
     {
-        if(this->req != nullptr) {
-            this->req->release();
+        uint32_t idx = IO_EVENT_SLOT_INDEX(user_data);
+        if(idx >= IO_EVENT_SLOT_COUNT) {
+            return nullptr;
         }
 
-        for (int i = 0; i < 2; i++) {
-            if (this->iov_release[i].first == IOClientWriteEventVectoredReleaseFlag::None) {
-                ;
-            }
-            else {
-                if(this->iov_release[i].first == IOClientWriteEventVectoredReleaseFlag::Std) {
-                    s_allocator.freebytesp2((uint8_t*)this->iov[i].iov_base, this->iov_release[i].second);
-                }
-                else if(this->iov_release[i].first == IOClientWriteEventVectoredReleaseFlag::AIO) {
-                    s_aio_allocator.freeAIOBuffer((uint8_t*)this->iov[i].iov_base);
-                }
-            }
+        IOEventSlot* slot = this->m_slots + idx;
+        if(slot->generation != IO_EVENT_SLOT_GENERATION(user_data)) {
+            return nullptr;
         }
-        s_allocator.freep2<IOClientWriteEventVectored>(this);
-    }
-};
 
-class IOJobCompleteEvent : public IOEvent
-{
-public:
-    std::thread::id m_tid;
-    int rpipe;
-    int wpipe;
-    char status[4];
-
-    size_t size;
-    uint8_t* result;
-    
-    IOJobCompleteEvent(UserRequest* req, int rpipe, int wpipe, size_t size, uint8_t* result): IOEvent(RING_EVENT_JOB_COMPLETE, req), m_tid(), rpipe(rpipe), wpipe(wpipe), status{0}, size(size), result(result) { ; }
-    virtual ~IOJobCompleteEvent() = default;
-
-    static IOJobCompleteEvent* create(IOUserRequestEvent* event, int rpipe, int wpipe)
-    {
-        auto req = event->req;
-        event->req = nullptr; //transfer ownership
-        
-        return new (s_allocator.allocate<IOJobCompleteEvent>()) IOJobCompleteEvent(req, rpipe, wpipe, 0, nullptr);
+        return slot;
     }
 
-    void release() override
+    size_t getInUseCount() const
     {
-        if(this->req != nullptr) {
-            this->req->release();
-        }
-
-        s_aio_allocator.freeAIOBuffer(this->result);
-        s_allocator.freep2<IOJobCompleteEvent>(this);
+        return this->m_inuse;
     }
 };
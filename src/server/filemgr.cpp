@@ -0,0 +1,235 @@
+#include "filemgr.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include <string>
+
+#define FILE_CACHE_SNAPSHOT_MAGIC "RSHKSNAP"
+#define FILE_CACHE_SNAPSHOT_VERSION 1
+#define FILE_CACHE_SNAPSHOT_ALIGN 16
+
+/**
+ * Snapshot layout (all offsets are from the start of the file):
+ *   [FileCacheSnapshotHeader][FileCacheSnapshotIndexEntry x entry_count][bodies and headers, each 16 byte aligned and null terminated]
+ **/
+struct FileCacheSnapshotHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_count;
+    uint64_t file_size;
+    uint64_t index_offset;
+};
+
+struct FileCacheSnapshotIndexEntry
+{
+    char path[SMALL_CACHE_PATH];
+    uint64_t path_len;
+
+    int64_t mtime_sec;
+    uint64_t mtime_nsec;
+
+    uint64_t data_offset;
+    uint64_t data_size;
+
+    uint64_t header_offset;
+    uint64_t header_size;
+};
+
+static size_t s_snapalign(size_t offset)
+{
+    return (offset + (FILE_CACHE_SNAPSHOT_ALIGN - 1)) & ~((size_t)FILE_CACHE_SNAPSHOT_ALIGN - 1);
+}
+
+static bool s_writeall(int fd, const void* data, size_t size, size_t& offset)
+{
+    const char* curr = (const char*)data;
+    size_t remaining = size;
+    while(remaining != 0) {
+        ssize_t wb = write(fd, curr, remaining);
+        if(wb <= 0) {
+            return false;
+        }
+
+        curr += wb;
+        remaining -= wb;
+    }
+
+    offset += size;
+    return true;
+}
+
+static bool s_writepadding(int fd, size_t& offset)
+{
+    static const char zeros[FILE_CACHE_SNAPSHOT_ALIGN] = { 0 };
+    return s_writeall(fd, zeros, s_snapalign(offset) - offset, offset);
+}
+
+void FileCacheManager::clear()
+{
+    for(auto& pair : this->memoizedsmall) {
+        const FileCachePermanentEntry& entry = pair.second;
+        if(entry.m_owned) {
+            s_allocator.freebytesp2((uint8_t*)entry.m_data, entry.m_size + 1);
+            s_allocator.freebytesp2((uint8_t*)entry.m_header, entry.m_header_size + 1);
+        }
+    }
+    this->memoizedsmall.clear();
+    this->missingsmall.clear();
+
+    if(this->m_snapshot_base != nullptr) {
+        munmap(this->m_snapshot_base, this->m_snapshot_size);
+        this->m_snapshot_base = nullptr;
+        this->m_snapshot_size = 0;
+    }
+}
+
+bool FileCacheManager::saveSnapshot(const char* snap_path) const
+{
+    //write to a temp file and rename so a crash mid-write never leaves a torn snapshot in place
+    std::string tmp_path = std::string(snap_path) + ".tmp";
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+        return false;
+    }
+
+    FileCacheSnapshotHeader hdr;
+    memset(&hdr, 0, sizeof(FileCacheSnapshotHeader));
+    memcpy(hdr.magic, FILE_CACHE_SNAPSHOT_MAGIC, sizeof(hdr.magic));
+    hdr.version = FILE_CACHE_SNAPSHOT_VERSION;
+    hdr.entry_count = (uint32_t)this->memoizedsmall.size();
+    hdr.index_offset = sizeof(FileCacheSnapshotHeader);
+
+    //lay out the index first so we know every offset before writing anything
+    std::vector<FileCacheSnapshotIndexEntry> index(this->memoizedsmall.size());
+    size_t offset = s_snapalign(hdr.index_offset + (index.size() * sizeof(FileCacheSnapshotIndexEntry)));
+
+    size_t pos = 0;
+    for(auto& pair : this->memoizedsmall) {
+        FileCacheSnapshotIndexEntry& ie = index[pos++];
+        memset(&ie, 0, sizeof(FileCacheSnapshotIndexEntry));
+
+        strncpy(ie.path, pair.first.getPath(), SMALL_CACHE_PATH);
+        ie.path_len = pair.first.getLength();
+        ie.mtime_sec = pair.second.m_mtime.tv_sec;
+        ie.mtime_nsec = pair.second.m_mtime.tv_nsec;
+
+        ie.data_offset = offset;
+        ie.data_size = pair.second.m_size;
+        offset = s_snapalign(offset + ie.data_size + 1);
+
+        ie.header_offset = offset;
+        ie.header_size = pair.second.m_header_size;
+        offset = s_snapalign(offset + ie.header_size + 1);
+    }
+    hdr.file_size = offset;
+
+    size_t written = 0;
+    bool ok = s_writeall(fd, &hdr, sizeof(FileCacheSnapshotHeader), written);
+    ok = ok && s_writeall(fd, index.data(), index.size() * sizeof(FileCacheSnapshotIndexEntry), written);
+    ok = ok && s_writepadding(fd, written);
+
+    for(auto& pair : this->memoizedsmall) {
+        const FileCachePermanentEntry& entry = pair.second;
+
+        ok = ok && s_writeall(fd, entry.m_data, entry.m_size, written);
+        ok = ok && s_writeall(fd, "", 1, written);
+        ok = ok && s_writepadding(fd, written);
+
+        ok = ok && s_writeall(fd, entry.m_header, entry.m_header_size, written);
+        ok = ok && s_writeall(fd, "", 1, written);
+        ok = ok && s_writepadding(fd, written);
+    }
+
+    ok = ok && (written == hdr.file_size) && (fsync(fd) == 0);
+    close(fd);
+
+    if(!ok || rename(tmp_path.c_str(), snap_path) != 0) {
+        unlink(tmp_path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+size_t FileCacheManager::loadSnapshot(const char* snap_path, const char* resource_root)
+{
+    assert(this->m_snapshot_base == nullptr);
+
+    int fd = open(snap_path, O_RDONLY);
+    if(fd < 0) {
+        return 0;
+    }
+
+    struct stat sb;
+    if(fstat(fd, &sb) != 0 || (size_t)sb.st_size < sizeof(FileCacheSnapshotHeader)) {
+        close(fd);
+        return 0;
+    }
+
+    size_t msize = (size_t)sb.st_size;
+    void* base = mmap(nullptr, msize, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+
+    if(base == MAP_FAILED) {
+        return 0;
+    }
+
+    const char* cbase = (const char*)base;
+    const FileCacheSnapshotHeader* hdr = (const FileCacheSnapshotHeader*)cbase;
+
+    bool valid = memcmp(hdr->magic, FILE_CACHE_SNAPSHOT_MAGIC, sizeof(hdr->magic)) == 0;
+    valid = valid && hdr->version == FILE_CACHE_SNAPSHOT_VERSION;
+    valid = valid && hdr->file_size == msize;
+    valid = valid && hdr->index_offset == sizeof(FileCacheSnapshotHeader);
+    valid = valid && hdr->index_offset + ((size_t)hdr->entry_count * sizeof(FileCacheSnapshotIndexEntry)) <= msize;
+    if(!valid) {
+        munmap(base, msize);
+        return 0;
+    }
+
+    const FileCacheSnapshotIndexEntry* index = (const FileCacheSnapshotIndexEntry*)(cbase + hdr->index_offset);
+
+    size_t installed = 0;
+    std::string root(resource_root);
+    for(uint32_t i = 0; i < hdr->entry_count; ++i) {
+        const FileCacheSnapshotIndexEntry& ie = index[i];
+
+        bool inbounds = ie.path_len <= SMALL_CACHE_PATH && ie.path_len == strnlen(ie.path, SMALL_CACHE_PATH);
+        inbounds = inbounds && ie.data_offset + ie.data_size + 1 <= msize;
+        inbounds = inbounds && ie.header_offset + ie.header_size + 1 <= msize;
+        if(!inbounds) {
+            continue;
+        }
+
+        //only install entries whose backing file is unchanged since the snapshot was written
+        std::string fpath = root + std::string(ie.path, ie.path_len);
+        struct statx stx;
+        if(statx(AT_FDCWD, fpath.c_str(), AT_STATX_SYNC_AS_STAT, STATX_MTIME | STATX_SIZE, &stx) != 0) {
+            continue;
+        }
+
+        if(stx.stx_mtime.tv_sec != ie.mtime_sec || stx.stx_mtime.tv_nsec != ie.mtime_nsec || stx.stx_size != ie.data_size) {
+            continue;
+        }
+
+        FileCacheSmallKey<SMALL_CACHE_PATH> key(ie.path, ie.path_len);
+        FileCachePermanentEntry entry(cbase + ie.data_offset, ie.data_size, cbase + ie.header_offset, ie.header_size, stx.stx_mtime, false);
+
+        auto res = this->memoizedsmall.emplace(key, entry);
+        if(res.second) {
+            installed++;
+        }
+    }
+
+    if(installed == 0) {
+        munmap(base, msize);
+        return 0;
+    }
+
+    this->m_snapshot_base = base;
+    this->m_snapshot_size = msize;
+
+    return installed;
+}
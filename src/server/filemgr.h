@@ -5,9 +5,17 @@
 
 //TODO: don't want malloc so later we should do a custom implementation of this
 #include <map>
+#include <vector>
+
+#include <sys/stat.h>
+
+class UserRequest;
 
 #define SMALL_CACHE_PATH 32
 
+#define NEGATIVE_CACHE_TTL_MS 5000
+#define NEGATIVE_CACHE_MAX_ENTRIES 4096
+
 template<size_t MAX>
 class FileCacheSmallKey
 {
@@ -17,7 +25,7 @@ private:
 public:
     FileCacheSmallKey() : m_len(0), m_path{} { ; }
     FileCacheSmallKey(const char* path, size_t len) : m_len(len), m_path{} { 
-        strncpy(this->m_path, path, MAX - 1); 
+        memcpy(this->m_path, path, std::min<size_t>(len, MAX - 1)); 
     }
 
     FileCacheSmallKey(const FileCacheSmallKey& other) : m_len(other.m_len), m_path{} 
@@ -36,6 +44,9 @@ public:
         return *this;
     }
 
+    const char* getPath() const { return this->m_path; }
+    size_t getLength() const { return this->m_len; }
+
     bool operator==(const FileCacheSmallKey& other) const
     {
         if(this->m_len != other.m_len) {
@@ -71,7 +82,17 @@ public:
     const char* m_data;
     size_t m_size;
 
-    FileCachePermanentEntry(const char* data, size_t size) : m_data(data), m_size(size) { ; }
+    //Pre-rendered response headers so a hit is just a writev of two fixed buffers
+    const char* m_header;
+    size_t m_header_size;
+
+    //Modification time of the file when it was loaded -- used to validate snapshot entries on restart
+    struct statx_timestamp m_mtime;
+
+    //False when the entry points into a mapped snapshot instead of allocator memory
+    bool m_owned;
+
+    FileCachePermanentEntry(const char* data, size_t size, const char* header, size_t header_size, struct statx_timestamp mtime, bool owned) : m_data(data), m_size(size), m_header(header), m_header_size(header_size), m_mtime(mtime), m_owned(owned) { ; }
     ~FileCachePermanentEntry() { ; }
 
     FileCachePermanentEntry(const FileCachePermanentEntry& other) = default;
@@ -85,22 +106,48 @@ class FileCacheManager
 private:
     std::map<FileCacheSmallKey<SMALL_CACHE_PATH>, FileCachePermanentEntry> memoizedsmall;
 
-    //TODO: later do a memoized general and then LRU flavors
+    //In-flight loads -- the first miss on a key starts the load and later requests for the same key are parked here until it completes
+    std::map<FileCacheSmallKey<SMALL_CACHE_PATH>, std::vector<UserRequest*>> pendingsmall;
 
-public:
-    FileCacheManager() { ; }
-    ~FileCacheManager() { ; }
+    //Recently failed lookups (key -> expiry tick) so repeated probes for missing files skip the filesystem entirely
+    std::map<FileCacheSmallKey<SMALL_CACHE_PATH>, uint64_t> missingsmall;
 
-    void clear()
+    void purgeExpiredMissing(uint64_t now)
     {
-        for(auto& pair : this->memoizedsmall) {
-            const FileCachePermanentEntry& entry = pair.second;
-            s_allocator.freebytesp2((uint8_t*)entry.m_data, entry.m_size);
+        for(auto it = this->missingsmall.begin(); it != this->missingsmall.end();) {
+            if(it->second <= now) {
+                it = this->missingsmall.erase(it);
+            }
+            else {
+                ++it;
+            }
         }
-        this->memoizedsmall.clear();
     }
 
-    std::pair<const char*, size_t> tryGet(const char* path)
+    //Mapping of the snapshot loaded at startup (if any) -- entries with m_owned == false point into this
+    void* m_snapshot_base;
+    size_t m_snapshot_size;
+
+    //TODO: later do a memoized general and then LRU flavors
+
+public:
+    FileCacheManager() : m_snapshot_base(nullptr), m_snapshot_size(0) { ; }
+    ~FileCacheManager() { ; }
+
+    void clear();
+
+    /**
+     * Write the current contents (index + bodies + pre-rendered headers) to a versioned snapshot file that can be mapped on restart
+     **/
+    bool saveSnapshot(const char* snap_path) const;
+
+    /**
+     * Map a snapshot written by saveSnapshot and install every entry whose backing file under resource_root still has the recorded mtime and size.
+     * Returns the number of entries installed.
+     **/
+    size_t loadSnapshot(const char* snap_path, const char* resource_root);
+
+    const FileCachePermanentEntry* tryGet(const char* path)
     {
         size_t len = strlen(path);
         if(len <= SMALL_CACHE_PATH) {
@@ -108,10 +155,10 @@ public:
 
             auto it = this->memoizedsmall.find(key);
             if(it != this->memoizedsmall.end()) {
-                return std::make_pair(it->second.m_data, it->second.m_size);
+                return &it->second;
             }
             else {
-                return std::make_pair(nullptr, 0);
+                return nullptr;
             }
         }
         else {
@@ -119,12 +166,100 @@ public:
         }
     }
 
-    const char* put(const char* path, size_t pathsize, const char* data, size_t datasize)
+    //takes ownership of data and header -- both must be allocatebytesp2(size + 1) blocks
+    const FileCachePermanentEntry* put(const char* path, size_t pathsize, const char* data, size_t datasize, const char* header, size_t headersize, struct statx_timestamp mtime)
     {
         if(pathsize <= SMALL_CACHE_PATH) {
-            auto it = this->memoizedsmall.emplace(FileCacheSmallKey<SMALL_CACHE_PATH>{path, pathsize}, FileCachePermanentEntry{data, datasize});
+            this->missingsmall.erase(FileCacheSmallKey<SMALL_CACHE_PATH>{path, pathsize});
+            auto it = this->memoizedsmall.emplace(FileCacheSmallKey<SMALL_CACHE_PATH>{path, pathsize}, FileCachePermanentEntry{data, datasize, header, headersize, mtime, true});
+
+            return &it.first->second;
+        }
+        else {
+            assert(false); //TODO: later implement larger key caching
+        }
+    }
+
+    bool isKnownMissing(const char* path, uint64_t now)
+    {
+        size_t len = strlen(path);
+        if(len > SMALL_CACHE_PATH) {
+            return false; //only small keys are negatively cached
+        }
+
+        auto it = this->missingsmall.find(FileCacheSmallKey<SMALL_CACHE_PATH>{path, len});
+        if(it == this->missingsmall.end()) {
+            return false;
+        }
+
+        if(it->second <= now) {
+            this->missingsmall.erase(it);
+            return false;
+        }
+
+        return true;
+    }
+
+    void putMissing(const char* path, uint64_t now)
+    {
+        size_t len = strlen(path);
+        if(len > SMALL_CACHE_PATH) {
+            return;
+        }
+
+        if(this->missingsmall.size() >= NEGATIVE_CACHE_MAX_ENTRIES) {
+            this->purgeExpiredMissing(now);
+            if(this->missingsmall.size() >= NEGATIVE_CACHE_MAX_ENTRIES) {
+                return; //still full of live entries so just skip caching this one
+            }
+        }
+
+        this->missingsmall[FileCacheSmallKey<SMALL_CACHE_PATH>{path, len}] = now + NEGATIVE_CACHE_TTL_MS;
+    }
+
+    /**
+     * If a load for this path is already in flight then park the request on it (taking ownership) and return true.
+     * Otherwise mark a load as in flight and return false -- the caller is then responsible for starting the load and calling completeLoad.
+     **/
+    bool tryParkOnLoad(const char* path, UserRequest* req)
+    {
+        size_t len = strlen(path);
+        if(len <= SMALL_CACHE_PATH) {
+            FileCacheSmallKey<SMALL_CACHE_PATH> key(path, len);
+
+            auto it = this->pendingsmall.find(key);
+            if(it != this->pendingsmall.end()) {
+                it->second.push_back(req);
+                return true;
+            }
+            else {
+                this->pendingsmall.emplace(key, std::vector<UserRequest*>{});
+                return false;
+            }
+        }
+        else {
+            assert(false); //TODO: later implement larger key caching
+        }
+    }
+
+    /**
+     * Clear the in-flight marker for this path and return the parked requests (ownership goes to the caller)
+     **/
+    std::vector<UserRequest*> completeLoad(const char* path)
+    {
+        size_t len = strlen(path);
+        if(len <= SMALL_CACHE_PATH) {
+            FileCacheSmallKey<SMALL_CACHE_PATH> key(path, len);
+
+            auto it = this->pendingsmall.find(key);
+            if(it == this->pendingsmall.end()) {
+                return std::vector<UserRequest*>{};
+            }
+
+            std::vector<UserRequest*> waiters = std::move(it->second);
+            this->pendingsmall.erase(it);
 
-            return it.first->second.m_data;
+            return waiters;
         }
         else {
             assert(false); //TODO: later implement larger key caching
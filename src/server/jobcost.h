@@ -0,0 +1,128 @@
+#pragma once
+
+#include "common.h"
+#include "jobs.h"
+
+#include <unordered_map>
+
+#define ENABLE_JOB_INLINE 1
+
+#define JOB_INLINE_BUDGET_US 50 //jobs predicted to run in less than this are run on the runloop instead of being handed off
+#define JOB_COST_BUCKETS 32
+#define JOB_COST_MIN_SAMPLES 8 //classes with fewer samples than this are always offloaded (and so get measured on the pool)
+#define JOB_COST_DECAY_SAMPLES 256 //halve the counts after this many so the model tracks changes in load
+#define JOB_COST_PERCENTILE 0.9
+
+/**
+ * Log2 histogram of run times -- bucket 0 holds sub-microsecond runs and bucket b holds [2^(b-1), 2^b) us
+ **/
+class JobCostHistogram
+{
+public:
+    uint32_t m_counts[JOB_COST_BUCKETS];
+    uint32_t m_total;
+
+    JobCostHistogram(): m_counts{0}, m_total(0) { ; }
+
+    static size_t bucketOf(uint64_t us)
+    {
+        if(us == 0) {
+            return 0;
+        }
+
+        size_t b = 64 - __builtin_clzll(us);
+        return std::min<size_t>(b, JOB_COST_BUCKETS - 1);
+    }
+
+    void record(uint64_t us)
+    {
+        if(this->m_total >= JOB_COST_DECAY_SAMPLES) {
+            this->m_total = 0;
+            for(size_t i = 0; i < JOB_COST_BUCKETS; ++i) {
+                this->m_counts[i] /= 2;
+                this->m_total += this->m_counts[i];
+            }
+        }
+
+        this->m_counts[bucketOf(us)]++;
+        this->m_total++;
+    }
+
+    //upper bound (in us) of the bucket holding the given percentile
+    uint64_t percentileBound(double p) const
+    {
+        uint32_t target = (uint32_t)std::ceil(this->m_total * p);
+
+        uint32_t seen = 0;
+        for(size_t i = 0; i < JOB_COST_BUCKETS; ++i) {
+            seen += this->m_counts[i];
+            if(seen >= target) {
+                return ((uint64_t)1) << i;
+            }
+        }
+
+        return UINT64_MAX;
+    }
+};
+
+class JobCostStats
+{
+public:
+    size_t inlined;
+    size_t offloaded;
+};
+
+/**
+ * Learned cost of compute jobs, used by the runloop to decide between running a job inline and handing it to the pool.
+ *   - Jobs are classed by route (job function) and argument -- small arguments each get a class and larger ones share a class per power of two.
+ *   - Every run (inline or on a worker) is recorded and a class runs inline only once its high percentile is known to fit the budget.
+ *   - Runloop only, so no synchronization -- workers just time the run into the descriptor.
+ **/
+class JobCostModel
+{
+private:
+    std::unordered_map<uint64_t, JobCostHistogram> m_classes;
+    uint64_t m_budget_us;
+    JobCostStats m_stats;
+
+    static uint64_t classKey(JobFunction fn, int64_t arg)
+    {
+        uint64_t uarg = (uint64_t)arg;
+        uint64_t aclass = (uarg < 64) ? uarg : (64 + (63 - __builtin_clzll(uarg)));
+
+        return ((uint64_t)(uintptr_t)fn * 31) ^ aclass;
+    }
+
+public:
+    JobCostModel(): m_classes(), m_budget_us(JOB_INLINE_BUDGET_US), m_stats{0, 0} { ; }
+
+    void setBudget(uint64_t budget_us)
+    {
+        this->m_budget_us = budget_us;
+    }
+
+    bool shouldRunInline(JobFunction fn, int64_t arg)
+    {
+        auto it = this->m_classes.find(classKey(fn, arg));
+
+        bool inlined = (it != this->m_classes.end()) && (it->second.m_total >= JOB_COST_MIN_SAMPLES) && (it->second.percentileBound(JOB_COST_PERCENTILE) <= this->m_budget_us);
+        if(inlined) {
+            this->m_stats.inlined++;
+        }
+        else {
+            this->m_stats.offloaded++;
+        }
+
+        return inlined;
+    }
+
+    void record(JobFunction fn, int64_t arg, uint64_t run_us)
+    {
+        this->m_classes[classKey(fn, arg)].record(run_us);
+    }
+
+    const JobCostStats& getStats() const
+    {
+        return this->m_stats;
+    }
+};
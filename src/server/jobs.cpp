@@ -0,0 +1,421 @@
+#include "jobs.h"
+
+#include <sys/syscall.h>
+
+static_assert((JOB_DEQUE_CAPACITY & (JOB_DEQUE_CAPACITY - 1)) == 0, "Deque capacity must be a power of two");
+static_assert((JOB_INJECT_CAPACITY & (JOB_INJECT_CAPACITY - 1)) == 0, "Inject capacity must be a power of two");
+
+static void s_futex_wait(std::atomic<uint32_t>* addr, uint32_t expected)
+{
+    syscall(SYS_futex, (uint32_t*)addr, FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+}
+
+static void s_futex_wake(std::atomic<uint32_t>* addr)
+{
+    syscall(SYS_futex, (uint32_t*)addr, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+}
+
+void JobCompletionQueue::initialize()
+{
+    this->m_eventfd = eventfd(0, EFD_CLOEXEC);
+    assert(this->m_eventfd >= 0);
+}
+
+void JobCompletionQueue::close()
+{
+    if(this->m_eventfd >= 0) {
+        ::close(this->m_eventfd);
+        this->m_eventfd = -1;
+    }
+}
+
+void JobCompletionQueue::post(JobDescriptor* job)
+{
+    JobDescriptor* head = this->m_head.load(std::memory_order_relaxed);
+    do {
+        job->m_next = head;
+    } while(!this->m_head.compare_exchange_weak(head, job, std::memory_order_release, std::memory_order_relaxed));
+
+    //the runloop may already own (and free) the job here so only the queue is touched from now on
+    if(head == nullptr) {
+        uint64_t one = 1;
+        auto bw = write(this->m_eventfd, &one, sizeof(one));
+        assert(bw == sizeof(one));
+    }
+}
+
+void JobCompletionQueue::wake()
+{
+    uint64_t one = 1;
+    auto bw = write(this->m_eventfd, &one, sizeof(one));
+    (void)bw;
+}
+
+JobDescriptor* JobCompletionQueue::drain()
+{
+    JobDescriptor* stack = this->m_head.exchange(nullptr, std::memory_order_acquire);
+
+    //the list is newest first so flip it
+    JobDescriptor* ordered = nullptr;
+    while(stack != nullptr) {
+        JobDescriptor* next = stack->m_next;
+        stack->m_next = ordered;
+        ordered = stack;
+        stack = next;
+    }
+
+    return ordered;
+}
+
+JobInjectQueue::JobInjectQueue(): m_cells(), m_enqueue(0), m_dequeue(0)
+{
+    for(size_t i = 0; i < JOB_INJECT_CAPACITY; ++i) {
+        this->m_cells[i].m_seq.store(i, std::memory_order_relaxed);
+        this->m_cells[i].m_job = nullptr;
+    }
+}
+
+bool JobInjectQueue::tryPush(JobDescriptor* job)
+{
+    size_t pos = this->m_enqueue.load(std::memory_order_relaxed);
+    while(true) {
+        Cell& cell = this->m_cells[pos & (JOB_INJECT_CAPACITY - 1)];
+        size_t seq = cell.m_seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if(diff == 0) {
+            if(this->m_enqueue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                cell.m_job = job;
+                cell.m_seq.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+        }
+        else if(diff < 0) {
+            return false; //full
+        }
+        else {
+            pos = this->m_enqueue.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+JobDescriptor* JobInjectQueue::tryPop()
+{
+    size_t pos = this->m_dequeue.load(std::memory_order_relaxed);
+    while(true) {
+        Cell& cell = this->m_cells[pos & (JOB_INJECT_CAPACITY - 1)];
+        size_t seq = cell.m_seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+        if(diff == 0) {
+            if(this->m_dequeue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                JobDescriptor* job = cell.m_job;
+                cell.m_seq.store(pos + JOB_INJECT_CAPACITY, std::memory_order_release);
+                return job;
+            }
+        }
+        else if(diff < 0) {
+            return nullptr; //empty
+        }
+        else {
+            pos = this->m_dequeue.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+JobDeque::JobDeque(): m_top(0), m_bottom(0), m_buffer()
+{
+    for(size_t i = 0; i < JOB_DEQUE_CAPACITY; ++i) {
+        this->m_buffer[i].store(nullptr, std::memory_order_relaxed);
+    }
+}
+
+bool JobDeque::push(JobDescriptor* job)
+{
+    int64_t b = this->m_bottom.load(std::memory_order_relaxed);
+    int64_t t = this->m_top.load(std::memory_order_acquire);
+    if(b - t >= JOB_DEQUE_CAPACITY) {
+        return false;
+    }
+
+    this->m_buffer[b & (JOB_DEQUE_CAPACITY - 1)].store(job, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    this->m_bottom.store(b + 1, std::memory_order_relaxed);
+
+    return true;
+}
+
+JobDescriptor* JobDeque::pop()
+{
+    int64_t b = this->m_bottom.load(std::memory_order_relaxed) - 1;
+    this->m_bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = this->m_top.load(std::memory_order_relaxed);
+
+    if(t > b) {
+        //empty -- restore
+        this->m_bottom.store(b + 1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    JobDescriptor* job = this->m_buffer[b & (JOB_DEQUE_CAPACITY - 1)].load(std::memory_order_relaxed);
+    if(t == b) {
+        //last element -- race any thief for it
+        if(!this->m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            job = nullptr;
+        }
+        this->m_bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    return job;
+}
+
+JobDescriptor* JobDeque::steal()
+{
+    int64_t t = this->m_top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = this->m_bottom.load(std::memory_order_acquire);
+
+    if(t >= b) {
+        return nullptr;
+    }
+
+    JobDescriptor* job = this->m_buffer[t & (JOB_DEQUE_CAPACITY - 1)].load(std::memory_order_relaxed);
+    if(!this->m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+        return nullptr; //lost to the owner or another thief
+    }
+
+    return job;
+}
+
+JobWorker::JobWorker(JobWorkerPool* pool, uint32_t id, const CPUPlacement& placement): m_pool(pool), m_id(id), m_placement(placement), m_inject(), m_deque(), m_wake(0), m_sleeping(false), m_thread()
+{
+    ;
+}
+
+JobWorkerPool::JobWorkerPool(): m_workers(), m_count(0), m_running(false), m_next(0)
+{
+    ;
+}
+
+JobWorkerPool::~JobWorkerPool()
+{
+    this->stop();
+}
+
+void JobWorkerPool::start(const std::vector<CPUPlacement>& placement)
+{
+    size_t count = std::min<size_t>(std::max<size_t>(1, placement.size()), JOB_MAX_WORKERS);
+
+    this->m_running.store(true, std::memory_order_release);
+    this->m_count = count;
+
+    for(size_t i = 0; i < count; ++i) {
+        CPUPlacement wp = (i < placement.size()) ? placement[i] : CPUPlacement{-1, ALLOC_NODE_ANY};
+        this->m_workers[i] = new JobWorker(this, (uint32_t)i, wp);
+    }
+
+    for(size_t i = 0; i < count; ++i) {
+        JobWorker* worker = this->m_workers[i];
+        worker->m_thread = std::thread([this, worker]() { this->workerLoop(worker); });
+    }
+}
+
+void JobWorkerPool::stop()
+{
+    if(!this->m_running.exchange(false, std::memory_order_acq_rel)) {
+        return;
+    }
+
+    for(size_t i = 0; i < this->m_count; ++i) {
+        this->m_workers[i]->m_wake.fetch_add(1, std::memory_order_seq_cst);
+        s_futex_wake(&this->m_workers[i]->m_wake);
+    }
+
+    //join everyone before freeing anything since workers still running may be stealing from a peer
+    for(size_t i = 0; i < this->m_count; ++i) {
+        this->m_workers[i]->m_thread.join();
+    }
+
+    for(size_t i = 0; i < this->m_count; ++i) {
+        delete this->m_workers[i];
+        this->m_workers[i] = nullptr;
+    }
+    this->m_count = 0;
+}
+
+bool JobWorkerPool::trySubmit(JobDescriptor* job)
+{
+    if(this->m_count == 0) {
+        return false;
+    }
+
+    //round robin start but prefer a worker that is parked (it will pick the job up right away)
+    size_t start = this->m_next.fetch_add(1, std::memory_order_relaxed) % this->m_count;
+    for(size_t i = 0; i < this->m_count; ++i) {
+        JobWorker* worker = this->m_workers[(start + i) % this->m_count];
+        if(worker->m_sleeping.load(std::memory_order_relaxed) && worker->m_inject[(size_t)job->priority].tryPush(job)) {
+            this->wake(worker);
+            return true;
+        }
+    }
+
+    for(size_t i = 0; i < this->m_count; ++i) {
+        JobWorker* worker = this->m_workers[(start + i) % this->m_count];
+        if(worker->m_inject[(size_t)job->priority].tryPush(job)) {
+            this->wake(worker);
+            return true;
+        }
+    }
+
+    return false; //every queue is full -- caller decides how to shed
+}
+
+void JobWorkerPool::wake(JobWorker* worker)
+{
+    //pairs with the fence in park -- either the worker sees the new job on its recheck or we see it parked
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(worker->m_sleeping.load(std::memory_order_relaxed)) {
+        worker->m_wake.fetch_add(1, std::memory_order_seq_cst);
+        s_futex_wake(&worker->m_wake);
+    }
+}
+
+void JobWorkerPool::wakeIdlePeer(JobWorker* worker)
+{
+    for(size_t i = 1; i < this->m_count; ++i) {
+        JobWorker* peer = this->m_workers[(worker->m_id + i) % this->m_count];
+        if(peer->m_sleeping.load(std::memory_order_relaxed)) {
+            peer->m_wake.fetch_add(1, std::memory_order_seq_cst);
+            s_futex_wake(&peer->m_wake);
+            return;
+        }
+    }
+}
+
+JobDescriptor* JobWorkerPool::findWorkAt(JobWorker* worker, size_t priority)
+{
+    JobDeque& deque = worker->m_deque[priority];
+    JobInjectQueue& inject = worker->m_inject[priority];
+
+    JobDescriptor* job = deque.pop();
+    if(job != nullptr) {
+        return job;
+    }
+
+    //move a batch from our inject queue into the deque so idle peers can steal part of it
+    size_t moved = 0;
+    while(moved < JOB_INJECT_BATCH) {
+        JobDescriptor* ijob = inject.tryPop();
+        if(ijob == nullptr) {
+            break;
+        }
+
+        if(!deque.push(ijob)) {
+            job = ijob; //deque is full so just run it
+            break;
+        }
+        moved++;
+    }
+
+    if(moved > 1) {
+        this->wakeIdlePeer(worker);
+    }
+
+    if(job == nullptr && moved != 0) {
+        job = deque.pop();
+    }
+
+    if(job != nullptr) {
+        return job;
+    }
+
+    //steal -- first from peers' deques then from their inject queues
+    for(size_t i = 1; i < this->m_count; ++i) {
+        JobWorker* peer = this->m_workers[(worker->m_id + i) % this->m_count];
+        job = peer->m_deque[priority].steal();
+        if(job != nullptr) {
+            return job;
+        }
+    }
+
+    for(size_t i = 1; i < this->m_count; ++i) {
+        JobWorker* peer = this->m_workers[(worker->m_id + i) % this->m_count];
+        job = peer->m_inject[priority].tryPop();
+        if(job != nullptr) {
+            return job;
+        }
+    }
+
+    return nullptr;
+}
+
+JobDescriptor* JobWorkerPool::findWork(JobWorker* worker)
+{
+    for(size_t p = 0; p < JOB_PRIORITY_COUNT; ++p) {
+        JobDescriptor* job = this->findWorkAt(worker, p);
+        if(job != nullptr) {
+            return job;
+        }
+    }
+
+    return nullptr;
+}
+
+void JobWorkerPool::park(JobWorker* worker)
+{
+    uint32_t seen = worker->m_wake.load(std::memory_order_seq_cst);
+    worker->m_sleeping.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    //recheck after announcing so a submit that raced with us is not missed
+    if(worker->injectEmpty() && this->m_running.load(std::memory_order_acquire)) {
+        s_futex_wait(&worker->m_wake, seen);
+    }
+
+    worker->m_sleeping.store(false, std::memory_order_relaxed);
+}
+
+void JobWorkerPool::workerLoop(JobWorker* worker)
+{
+#if ENABLE_JOB_WORKER_PINNING
+    //from inside the thread so the allocator node binding (thread local) applies to this worker
+    s_place_current_thread(worker->m_placement);
+#endif
+
+    size_t idle_rounds = 0;
+    while(this->m_running.load(std::memory_order_acquire)) {
+        JobDescriptor* job = this->findWork(worker);
+        if(job == nullptr) {
+            if(++idle_rounds < JOB_SPIN_ROUNDS) {
+                std::this_thread::yield();
+            }
+            else {
+                idle_rounds = 0;
+                this->park(worker);
+            }
+            continue;
+        }
+        idle_rounds = 0;
+
+        s_trace_event(RingTraceKind::JobStart, (uint32_t)job->tag, (uint32_t)(job->tag >> 32), 0, 0, 0);
+
+        if(job->token.shouldStop()) {
+            //expired (or cancelled) while queued -- hand it straight back without running
+            job->status = job->token.stopStatus();
+        }
+        else {
+            uint64_t start = s_now_us();
+            job->status = JobStatus::Completed;
+            job->run(job);
+            job->run_us = s_now_us() - start;
+
+            s_metrics_stage(MetricStage::Job, job->run_us);
+        }
+
+        s_trace_event(RingTraceKind::JobEnd, (uint32_t)job->tag, (uint32_t)(job->tag >> 32), 0, (int32_t)job->status, 0);
+
+        //post completion last -- the runloop owns (and may free) the descriptor after this
+        job->completion->post(job);
+    }
+}
@@ -0,0 +1,274 @@
+#pragma once
+
+#include "common.h"
+#include "topology.h"
+#include "metrics.h"
+#include "trace.h"
+
+#include <atomic>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+
+#define ENABLE_JOB_WORKER_PINNING 1
+
+#define JOB_WORKER_COUNT 0 //0 means one worker per usable CPU except the runloop's
+#define JOB_MAX_WORKERS 64
+#define JOB_DEQUE_CAPACITY 1024
+#define JOB_INJECT_CAPACITY 256
+#define JOB_INJECT_BATCH 32
+#define JOB_SPIN_ROUNDS 64
+#define JOB_CACHE_LINE 64
+
+#define JOB_DEFAULT_DEADLINE_MS 10000
+
+class JobDescriptor;
+class JobCompletionQueue;
+typedef void (*JobFunction)(JobDescriptor* job);
+
+/**
+ * Scheduling classes -- workers always take the most urgent class they can find (own queues first, then stealing)
+ **/
+enum class JobPriority : uint8_t
+{
+    High = 0,
+    Normal = 1,
+    Low = 2
+};
+#define JOB_PRIORITY_COUNT 3
+
+enum class JobStatus : uint8_t
+{
+    Pending,
+    Completed,
+    Expired, //deadline passed (before or while running)
+    Cancelled //cancel() was called
+};
+
+/**
+ * Cooperative cancellation -- set by the runloop (cancel) or implied by the deadline, polled by long running job functions
+ **/
+class JobCancellationToken
+{
+private:
+    std::atomic<bool> m_cancelled;
+    uint64_t m_deadline_ms; //0 for no deadline
+
+public:
+    void initialize(uint64_t deadline_ms)
+    {
+        this->m_cancelled.store(false, std::memory_order_relaxed);
+        this->m_deadline_ms = deadline_ms;
+    }
+
+    void cancel()
+    {
+        this->m_cancelled.store(true, std::memory_order_relaxed);
+    }
+
+    bool isCancelled() const
+    {
+        return this->m_cancelled.load(std::memory_order_relaxed);
+    }
+
+    bool isExpired(uint64_t now) const
+    {
+        return this->m_deadline_ms != 0 && now >= this->m_deadline_ms;
+    }
+
+    bool shouldStop() const
+    {
+        return this->isCancelled() || this->isExpired(s_now_ms());
+    }
+
+    JobStatus stopStatus() const
+    {
+        return this->isCancelled() ? JobStatus::Cancelled : JobStatus::Expired;
+    }
+};
+
+/**
+ * One unit of compute work -- allocated by the runloop (in the request arena) and owned by the pool from submit until it is posted back.
+ * The route supplies the function, argument, priority, and deadline, the worker fills in the status, result (an AIO buffer), and size.
+ * A job whose token is already stopped when a worker picks it up is posted back without running.
+ **/
+class JobDescriptor
+{
+public:
+    JobFunction run;
+    int64_t arg;
+
+    JobPriority priority;
+    JobStatus status; //set by the worker -- a job function that gives up on the token sets it to token.stopStatus()
+    JobCancellationToken token;
+
+    uint8_t* result;
+    size_t size;
+    uint64_t run_us; //time spent in run (0 if it never ran) -- feeds the inline/offload cost model
+
+    JobCompletionQueue* completion; //where the worker posts the finished job -- it must not touch the descriptor after that
+    uint64_t tag; //opaque to the pool (the runloop stores the owning event slot user_data)
+
+    JobDescriptor* m_next;
+};
+
+/**
+ * Finished jobs headed back to one runloop -- workers push onto a lock free list and only the push that finds the list
+ * empty writes the eventfd, so the runloop gets one wakeup (and one pending read SQE) for any number of completions.
+ **/
+class JobCompletionQueue
+{
+private:
+    alignas(JOB_CACHE_LINE) std::atomic<JobDescriptor*> m_head;
+    int m_eventfd;
+
+public:
+    JobCompletionQueue(): m_head(nullptr), m_eventfd(-1) { ; }
+
+    void initialize();
+    void close();
+
+    int getEventFD() const
+    {
+        return this->m_eventfd;
+    }
+
+    //any thread
+    void post(JobDescriptor* job);
+
+    //wake the runloop with no job posted (just an eventfd write so it is safe from a signal handler)
+    void wake();
+
+    //owning runloop only -- takes everything posted so far (in completion order)
+    JobDescriptor* drain();
+};
+
+/**
+ * Bounded MPMC queue (Vyukov) used to hand jobs from the runloop(s) to a worker -- idle peers may also take from it
+ **/
+class JobInjectQueue
+{
+private:
+    class Cell
+    {
+    public:
+        std::atomic<size_t> m_seq;
+        JobDescriptor* m_job;
+    };
+
+    Cell m_cells[JOB_INJECT_CAPACITY];
+
+    alignas(JOB_CACHE_LINE) std::atomic<size_t> m_enqueue;
+    alignas(JOB_CACHE_LINE) std::atomic<size_t> m_dequeue;
+
+public:
+    JobInjectQueue();
+
+    bool tryPush(JobDescriptor* job);
+    JobDescriptor* tryPop();
+
+    bool empty() const
+    {
+        return this->m_enqueue.load(std::memory_order_acquire) == this->m_dequeue.load(std::memory_order_acquire);
+    }
+};
+
+/**
+ * Bounded Chase-Lev work-stealing deque -- the owning worker pushes/pops at the bottom and thieves steal from the top
+ **/
+class JobDeque
+{
+private:
+    alignas(JOB_CACHE_LINE) std::atomic<int64_t> m_top;
+    alignas(JOB_CACHE_LINE) std::atomic<int64_t> m_bottom;
+    alignas(JOB_CACHE_LINE) std::atomic<JobDescriptor*> m_buffer[JOB_DEQUE_CAPACITY];
+
+public:
+    JobDeque();
+
+    size_t size() const
+    {
+        int64_t b = this->m_bottom.load(std::memory_order_relaxed);
+        int64_t t = this->m_top.load(std::memory_order_relaxed);
+        return (b > t) ? (size_t)(b - t) : 0;
+    }
+
+    //owner only
+    bool push(JobDescriptor* job);
+    JobDescriptor* pop();
+
+    //any thread
+    JobDescriptor* steal();
+};
+
+class JobWorkerPool;
+
+class alignas(JOB_CACHE_LINE) JobWorker
+{
+public:
+    JobWorkerPool* m_pool;
+    uint32_t m_id;
+    CPUPlacement m_placement;
+
+    JobInjectQueue m_inject[JOB_PRIORITY_COUNT];
+    JobDeque m_deque[JOB_PRIORITY_COUNT];
+
+    bool injectEmpty() const
+    {
+        for(size_t p = 0; p < JOB_PRIORITY_COUNT; ++p) {
+            if(!this->m_inject[p].empty()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    alignas(JOB_CACHE_LINE) std::atomic<uint32_t> m_wake; //futex word -- bumped by submitters that find the worker asleep
+    std::atomic<bool> m_sleeping;
+
+    std::thread m_thread;
+
+    JobWorker(JobWorkerPool* pool, uint32_t id, const CPUPlacement& placement);
+};
+
+/**
+ * Fixed set of (optionally CPU pinned) compute workers.
+ *   - The runloop submits with trySubmit which never blocks -- it fails when every inject queue is full so the caller can shed the request.
+ *   - A worker drains its inject queue in batches into its own deque and runs from the bottom, idle workers steal from the top of peers' deques.
+ *   - Each priority class has its own queues and classes are searched strictly in order (so low priority work only runs when nothing more urgent is waiting anywhere).
+ *   - Idle workers park on a futex and are woken by submitters (or by a peer that just picked up more work than it can run).
+ **/
+class JobWorkerPool
+{
+private:
+    JobWorker* m_workers[JOB_MAX_WORKERS];
+    size_t m_count;
+
+    std::atomic<bool> m_running;
+    std::atomic<size_t> m_next;
+
+    void workerLoop(JobWorker* worker);
+    JobDescriptor* findWork(JobWorker* worker);
+    JobDescriptor* findWorkAt(JobWorker* worker, size_t priority);
+
+    void wake(JobWorker* worker);
+    void wakeIdlePeer(JobWorker* worker);
+    void park(JobWorker* worker);
+
+public:
+    JobWorkerPool();
+    ~JobWorkerPool();
+
+    /**
+     * Spawn one worker per placement (see CPUTopology::workerPlacement) -- each pins itself and allocates from its own node
+     **/
+    void start(const std::vector<CPUPlacement>& placement);
+    void stop();
+
+    bool trySubmit(JobDescriptor* job);
+
+    size_t getWorkerCount() const
+    {
+        return this->m_count;
+    }
+};
@@ -0,0 +1,165 @@
+#include "metrics.h"
+
+#include <cstdarg>
+
+#define METRICS_LINE_MAX 256
+
+//exported cumulative bucket bounds are the powers of two (they line up with the internal bucket edges so the counts are exact)
+#define METRICS_EXPORT_MAX_EXPONENT 27
+
+static const char* s_route_names[(size_t)MetricRoute::Count] = { "agentic", "task_status", "metrics", "sample", "hello", "helloname", "fib", "other" };
+static const char* s_stage_names[(size_t)MetricStage::Count] = { "stat", "open", "read", "write", "job" };
+
+static const double s_quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+MetricsRegistry s_metrics;
+thread_local MetricsShard* s_thread_metrics = nullptr;
+
+MetricsShard* MetricsRegistry::registerShard()
+{
+    MetricsShard* shard = new MetricsShard();
+
+    std::lock_guard<std::mutex> lock(this->m_lock);
+    shard->m_next = this->m_shards;
+    this->m_shards = shard;
+
+    return shard;
+}
+
+/**
+ * Scrape time merge of one histogram across shards
+ **/
+class MergedHistogram
+{
+public:
+    uint64_t m_counts[METRICS_BUCKET_COUNT];
+    uint64_t m_total;
+    uint64_t m_sum_us;
+
+    MergedHistogram(): m_counts{0}, m_total(0), m_sum_us(0) { ; }
+
+    void add(const LatencyHistogram& hist)
+    {
+        for(size_t i = 0; i < METRICS_BUCKET_COUNT; ++i) {
+            this->m_counts[i] += hist.m_counts[i].get();
+        }
+        this->m_total += hist.m_total.get();
+        this->m_sum_us += hist.m_sum_us.get();
+    }
+
+    //upper bound of the bucket holding the quantile
+    uint64_t quantile(double q) const
+    {
+        uint64_t target = (uint64_t)std::ceil(q * this->m_total);
+
+        uint64_t seen = 0;
+        for(size_t i = 0; i < METRICS_BUCKET_COUNT; ++i) {
+            seen += this->m_counts[i];
+            if(seen >= target && seen != 0) {
+                return LatencyHistogram::bucketUpperBound(i);
+            }
+        }
+
+        return 0;
+    }
+
+    //exact whenever bound ends a bucket (every power of two does)
+    uint64_t countAtOrBelow(uint64_t bound) const
+    {
+        uint64_t count = 0;
+        for(size_t i = 0; i < METRICS_BUCKET_COUNT && LatencyHistogram::bucketUpperBound(i) <= bound; ++i) {
+            count += this->m_counts[i];
+        }
+        return count;
+    }
+};
+
+static void s_append(std::string& out, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void s_append(std::string& out, const char* fmt, ...)
+{
+    char line[METRICS_LINE_MAX];
+
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+
+    out.append(line, std::min<size_t>(len, sizeof(line) - 1));
+}
+
+static void s_render_histogram(std::string& out, const char* name, const char* label, const char* value, const MergedHistogram& hist)
+{
+    for(size_t e = 0; e <= METRICS_EXPORT_MAX_EXPONENT; ++e) {
+        uint64_t bound = ((uint64_t)1) << e;
+        s_append(out, "%s_bucket{%s=\"%s\",le=\"%.6f\"} %lu\n", name, label, value, bound / 1000000.0, hist.countAtOrBelow(bound));
+    }
+    s_append(out, "%s_bucket{%s=\"%s\",le=\"+Inf\"} %lu\n", name, label, value, hist.m_total);
+    s_append(out, "%s_sum{%s=\"%s\"} %.6f\n", name, label, value, hist.m_sum_us / 1000000.0);
+    s_append(out, "%s_count{%s=\"%s\"} %lu\n", name, label, value, hist.m_total);
+}
+
+static void s_render_quantiles(std::string& out, const char* name, const char* label, const char* value, const MergedHistogram& hist)
+{
+    if(hist.m_total == 0) {
+        return;
+    }
+
+    for(size_t i = 0; i < sizeof(s_quantiles) / sizeof(s_quantiles[0]); ++i) {
+        s_append(out, "%s{%s=\"%s\",quantile=\"%g\"} %.6f\n", name, label, value, s_quantiles[i], hist.quantile(s_quantiles[i]) / 1000000.0);
+    }
+}
+
+void MetricsRegistry::render(std::string& out, const char* const* error_names, size_t error_count)
+{
+    std::lock_guard<std::mutex> lock(this->m_lock);
+
+    out += "# HELP rshook_requests_total Responses written by route.\n# TYPE rshook_requests_total counter\n";
+    for(size_t r = 0; r < (size_t)MetricRoute::Count; ++r) {
+        uint64_t total = 0;
+        for(MetricsShard* shard = this->m_shards; shard != nullptr; shard = shard->m_next) {
+            total += shard->m_requests[r].get();
+        }
+        s_append(out, "rshook_requests_total{route=\"%s\"} %lu\n", s_route_names[r], total);
+    }
+
+    out += "# HELP rshook_errors_total Error responses by error code.\n# TYPE rshook_errors_total counter\n";
+    for(size_t c = 0; c < std::min<size_t>(error_count, METRICS_MAX_ERRORS); ++c) {
+        uint64_t total = 0;
+        for(MetricsShard* shard = this->m_shards; shard != nullptr; shard = shard->m_next) {
+            total += shard->m_errors[c].get();
+        }
+        s_append(out, "rshook_errors_total{code=\"%s\"} %lu\n", error_names[c], total);
+    }
+
+    MergedHistogram routes[(size_t)MetricRoute::Count];
+    MergedHistogram stages[(size_t)MetricStage::Count];
+    for(MetricsShard* shard = this->m_shards; shard != nullptr; shard = shard->m_next) {
+        for(size_t r = 0; r < (size_t)MetricRoute::Count; ++r) {
+            routes[r].add(shard->m_request_latency[r]);
+        }
+        for(size_t s = 0; s < (size_t)MetricStage::Count; ++s) {
+            stages[s].add(shard->m_stage_latency[s]);
+        }
+    }
+
+    out += "# HELP rshook_request_duration_seconds Time from accept to response written by route.\n# TYPE rshook_request_duration_seconds histogram\n";
+    for(size_t r = 0; r < (size_t)MetricRoute::Count; ++r) {
+        s_render_histogram(out, "rshook_request_duration_seconds", "route", s_route_names[r], routes[r]);
+    }
+
+    out += "# HELP rshook_request_duration_quantile_seconds Request latency quantiles by route (bucket upper bounds).\n# TYPE rshook_request_duration_quantile_seconds gauge\n";
+    for(size_t r = 0; r < (size_t)MetricRoute::Count; ++r) {
+        s_render_quantiles(out, "rshook_request_duration_quantile_seconds", "route", s_route_names[r], routes[r]);
+    }
+
+    out += "# HELP rshook_stage_duration_seconds Time spent in each pipeline stage (ring ops from submit to completion, jobs while running).\n# TYPE rshook_stage_duration_seconds histogram\n";
+    for(size_t s = 0; s < (size_t)MetricStage::Count; ++s) {
+        s_render_histogram(out, "rshook_stage_duration_seconds", "stage", s_stage_names[s], stages[s]);
+    }
+
+    out += "# HELP rshook_stage_duration_quantile_seconds Stage latency quantiles (bucket upper bounds).\n# TYPE rshook_stage_duration_quantile_seconds gauge\n";
+    for(size_t s = 0; s < (size_t)MetricStage::Count; ++s) {
+        s_render_quantiles(out, "rshook_stage_duration_quantile_seconds", "stage", s_stage_names[s], stages[s]);
+    }
+}
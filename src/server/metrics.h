@@ -0,0 +1,174 @@
+#pragma once
+
+#include "common.h"
+
+#include <atomic>
+#include <mutex>
+#include <string>
+
+#define ENABLE_METRICS 1
+
+#define METRICS_ROUTE "/hyper-metrics"
+#define METRICS_MAX_ERRORS 8
+
+//log-linear latency buckets (in us) -- values below 2^METRICS_SUB_BITS are exact and each power of two above is split into 2^METRICS_SUB_BITS buckets (~6% precision)
+#define METRICS_SUB_BITS 4
+#define METRICS_SUB_COUNT (1 << METRICS_SUB_BITS)
+#define METRICS_MAX_EXPONENT 40
+#define METRICS_BUCKET_COUNT (METRICS_SUB_COUNT + (METRICS_MAX_EXPONENT - METRICS_SUB_BITS) * METRICS_SUB_COUNT)
+
+enum class MetricRoute : uint8_t
+{
+    Agentic,
+    TaskStatus,
+    Metrics,
+    Sample,
+    Hello,
+    HelloName,
+    Fib,
+    Other,
+    Count
+};
+
+enum class MetricStage : uint8_t
+{
+    Stat,
+    Open,
+    Read,
+    Write,
+    Job,
+    Count
+};
+
+/**
+ * Counter with a single writer (the owning thread) -- plain load/store so recording never takes a locked instruction, scrapes just read it
+ **/
+class MetricCounter
+{
+public:
+    std::atomic<uint64_t> m_value;
+
+    MetricCounter(): m_value(0) { ; }
+
+    void add(uint64_t n)
+    {
+        this->m_value.store(this->m_value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    uint64_t get() const
+    {
+        return this->m_value.load(std::memory_order_relaxed);
+    }
+};
+
+/**
+ * HDR style latency histogram (single writer) -- fixed log-linear buckets so shards merge by adding counts
+ **/
+class LatencyHistogram
+{
+public:
+    MetricCounter m_counts[METRICS_BUCKET_COUNT];
+    MetricCounter m_total;
+    MetricCounter m_sum_us;
+
+    //buckets are closed above -- bucket idx holds (bucketUpperBound(idx - 1), bucketUpperBound(idx)] so every power of two ends a bucket
+    static size_t bucketOf(uint64_t us)
+    {
+        if(us <= METRICS_SUB_COUNT) {
+            return (us == 0) ? 0 : (size_t)(us - 1);
+        }
+
+        uint64_t v = us - 1;
+        size_t e = 63 - __builtin_clzll(v);
+        if(e >= METRICS_MAX_EXPONENT) {
+            return METRICS_BUCKET_COUNT - 1;
+        }
+
+        size_t sub = (size_t)(v >> (e - METRICS_SUB_BITS)) & (METRICS_SUB_COUNT - 1);
+        return METRICS_SUB_COUNT + (e - METRICS_SUB_BITS) * METRICS_SUB_COUNT + sub;
+    }
+
+    //largest value in the bucket
+    static uint64_t bucketUpperBound(size_t idx)
+    {
+        if(idx < METRICS_SUB_COUNT) {
+            return idx + 1;
+        }
+
+        size_t e = METRICS_SUB_BITS + (idx - METRICS_SUB_COUNT) / METRICS_SUB_COUNT;
+        uint64_t sub = (idx - METRICS_SUB_COUNT) % METRICS_SUB_COUNT;
+        return (METRICS_SUB_COUNT + sub + 1) << (e - METRICS_SUB_BITS);
+    }
+
+    void record(uint64_t us)
+    {
+        this->m_counts[bucketOf(us)].add(1);
+        this->m_total.add(1);
+        this->m_sum_us.add(us);
+    }
+};
+
+/**
+ * All the metrics one thread records -- each thread gets its own (registered on first use) and scrapes sum them
+ **/
+class MetricsShard
+{
+public:
+    MetricCounter m_requests[(size_t)MetricRoute::Count];
+    LatencyHistogram m_request_latency[(size_t)MetricRoute::Count];
+    LatencyHistogram m_stage_latency[(size_t)MetricStage::Count];
+    MetricCounter m_errors[METRICS_MAX_ERRORS];
+
+    MetricsShard* m_next;
+};
+
+class MetricsRegistry
+{
+private:
+    std::mutex m_lock;
+    MetricsShard* m_shards; //threads are long lived so shards are never unlinked
+
+public:
+    MetricsRegistry(): m_lock(), m_shards(nullptr) { ; }
+
+    MetricsShard* registerShard();
+
+    /**
+     * Append everything in Prometheus text format -- error codes are indexed into the caller's name table
+     **/
+    void render(std::string& out, const char* const* error_names, size_t error_count);
+};
+
+extern MetricsRegistry s_metrics;
+extern thread_local MetricsShard* s_thread_metrics;
+
+inline MetricsShard* s_metrics_shard()
+{
+    if(s_thread_metrics == nullptr) {
+        s_thread_metrics = s_metrics.registerShard();
+    }
+    return s_thread_metrics;
+}
+
+inline void s_metrics_request(MetricRoute route, uint64_t us)
+{
+#if ENABLE_METRICS
+    MetricsShard* shard = s_metrics_shard();
+    shard->m_requests[(size_t)route].add(1);
+    shard->m_request_latency[(size_t)route].record(us);
+#endif
+}
+
+inline void s_metrics_stage(MetricStage stage, uint64_t us)
+{
+#if ENABLE_METRICS
+    s_metrics_shard()->m_stage_latency[(size_t)stage].record(us);
+#endif
+}
+
+inline void s_metrics_error(size_t code)
+{
+#if ENABLE_METRICS
+    s_metrics_shard()->m_errors[std::min<size_t>(code, METRICS_MAX_ERRORS - 1)].add(1);
+#endif
+}
@@ -0,0 +1,251 @@
+#pragma once
+
+#include "common.h"
+#include "alloc.h"
+
+#include <unordered_map>
+#include <vector>
+
+#define RESULT_CACHE_MAX_BYTES (((size_t)8) << 20)
+#define RESULT_CACHE_TTL_MS 60000
+
+class UserRequest;
+
+/**
+ * Cached output of a deterministic compute route -- one block holding the entry, its full key, and the result bytes
+ **/
+class ResultCacheEntry
+{
+public:
+    uint64_t m_hash;
+    const char* m_key;
+    size_t m_key_size;
+
+    const char* m_data;
+    size_t m_size;
+
+    uint64_t m_expires;
+
+    ResultCacheEntry* m_prev;
+    ResultCacheEntry* m_next;
+
+    size_t blockSize() const
+    {
+        return sizeof(ResultCacheEntry) + this->m_key_size + 1 + this->m_size + 1;
+    }
+};
+
+/**
+ * Memoized results for routes that opt in as deterministic.
+ *   - Keys are the route plus the canonical form of the arguments, looked up by a 64 bit hash and confirmed against the full key.
+ *   - Entries expire after a TTL and the least recently used ones are evicted to stay under the byte budget.
+ *   - Identical requests that arrive while a computation is in flight park on it (like file loads) and are answered from the one result.
+ **/
+class ResultCacheManager
+{
+private:
+    class PendingCompute
+    {
+    public:
+        uint64_t m_owner; //tag of the computation that will complete this entry
+        const char* m_key; //owned by the computing request (which outlives the pending entry)
+        size_t m_key_size;
+        std::vector<UserRequest*> m_waiters;
+    };
+
+    std::unordered_map<uint64_t, ResultCacheEntry*> m_entries;
+    std::unordered_map<uint64_t, PendingCompute> m_pending;
+
+    //LRU order -- most recently used at the head
+    ResultCacheEntry* m_head;
+    ResultCacheEntry* m_tail;
+
+    size_t m_bytes;
+    size_t m_budget;
+    uint64_t m_ttl_ms;
+
+    void unlink(ResultCacheEntry* entry)
+    {
+        if(entry->m_prev != nullptr) {
+            entry->m_prev->m_next = entry->m_next;
+        }
+        else {
+            this->m_head = entry->m_next;
+        }
+
+        if(entry->m_next != nullptr) {
+            entry->m_next->m_prev = entry->m_prev;
+        }
+        else {
+            this->m_tail = entry->m_prev;
+        }
+
+        entry->m_prev = nullptr;
+        entry->m_next = nullptr;
+    }
+
+    void pushFront(ResultCacheEntry* entry)
+    {
+        entry->m_prev = nullptr;
+        entry->m_next = this->m_head;
+        if(this->m_head != nullptr) {
+            this->m_head->m_prev = entry;
+        }
+        this->m_head = entry;
+
+        if(this->m_tail == nullptr) {
+            this->m_tail = entry;
+        }
+    }
+
+    void evict(ResultCacheEntry* entry)
+    {
+        this->unlink(entry);
+        this->m_entries.erase(entry->m_hash);
+
+        this->m_bytes -= entry->blockSize();
+        s_allocator.freebytesp2((uint8_t*)entry, entry->blockSize());
+    }
+
+    static bool keyMatches(const ResultCacheEntry* entry, const char* key, size_t keysize)
+    {
+        return entry->m_key_size == keysize && memcmp(entry->m_key, key, keysize) == 0;
+    }
+
+public:
+    ResultCacheManager(): m_entries(), m_pending(), m_head(nullptr), m_tail(nullptr), m_bytes(0), m_budget(RESULT_CACHE_MAX_BYTES), m_ttl_ms(RESULT_CACHE_TTL_MS) { ; }
+
+    ~ResultCacheManager()
+    {
+        this->clear();
+    }
+
+    //FNV-1a -- keys are short (route + canonical arguments)
+    static uint64_t hashKey(const char* key, size_t keysize)
+    {
+        uint64_t h = 14695981039346656037ull;
+        for(size_t i = 0; i < keysize; ++i) {
+            h ^= (uint8_t)key[i];
+            h *= 1099511628211ull;
+        }
+        return h;
+    }
+
+    void clear()
+    {
+        while(this->m_head != nullptr) {
+            this->evict(this->m_head);
+        }
+        assert(this->m_bytes == 0);
+    }
+
+    const ResultCacheEntry* tryGet(uint64_t hash, const char* key, size_t keysize, uint64_t now)
+    {
+        auto it = this->m_entries.find(hash);
+        if(it == this->m_entries.end() || !keyMatches(it->second, key, keysize)) {
+            return nullptr;
+        }
+
+        ResultCacheEntry* entry = it->second;
+        if(entry->m_expires <= now) {
+            this->evict(entry);
+            return nullptr;
+        }
+
+        this->unlink(entry);
+        this->pushFront(entry);
+
+        return entry;
+    }
+
+    /**
+     * Copy the result in (replacing any entry with the same hash) and evict from the cold end to stay under budget
+     **/
+    void put(uint64_t hash, const char* key, size_t keysize, const char* data, size_t datasize, uint64_t now)
+    {
+        size_t blocksize = sizeof(ResultCacheEntry) + keysize + 1 + datasize + 1;
+        if(blocksize > this->m_budget) {
+            return;
+        }
+
+        auto it = this->m_entries.find(hash);
+        if(it != this->m_entries.end()) {
+            this->evict(it->second);
+        }
+
+        while(this->m_bytes + blocksize > this->m_budget && this->m_tail != nullptr) {
+            this->evict(this->m_tail);
+        }
+
+        uint8_t* mem = s_allocator.allocatebytesp2(blocksize);
+        ResultCacheEntry* entry = (ResultCacheEntry*)mem;
+
+        char* ckey = (char*)(mem + sizeof(ResultCacheEntry));
+        memcpy(ckey, key, keysize);
+        ckey[keysize] = '\0';
+
+        char* cdata = ckey + keysize + 1;
+        memcpy(cdata, data, datasize);
+        cdata[datasize] = '\0';
+
+        entry->m_hash = hash;
+        entry->m_key = ckey;
+        entry->m_key_size = keysize;
+        entry->m_data = cdata;
+        entry->m_size = datasize;
+        entry->m_expires = now + this->m_ttl_ms;
+        entry->m_prev = nullptr;
+        entry->m_next = nullptr;
+
+        this->m_entries[hash] = entry;
+        this->pushFront(entry);
+        this->m_bytes += blocksize;
+    }
+
+    /**
+     * If an identical computation is in flight then park the request on it and return true.
+     * Otherwise record the caller (owner tag) as computing it and return false -- the caller then runs it and calls completeCompute.
+     **/
+    bool tryParkOnCompute(uint64_t hash, const char* key, size_t keysize, uint64_t owner, UserRequest* req)
+    {
+        auto it = this->m_pending.find(hash);
+        if(it == this->m_pending.end()) {
+            this->m_pending.emplace(hash, PendingCompute{owner, key, keysize, std::vector<UserRequest*>{}});
+            return false;
+        }
+
+        if(it->second.m_key_size != keysize || memcmp(it->second.m_key, key, keysize) != 0) {
+            return false; //hash collision -- just compute it separately (completeCompute ignores non-owners)
+        }
+
+        it->second.m_waiters.push_back(req);
+        return true;
+    }
+
+    bool hasWaiters(uint64_t hash, uint64_t owner) const
+    {
+        auto it = this->m_pending.find(hash);
+        return it != this->m_pending.end() && it->second.m_owner == owner && !it->second.m_waiters.empty();
+    }
+
+    /**
+     * Clear the in-flight marker (if this owner still holds it) and return the parked requests (ownership goes to the caller)
+     **/
+    std::vector<UserRequest*> completeCompute(uint64_t hash, uint64_t owner)
+    {
+        auto it = this->m_pending.find(hash);
+        if(it == this->m_pending.end() || it->second.m_owner != owner) {
+            return std::vector<UserRequest*>{};
+        }
+
+        std::vector<UserRequest*> waiters = std::move(it->second.m_waiters);
+        this->m_pending.erase(it);
+
+        return waiters;
+    }
+
+    size_t getBytes() const
+    {
+        return this->m_bytes;
+    }
+};
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "common.h"
+#include "alloc.h"
+#include "events.h"
+
+#include <coroutine>
+#include <exception>
+
+class RSHookServer;
+
+/**
+ * Return type for handlers written as coroutines over the ring -- fire and forget.
+ * The handler starts running right away (on the runloop), suspends at each co_await of a ring operation, and is resumed by the
+ * runloop when that operation's completion arrives. The frame frees itself when the handler returns.
+ * Frames come from the per-thread slab allocator (by size class) so a multi-step handler costs one pooled allocation, not one per stage.
+ **/
+class RingTask
+{
+public:
+    class promise_type
+    {
+    public:
+        static void* operator new(size_t size)
+        {
+            return s_allocator.allocatebytesp2(size);
+        }
+
+        static void operator delete(void* frame, size_t size)
+        {
+            s_allocator.freebytesp2((uint8_t*)frame, size);
+        }
+
+        RingTask get_return_object() noexcept
+        {
+            return RingTask{};
+        }
+
+        std::suspend_never initial_suspend() noexcept
+        {
+            return std::suspend_never{};
+        }
+
+        std::suspend_never final_suspend() noexcept
+        {
+            return std::suspend_never{};
+        }
+
+        void return_void() noexcept
+        {
+            ;
+        }
+
+        void unhandled_exception() noexcept
+        {
+            std::terminate();
+        }
+    };
+};
+
+/**
+ * One submitted ring operation -- co_await gives the CQE result (negative errno on failure)
+ **/
+class RingOpAwaitable
+{
+public:
+    IOEventSlot* m_slot;
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> handle) noexcept
+    {
+        //the SQE is already queued but nothing is submitted before the handler suspends back into the runloop
+        this->m_slot->as.coroutine.frame = handle.address();
+    }
+
+    int32_t await_resume() const noexcept
+    {
+        return this->m_slot->as.coroutine.res;
+    }
+};
+
+/**
+ * Ring operations for a coroutine handler -- each one queues an SQE on the handler's slot (which stays with the handler until it
+ * moves the slot on to a response write) and returns the awaitable for its completion.
+ **/
+class IOCoroutineRing
+{
+private:
+    RSHookServer* m_server;
+    IOEventSlot* m_slot;
+
+    struct io_uring_sqe* prepare(MetricStage stage);
+    RingOpAwaitable submit(struct io_uring_sqe* sqe);
+
+public:
+    IOCoroutineRing(RSHookServer* server, IOEventSlot* slot): m_server(server), m_slot(slot) { ; }
+
+    RingOpAwaitable statx(const char* path, struct statx* stat_buf);
+    RingOpAwaitable openat(const char* path, int flags);
+    RingOpAwaitable read(int fd, void* buf, unsigned size, uint64_t offset);
+};
@@ -7,8 +7,10 @@ typedef nlohmann::json json;
 
 #include <libgen.h> // For dirname
 
-#define HEADER_BUFFER_MAX 512
+//fib requests at or below this are cheap enough to jump ahead of big ones by default
+#define FIB_SMALL_VALUE 25
 #define QUEUE_DEPTH 256
+#define FILE_READ_CHUNK_MAX ((size_t)1 << 30) //largest single read submitted for a file fill (the kernel caps a read at a bit under 2GB anyway)
 
 #if ENABLE_CONSOLE_STATUS
 #define CONSOLE_STATUS_PRINT(...) printf(__VA_ARGS__)
@@ -110,140 +112,284 @@ int build_file_headers(const char* path, size_t contents_size, char* send_buffer
     return std::snprintf(send_buffer, HEADER_BUFFER_MAX, "HTTP/1.0 200 OK\r\n%s%sContent-Length: %ld\r\n\r\n", SERVER_STRING, ftype, contents_size);
 }
 
-void RSHookServer::write_user_direct(UserRequest* req, size_t size, const char* data)
+int build_task_accepted_response(uint64_t task_id, char* send_buffer)
+{
+    char body[96];
+    int body_len = std::snprintf(body, sizeof(body), "{\"task\": \"%016lx\", \"state\": \"running\"}", task_id);
+    return std::snprintf(send_buffer, HEADER_BUFFER_MAX, "HTTP/1.0 202 Accepted\r\n%sContent-Type: application/json\r\nLocation: %s%016lx\r\nRetry-After: 1\r\nContent-Length: %d\r\n\r\n%s", SERVER_STRING, TASK_STATUS_ROUTE, task_id, body_len, body);
+}
+
+struct io_uring_sqe* RSHookServer::get_sqe()
 {
     struct io_uring_sqe* sqe = io_uring_get_sqe(&this->ring);
-    IOClientWriteEvent* evt = IOClientWriteEvent::create(req, size, data);
+    if(sqe == nullptr) {
+        //submission queue is full (e.g. when fanning out to many parked requests) so flush it and retry
+        io_uring_submit(&this->ring);
+        this->submission_count = 0;
+
+        sqe = io_uring_get_sqe(&this->ring);
+    }
+
+    return sqe;
+}
+
+void RSHookServer::submit_slot(struct io_uring_sqe* sqe, IOEventSlot* slot)
+{
+    io_uring_sqe_set_data64(sqe, slot->user_data());
+    slot->pending++;
+    s_trace_event(RingTraceKind::Submit, slot->index, slot->generation, slot->io_event_type, 0, IO_EVENT_SLOT_OP_STAGE);
 
-    io_uring_prep_write(sqe, req->client_socket, data, size, 0);
-    io_uring_sqe_set_data(sqe, evt);
+    if(slot->req != nullptr) {
+        slot->req->stage_us = s_now_us();
+    }
 
     this->submission_count++; //track number of submissions for batching
 }
 
-void RSHookServer::write_user_direct_wheaders(UserRequest* req, size_t size, const char* data, const char* dkind)
+void RSHookServer::submit_slot_watch(struct io_uring_sqe* sqe, IOEventSlot* slot)
 {
-    struct io_uring_sqe* sqe = io_uring_get_sqe(&this->ring);
-    IOClientWriteEventVectored* evt = IOClientWriteEventVectored::create(req);
+    io_uring_sqe_set_data64(sqe, slot->watch_user_data());
+    slot->pending++;
+    s_trace_event(RingTraceKind::Submit, slot->index, slot->generation, slot->io_event_type, 0, IO_EVENT_SLOT_OP_WATCH);
+
+    this->submission_count++; //track number of submissions for batching
+}
+
+IOEventSlot* RSHookServer::acquire_response_slot(UserRequest* req)
+{
+    IOEventSlot* slot = this->event_slots.acquire(RING_EVENT_IO_CLIENT_WRITE, req);
+    if(slot == nullptr) {
+        //out of slots -- drop the connection rather than block the runloop
+        CONSOLE_LOG_PRINT("Event slot table exhausted -- dropping client socket %d\n", req->client_socket);
+
+        close(req->client_socket);
+        req->release();
+    }
+
+    return slot;
+}
+
+void RSHookServer::write_user_direct(IOEventSlot* slot, size_t size, const char* data)
+{
+    struct io_uring_sqe* sqe = this->get_sqe();
+
+    slot->rearm(RING_EVENT_IO_CLIENT_WRITE);
+    slot->as.write.size = size;
+    slot->as.write.msg_data = data;
+
+    io_uring_prep_write(sqe, slot->req->client_socket, data, size, 0);
+    this->submit_slot(sqe, slot);
+}
+
+void RSHookServer::write_user_direct_wheaders(IOEventSlot* slot, size_t size, const char* data, const char* dkind)
+{
+    struct io_uring_sqe* sqe = this->get_sqe();
+    UserRequest* req = slot->req;
+
+    slot->rearm(RING_EVENT_IO_CLIENT_WRITE_VECTORED);
+    IOClientWriteVectoredState& st = slot->as.write_vectored;
 
     //Set the headers as the first iovec entry
-    char* header = (char*)s_allocator.allocatebytesp2(HEADER_BUFFER_MAX);
+    char* header = (char*)req->arena.allocate(HEADER_BUFFER_MAX);
     int header_len = build_direct_user_headers(req->route, size, header, dkind);
-    evt->iov[0].iov_base = header;
-    evt->iov[0].iov_len = header_len;
-    evt->iov_release[0] = std::make_pair(IOClientWriteEventVectoredReleaseFlag::Std, header_len);
+    st.iov[0].iov_base = header;
+    st.iov[0].iov_len = header_len;
+    st.iov_release[0] = IOClientWriteEventVectoredReleaseFlag::None;
 
     //Set the contents as the second iovec entry
-    evt->iov[1].iov_base = (char*)data;
-    evt->iov[1].iov_len = size;
-    evt->iov_release[1] = std::make_pair(IOClientWriteEventVectoredReleaseFlag::None, -1);
+    st.iov[1].iov_base = (char*)data;
+    st.iov[1].iov_len = size;
+    st.iov_release[1] = IOClientWriteEventVectoredReleaseFlag::None;
 
-    io_uring_prep_writev(sqe, req->client_socket, evt->iov, 2, 0);
-    io_uring_sqe_set_data(sqe, evt);
-
-    this->submission_count++; //track number of submissions for batching
+    io_uring_prep_writev(sqe, req->client_socket, st.iov, 2, 0);
+    this->submit_slot(sqe, slot);
 }
 
 
-void RSHookServer::write_user_direct_aio_wheaders(UserRequest* req, size_t size, const char* data, const char* dkind)
+void RSHookServer::write_user_direct_aio_wheaders(IOEventSlot* slot, size_t size, const char* data, const char* dkind)
 {
-    struct io_uring_sqe* sqe = io_uring_get_sqe(&this->ring);
-    IOClientWriteEventVectored* evt = IOClientWriteEventVectored::create(req);
+    struct io_uring_sqe* sqe = this->get_sqe();
+    UserRequest* req = slot->req;
+
+    slot->rearm(RING_EVENT_IO_CLIENT_WRITE_VECTORED);
+    IOClientWriteVectoredState& st = slot->as.write_vectored;
 
     //Set the headers as the first iovec entry
-    char* header = (char*)s_allocator.allocatebytesp2(HEADER_BUFFER_MAX);
+    char* header = (char*)req->arena.allocate(HEADER_BUFFER_MAX);
     int header_len = build_direct_user_headers(req->route, size, header, dkind);
-    evt->iov[0].iov_base = header;
-    evt->iov[0].iov_len = header_len;
-    evt->iov_release[0] = std::make_pair(IOClientWriteEventVectoredReleaseFlag::Std, header_len);
+    st.iov[0].iov_base = header;
+    st.iov[0].iov_len = header_len;
+    st.iov_release[0] = IOClientWriteEventVectoredReleaseFlag::None;
 
     //Set the contents as the second iovec entry
-    evt->iov[1].iov_base = (char*)data;
-    evt->iov[1].iov_len = size;
-    evt->iov_release[1] = std::make_pair(IOClientWriteEventVectoredReleaseFlag::AIO, -1);
+    st.iov[1].iov_base = (char*)data;
+    st.iov[1].iov_len = size;
+    st.iov_release[1] = IOClientWriteEventVectoredReleaseFlag::AIO;
 
-    io_uring_prep_writev(sqe, req->client_socket, evt->iov, 2, 0);
-    io_uring_sqe_set_data(sqe, evt);
+    io_uring_prep_writev(sqe, req->client_socket, st.iov, 2, 0);
+    this->submit_slot(sqe, slot);
+}
 
-    this->submission_count++; //track number of submissions for batching
+void RSHookServer::write_user_file_contents(IOEventSlot* slot, const FileCachePermanentEntry* entry)
+{
+    struct io_uring_sqe* sqe = this->get_sqe();
+
+    slot->rearm(RING_EVENT_IO_CLIENT_WRITE_VECTORED);
+    IOClientWriteVectoredState& st = slot->as.write_vectored;
+
+    //Set the pre-rendered headers as the first iovec entry
+    st.iov[0].iov_base = (char*)entry->m_header;
+    st.iov[0].iov_len = entry->m_header_size;
+    st.iov_release[0] = IOClientWriteEventVectoredReleaseFlag::None;
+
+    //Set the contents as the second iovec entry -- both are owned by the cache
+    st.iov[1].iov_base = (char*)entry->m_data;
+    st.iov[1].iov_len = entry->m_size;
+    st.iov_release[1] = IOClientWriteEventVectoredReleaseFlag::None;
+
+    io_uring_prep_writev(sqe, slot->req->client_socket, st.iov, 2, 0);
+    this->submit_slot(sqe, slot);
 }
 
-void RSHookServer::write_user_file_contents(UserRequest* req, size_t size, const char* data, bool should_release)
+void RSHookServer::write_user_shared_file_contents(IOEventSlot* slot, SharedFileCacheBlob* blob)
 {
-    struct io_uring_sqe* sqe = io_uring_get_sqe(&this->ring);
-    IOClientWriteEventVectored* evt = IOClientWriteEventVectored::create(req);
+    struct io_uring_sqe* sqe = this->get_sqe();
 
-    //Set the headers as the first iovec entry
-    char* header = (char*)s_allocator.allocatebytesp2(HEADER_BUFFER_MAX);
-    int header_len = build_file_headers(req->route, size, header);
-    evt->iov[0].iov_base = header;
-    evt->iov[0].iov_len = header_len;
-    evt->iov_release[0] = std::make_pair(IOClientWriteEventVectoredReleaseFlag::Std, header_len);
+    slot->rearm(RING_EVENT_IO_CLIENT_WRITE_VECTORED);
+    IOClientWriteVectoredState& st = slot->as.write_vectored;
 
-    //Set the contents as the second iovec entry
-    evt->iov[1].iov_base = (char*)data;
-    evt->iov[1].iov_len = size;
-    evt->iov_release[1] = should_release ? std::make_pair(IOClientWriteEventVectoredReleaseFlag::Std, (int32_t)size) : std::make_pair(IOClientWriteEventVectoredReleaseFlag::None, -1);
+    //Set the pre-rendered headers as the first iovec entry
+    st.iov[0].iov_base = (char*)blob->m_header;
+    st.iov[0].iov_len = blob->m_header_size;
+    st.iov_release[0] = IOClientWriteEventVectoredReleaseFlag::None;
 
-    io_uring_prep_writev(sqe, req->client_socket, evt->iov, 2, 0);
-    io_uring_sqe_set_data(sqe, evt);
+    //Set the contents as the second iovec entry -- the pin keeps both alive (even if the entry is replaced) until the write completes
+    st.iov[1].iov_base = (char*)blob->m_data;
+    st.iov[1].iov_len = blob->m_size;
+    st.iov_release[1] = IOClientWriteEventVectoredReleaseFlag::SharedBlob;
 
-    this->submission_count++; //track number of submissions for batching
+    io_uring_prep_writev(sqe, slot->req->client_socket, st.iov, 2, 0);
+    this->submit_slot(sqe, slot);
 }
 
-void RSHookServer::write_user_dynamic_response(UserRequest* req, size_t size, const char* data)
+void RSHookServer::write_user_dynamic_response(IOEventSlot* slot, size_t size, const char* data)
 {
-    struct io_uring_sqe* sqe = io_uring_get_sqe(&this->ring);
-    IOClientWriteEventVectored* evt = IOClientWriteEventVectored::create(req);
+    struct io_uring_sqe* sqe = this->get_sqe();
+    UserRequest* req = slot->req;
+
+    slot->rearm(RING_EVENT_IO_CLIENT_WRITE_VECTORED);
+    IOClientWriteVectoredState& st = slot->as.write_vectored;
 
     //Set the headers as the first iovec entry
-    char* header = (char*)s_allocator.allocatebytesp2(HEADER_BUFFER_MAX);
+    char* header = (char*)req->arena.allocate(HEADER_BUFFER_MAX);
     int header_len = build_file_headers(req->route, size, header);
-    evt->iov[0].iov_base = header;
-    evt->iov[0].iov_len = header_len;
-    evt->iov_release[0] = std::make_pair(IOClientWriteEventVectoredReleaseFlag::Std, header_len);
+    st.iov[0].iov_base = header;
+    st.iov[0].iov_len = header_len;
+    st.iov_release[0] = IOClientWriteEventVectoredReleaseFlag::None;
 
     //Set the contents as the second iovec entry
-    evt->iov[1].iov_base = (char*)data;
-    evt->iov[1].iov_len = size;
-    evt->iov_release[1] = std::make_pair(IOClientWriteEventVectoredReleaseFlag::Std, (int32_t)size);
+    st.iov[1].iov_base = (char*)data;
+    st.iov[1].iov_len = size;
+    st.iov_release[1] = IOClientWriteEventVectoredReleaseFlag::None; //data is in the request arena
 
-    io_uring_prep_writev(sqe, req->client_socket, evt->iov, 2, 0);
-    io_uring_sqe_set_data(sqe, evt);
-
-    this->submission_count++; //track number of submissions for batching
+    io_uring_prep_writev(sqe, req->client_socket, st.iov, 2, 0);
+    this->submit_slot(sqe, slot);
 }
 
-void RSHookServer::handle_error_code(UserRequest* req, RSErrorCode error_code)
+void RSHookServer::send_error_code(IOEventSlot* slot, RSErrorCode error_code)
 {
-    UserRequest* req_clone = req->clone();
+    s_metrics_error((size_t)error_code);
 
     switch(error_code) {
     case RSErrorCode::MALFORMED_REQUEST:
-        this->send_static_content(req_clone, MALFORMED_REQUEST_MSG);
+        this->send_static_content(slot, MALFORMED_REQUEST_MSG);
         break;
     case RSErrorCode::UNSUPPORTED_VERB:
-        this->send_static_content(req_clone, UNSUPPORTED_VERB_MSG);
+        this->send_static_content(slot, UNSUPPORTED_VERB_MSG);
         break;
     case RSErrorCode::ROUTE_NOT_FOUND:
-        this->send_static_content(req_clone, CONTENT_404_MSG);
+        this->send_static_content(slot, CONTENT_404_MSG);
+        break;
+    case RSErrorCode::SERVICE_UNAVAILABLE:
+        this->send_static_content(slot, SERVICE_UNAVAILABLE_MSG);
+        break;
+    case RSErrorCode::GATEWAY_TIMEOUT:
+        this->send_static_content(slot, GATEWAY_TIMEOUT_MSG);
         break;
     default:
-        this->send_static_content(req_clone, INTERNAL_SERVER_ERROR_MSG);
+        this->send_static_content(slot, INTERNAL_SERVER_ERROR_MSG);
         break;
     }
 }
 
+void RSHookServer::handle_error_code(IOEventSlot* slot, RSErrorCode error_code)
+{
+    //the slot moves on to the error response write (and keeps ownership of the request)
+    this->send_error_code(slot, error_code);
+}
+
+void RSHookServer::shed_user_connect(int client_socket)
+{
+    //answer inline with the pre-rendered 503 -- no request, arena, slot, or SQE is used for shed connections
+    //drain whatever part of the request has arrived first so the close does not turn into a reset that eats the response
+    char drain[512];
+    while(recv(client_socket, drain, sizeof(drain), MSG_DONTWAIT) > 0) {
+        ;
+    }
+
+    s_metrics_error((size_t)RSErrorCode::SERVICE_UNAVAILABLE);
+
+    auto bw = send(client_socket, SERVICE_UNAVAILABLE_MSG, s_strlen(SERVICE_UNAVAILABLE_MSG), MSG_DONTWAIT | MSG_NOSIGNAL);
+    if(bw < 0) {
+        CONSOLE_LOG_PRINT("Error sending 503 to client socket %d: %s\n", client_socket, strerror(errno));
+    }
+
+    close(client_socket);
+}
+
 void RSHookServer::process_user_connect(int listen_socket)
 {
-    struct io_uring_sqe* sqe = io_uring_get_sqe(&this->ring);
-    UserRequest* req = UserRequest::create(listen_socket, nullptr, 0, nullptr);
-    IOUserRequestEvent* evt = IOUserRequestEvent::create(req, (char*)s_allocator.allocatebytesp2(HTTP_MAX_REQUEST_BUFFER_SIZE));
+    if(listen_socket < 0) {
+        CONSOLE_LOG_PRINT("Error accepting connection: %s\n", strerror(-listen_socket));
+        return;
+    }
 
-    io_uring_prep_read(sqe, listen_socket, evt->http_request_data, HTTP_MAX_REQUEST_BUFFER_SIZE, 0);
-    io_uring_sqe_set_data(sqe, evt);
+    if(this->shutdown_requested) {
+        //draining for shutdown -- only the work already in flight gets finished
+        CONSOLE_LOG_PRINT("Shutting down -- shedding client socket %d\n", listen_socket);
+        this->shed_user_connect(listen_socket);
+        return;
+    }
 
-    this->submission_count++; //track number of submissions for batching
+    //a burst of completions fills the SQ with our own batched submissions -- flush them before treating low space as overload
+    size_t sq_space = io_uring_sq_space_left(&this->ring);
+    if(sq_space < this->admission.getMinSQSpace() && this->submission_count > 0) {
+        io_uring_submit(&this->ring);
+        this->submission_count = 0;
+
+        sq_space = io_uring_sq_space_left(&this->ring);
+    }
+
+    AdmissionDecision decision = this->admission.admitConnection(this->event_slots.getInUseCount(), sq_space);
+    if(decision != AdmissionDecision::Admit) {
+        CONSOLE_LOG_PRINT("Shedding client socket %d (%d)\n", listen_socket, (int)decision);
+        this->shed_user_connect(listen_socket);
+        return;
+    }
+
+    IOEventSlot* slot = this->event_slots.acquire(RING_EVENT_IO_CLIENT_READ, nullptr);
+    if(slot == nullptr) {
+        CONSOLE_LOG_PRINT("Event slot table exhausted -- dropping client socket %d\n", listen_socket);
+        close(listen_socket);
+        return;
+    }
+
+    struct io_uring_sqe* sqe = this->get_sqe();
+    slot->req = UserRequest::create(listen_socket);
+    slot->as.user_request.http_request_data = (char*)slot->req->arena.allocate(HTTP_MAX_REQUEST_BUFFER_SIZE);
+
+    io_uring_prep_read(sqe, listen_socket, slot->as.user_request.http_request_data, HTTP_MAX_REQUEST_BUFFER_SIZE, 0);
+    this->submit_slot(sqe, slot);
 }
 
 std::pair<const char*, const char*> extractHTTPVerb(const char* http_request_data)
@@ -272,6 +418,90 @@ size_t extractHTTPContentLength(const char* http_request_data)
     return strtol(clstart + strlen("Content-Length: "), nullptr, 10);
 }
 
+const char* extractHTTPHeaderValue(const char* http_request_data, const char* header)
+{
+    const char* hstart = strstr(http_request_data, header);
+    if(hstart == nullptr) {
+        return nullptr;
+    }
+
+    return hstart + strlen(header);
+}
+
+JobPriority extractJobPriority(const char* http_request_data, JobPriority dflt)
+{
+    const char* pval = extractHTTPHeaderValue(http_request_data, "X-Priority: ");
+    if(pval == nullptr) {
+        return dflt;
+    }
+
+    if(strncmp(pval, "high", 4) == 0) {
+        return JobPriority::High;
+    }
+    else if(strncmp(pval, "low", 3) == 0) {
+        return JobPriority::Low;
+    }
+    else {
+        return JobPriority::Normal;
+    }
+}
+
+uint64_t extractJobDeadline(const char* http_request_data, uint64_t now)
+{
+    //relative deadline in ms from the client (capped at the server default)
+    uint64_t budget = JOB_DEFAULT_DEADLINE_MS;
+
+    const char* dval = extractHTTPHeaderValue(http_request_data, "X-Deadline-Ms: ");
+    if(dval != nullptr) {
+        uint64_t requested = strtoull(dval, nullptr, 10);
+        if(requested != 0) {
+            budget = std::min<uint64_t>(budget, requested);
+        }
+    }
+
+    return now + budget;
+}
+
+const char* extractPreferToken(const char* http_request_data, const char* token)
+{
+    //RFC 7240 preferences -- the token has to be on the Prefer line itself
+    const char* pval = extractHTTPHeaderValue(http_request_data, "Prefer: ");
+    if(pval == nullptr) {
+        return nullptr;
+    }
+
+    const char* pend = strstr(pval, "\r\n");
+    const char* tpos = strstr(pval, token);
+    if(tpos == nullptr || (pend != nullptr && tpos > pend)) {
+        return nullptr;
+    }
+
+    return tpos + strlen(token);
+}
+
+uint64_t extractTaskWait(const char* http_request_data)
+{
+    //Prefer: wait=<seconds> turns a status poll into a long-poll (capped at the server max)
+    const char* wval = extractPreferToken(http_request_data, "wait=");
+    if(wval == nullptr) {
+        return 0;
+    }
+
+    return std::min<uint64_t>(strtoull(wval, nullptr, 10) * 1000, TASK_MAX_WAIT_MS);
+}
+
+bool extractTaskId(const std::pair<const char*, const char*>& path, uint64_t& task_id)
+{
+    const char* idstart = path.first + strlen(TASK_STATUS_ROUTE);
+    if(idstart >= path.second) {
+        return false;
+    }
+
+    char* idend = nullptr;
+    task_id = strtoull(idstart, &idend, 16);
+    return idend == path.second;
+}
+
 std::pair<const char*, const char*> extractHTTPData(const char* http_request_data, size_t content_length)
 {
     const char* dstart = strstr(http_request_data, "\r\n\r\n") + 4;
@@ -285,20 +515,81 @@ bool pathMatchsRoute(const std::pair<const char*, const char*>& path, const char
     return (strncmp(path.first, match, path.second - path.first) == 0);
 }
 
-void RSHookServer::process_user_request(IOUserRequestEvent* event, size_t read_size)
+bool pathHasPrefix(const std::pair<const char*, const char*>& path, const char* prefix)
 {
-    event->http_request_data[read_size] = '\0'; //Null-terminate the read data
+    size_t plen = strlen(prefix);
+    return ((size_t)(path.second - path.first) >= plen) && (strncmp(path.first, prefix, plen) == 0);
+}
 
-    std::pair<const char*, const char*> verb = extractHTTPVerb(event->http_request_data);
-    std::pair<const char*, const char*> path = extractHTTPPath(event->http_request_data);
+MetricRoute classifyMetricRoute(const std::pair<const char*, const char*>& path)
+{
+    if(pathMatchsRoute(path, "/hyper-agentic.md")) {
+        return MetricRoute::Agentic;
+    }
+    else if(pathHasPrefix(path, TASK_STATUS_ROUTE)) {
+        return MetricRoute::TaskStatus;
+    }
+    else if(pathMatchsRoute(path, METRICS_ROUTE)) {
+        return MetricRoute::Metrics;
+    }
+    else if(pathMatchsRoute(path, "/sample.json")) {
+        return MetricRoute::Sample;
+    }
+    else if(pathMatchsRoute(path, "/hello")) {
+        return MetricRoute::Hello;
+    }
+    else if(pathMatchsRoute(path, "/helloname")) {
+        return MetricRoute::HelloName;
+    }
+    else if(pathMatchsRoute(path, "/fib")) {
+        return MetricRoute::Fib;
+    }
+    else {
+        return MetricRoute::Other;
+    }
+}
+
+bool job_should_stop(void* ctx)
+{
+    return ((JobDescriptor*)ctx)->token.shouldStop();
+}
+
+void run_fib_job(JobDescriptor* job)
+{
+    CONSOLE_LOG_PRINT("Job running...\n");
+
+    int64_t result_value = 0;
+    if(!fib_cancellable(job->arg, job_should_stop, job, result_value)) {
+        CONSOLE_LOG_PRINT("Job stopped early\n");
+        job->status = job->token.stopStatus();
+        return;
+    }
+
+    job->result = s_aio_allocator.allocAIOBuffer();
+    job->size = std::snprintf((char*)job->result, AIO_BUFFER_SIZE, "{\"value\": %ld}", result_value);
+
+    CONSOLE_LOG_PRINT("Job done\n");
+}
+
+void RSHookServer::process_user_request(IOEventSlot* slot, size_t read_size)
+{
+    char* http_request_data = slot->as.user_request.http_request_data;
+    http_request_data[read_size] = '\0'; //Null-terminate the read data
+    slot->req->read_us = s_now_us();
+
+    //no-op unless the capture was opened at startup (ENABLE_REQUEST_CAPTURE)
+    this->capture.record(slot->req->start_us, http_request_data, read_size);
 
-    event->req->route = s_allocator.strcopyp2(path.first, path.second - path.first);
-    event->req->argdata = nullptr;
+    std::pair<const char*, const char*> verb = extractHTTPVerb(http_request_data);
+    std::pair<const char*, const char*> path = extractHTTPPath(http_request_data);
+
+    slot->req->route = slot->req->arena.strcopy(path.first, path.second - path.first);
+    slot->req->argdata = nullptr;
+    slot->req->metric_route = classifyMetricRoute(path);
 
     //TODO: standard support for common tasks
     //    - Middleware -- auth, redirect, compression, etc.
     //    - Logging/Perf -- also TTD, and other novel diagnostics
-    //    - Status endpoints for tasks (/endpoint/hyper-status/{taskid})
     //    - Cancellation support
 
     if (strncmp(verb.first, "get", verb.second - verb.first) == 0 || strncmp(verb.first, "GET", verb.second - verb.first) == 0)
@@ -308,187 +599,896 @@ void RSHookServer::process_user_request(IOUserRequestEvent* event, size_t read_s
             //A known route for hyper-agentic description
 
             const char* response = "# Agentic Server\r\n\r\nThis is a static markdown file served by the Agentic server that describes the available operations in HATEOAS model (aka skills) -- each operation can also be queried in more detail on a sig specific info URI.\r\n";
-            this->send_static_content(event->req->clone(), response);
+            this->send_static_content(slot, response);
+        }
+        else if(pathHasPrefix(path, TASK_STATUS_ROUTE)) /*Status (and result) of an async task -- optionally long-polled*/
+        {
+            uint64_t task_id = 0;
+            if(!extractTaskId(path, task_id)) {
+                handle_error_code(slot, RSErrorCode::MALFORMED_REQUEST);
+            }
+            else {
+                this->process_task_status(slot, task_id, extractTaskWait(http_request_data));
+            }
+        }
+        else if(pathMatchsRoute(path, METRICS_ROUTE)) /*Counters and latency histograms in Prometheus text format*/
+        {
+            this->send_metrics(slot);
         }
         else if(pathMatchsRoute(path, "/sample.json")) /*Route type #1 file service -- static (permanent) files or basic caching as resources*/
         {
-            std::pair<const char*, size_t> cached_data = this->file_cache_mgr.tryGet(event->req->route);
-            if(cached_data.first != nullptr) {
-                CONSOLE_LOG_PRINT("Cache hit for %s\n", event->req->route);
-                this->send_cache_file_content(event->req->clone(), cached_data.second, cached_data.first);
+            if(this->try_send_cached_file(slot)) {
+                CONSOLE_LOG_PRINT("Cache hit for %s\n", slot->req->route);
+            }
+            else if(this->file_cache_mgr.isKnownMissing(slot->req->route, s_now_ms())) {
+                CONSOLE_LOG_PRINT("Negative cache hit for %s\n", slot->req->route);
+                handle_error_code(slot, RSErrorCode::ROUTE_NOT_FOUND);
+            }
+            else if(this->file_cache_mgr.tryParkOnLoad(slot->req->route, slot->req)) {
+                CONSOLE_LOG_PRINT("Load in flight for %s -- parking request\n", slot->req->route);
+                slot->req = nullptr; //transfer ownership to the pending load
             }
             else {
-                char* fpath = (char*)s_allocator.allocatebytesp2(s_strlen(this->resource_root) + s_strlen("/sample.json") + 1);
+                char* fpath = (char*)slot->req->arena.allocate(s_strlen(this->resource_root) + s_strlen("/sample.json") + 1);
                 sprintf(fpath, "%s%s", this->resource_root, "/sample.json");
 
-                this->process_http_file_access(event, fpath, true);
+                this->process_http_file_access(slot, fpath, true);
             }
         }
         else if(pathMatchsRoute(path, "/hello")) /* Route type #2 immediate response of fixed (small) values */
         {
             const char* response = "{\"message\": \"Hello, world!\"}";
-            this->send_immediate_fixed_content(event->req->clone(), s_strlen(response), response, "json");
+            this->send_immediate_fixed_content(slot, s_strlen(response), response, "json");
         }
         else if(pathMatchsRoute(path, "/helloname")) /* Route type #3 compute response based on input data inline with request */
         {
-            size_t datalen = extractHTTPContentLength(event->http_request_data);
+            size_t datalen = extractHTTPContentLength(http_request_data);
             if(datalen == 0) {
-                handle_error_code(event->req, RSErrorCode::MALFORMED_REQUEST);
+                handle_error_code(slot, RSErrorCode::MALFORMED_REQUEST);
             }
             else {
-                std::pair<const char*, const char*> data = extractHTTPData(event->http_request_data, datalen);
+                std::pair<const char*, const char*> data = extractHTTPData(http_request_data, datalen);
 
                 auto jpayload = json::parse(data.first, data.second, nullptr, false, false);
                 std::string name = jpayload["name"].get<std::string>();
             
-                char* sendbuff = (char*)s_allocator.allocatebytesp2(256);
+                char* sendbuff = (char*)slot->req->arena.allocate(256);
                 size_t datasize = std::snprintf(sendbuff, 256, "{\"message\": \"Hello, %s!\"}", name.c_str());
 
-                this->write_user_dynamic_response(event->req->clone(), datasize, sendbuff);
+                this->write_user_dynamic_response(slot, datasize, sendbuff);
             }
         }
         else if(pathMatchsRoute(path, "/fib")) /* Route type #4 compute response based on input data but run on thread-pool for non-blocking */
         {
             //TODO: more task specialization
-            //   - Allow priority support
-            //   - Allow for timeouts too
-            //   - Result processing options (streaming with status updates, status endpoints, or just blocking)
+            //   - Result processing options (streaming with status updates)
 
-            size_t datalen = extractHTTPContentLength(event->http_request_data);
+            size_t datalen = extractHTTPContentLength(http_request_data);
             if(datalen == 0) {
-                handle_error_code(event->req, RSErrorCode::MALFORMED_REQUEST);
+                handle_error_code(slot, RSErrorCode::MALFORMED_REQUEST);
             }
             else {
-                std::pair<const char*, const char*> data = extractHTTPData(event->http_request_data, datalen);
+                std::pair<const char*, const char*> data = extractHTTPData(http_request_data, datalen);
 
                 auto jpayload = json::parse(data.first, data.second, nullptr, false, false);
                 int64_t value = jpayload["value"].get<int64_t>();
 
-                //Compute Fibonacci (inefficiently on purpose) -- run in separate thread with callback/futex for iouring 
-                this->process_job_request(event, value);
+                //Compute Fibonacci (inefficiently on purpose) -- run on the job worker pool with completions batched back through an eventfd
+                //small values default to high priority so they are not stuck behind huge ones (X-Priority overrides)
+                JobPriority priority = extractJobPriority(http_request_data, value <= FIB_SMALL_VALUE ? JobPriority::High : JobPriority::Normal);
+                uint64_t deadline = extractJobDeadline(http_request_data, s_now_ms());
+
+                //fib is pure so results are memoized on the route + canonical (sorted key) form of the arguments
+                std::string canonical = jpayload.dump();
+                char* memo_key = (char*)slot->req->arena.allocate(s_strlen(slot->req->route) + 1 + canonical.size() + 1);
+                sprintf(memo_key, "%s?%s", slot->req->route, canonical.c_str());
+
+                if(extractPreferToken(http_request_data, "respond-async") != nullptr) {
+                    //answer 202 with a task id right away and let the client poll for the result
+                    this->process_async_job_request(slot, run_fib_job, value, priority, memo_key);
+                }
+                else {
+                    this->process_job_request(slot, run_fib_job, value, priority, deadline, memo_key);
+                }
             }
         }
         else
         {
-            handle_error_code(event->req, RSErrorCode::ROUTE_NOT_FOUND);
+            handle_error_code(slot, RSErrorCode::ROUTE_NOT_FOUND);
         }
     }
     else
     {
         /* posts here and more */
 
-        handle_error_code(event->req, RSErrorCode::UNSUPPORTED_VERB);
+        handle_error_code(slot, RSErrorCode::UNSUPPORTED_VERB);
     }
 }
 
-void RSHookServer::process_http_file_access(IOUserRequestEvent* req, const char* file_path, bool memoize)
+struct io_uring_sqe* IOCoroutineRing::prepare(MetricStage stage)
 {
-    struct io_uring_sqe* sqe = io_uring_get_sqe(&this->ring);
-    IOFileStatEvent* evt = IOFileStatEvent::create(req, file_path, memoize);
-
-    io_uring_prep_statx(sqe, AT_FDCWD, file_path, AT_STATX_SYNC_AS_STAT, STATX_ALL, &evt->stat_buf);
-    io_uring_sqe_set_data(sqe, evt);
-
-    this->submission_count++; //track number of submissions for batching
+    this->m_slot->rearm(RING_EVENT_IO_COROUTINE);
+    this->m_slot->as.coroutine.stage = stage;
+    return this->m_server->get_sqe();
 }
 
-void RSHookServer::process_fstat_result(IOFileStatEvent* event)
+RingOpAwaitable IOCoroutineRing::submit(struct io_uring_sqe* sqe)
 {
-    struct io_uring_sqe* sqe = io_uring_get_sqe(&this->ring);
-    IOFileOpenEvent* evt = IOFileOpenEvent::create(event, event->stat_buf, event->memoize);
-
-    io_uring_prep_openat(sqe, AT_FDCWD, evt->file_path, O_RDONLY | O_NONBLOCK, 0);
-    io_uring_sqe_set_data(sqe, evt);
-
-    this->submission_count++; //track number of submissions for batching
+    this->m_server->submit_slot(sqe, this->m_slot);
+    return RingOpAwaitable{this->m_slot};
 }
 
-void RSHookServer::process_fopen_result(IOFileOpenEvent* event, int file_descriptor)
+RingOpAwaitable IOCoroutineRing::statx(const char* path, struct statx* stat_buf)
 {
-    struct io_uring_sqe* sqe = io_uring_get_sqe(&this->ring);
-    IOFileReadEvent* evt = IOFileReadEvent::create(event, file_descriptor, event->stat_buf.stx_size, (char*)s_allocator.allocatebytesp2(event->stat_buf.stx_size + 1), event->memoize);
+    struct io_uring_sqe* sqe = this->prepare(MetricStage::Stat);
+    io_uring_prep_statx(sqe, AT_FDCWD, path, AT_STATX_SYNC_AS_STAT, STATX_ALL, stat_buf);
+    return this->submit(sqe);
+}
 
-    io_uring_prep_read(sqe, file_descriptor, evt->file_data, evt->size, 0);
-    io_uring_sqe_set_data(sqe, evt);
+RingOpAwaitable IOCoroutineRing::openat(const char* path, int flags)
+{
+    struct io_uring_sqe* sqe = this->prepare(MetricStage::Open);
+    io_uring_prep_openat(sqe, AT_FDCWD, path, flags, 0);
+    return this->submit(sqe);
+}
 
-    this->submission_count++; //track number of submissions for batching
+RingOpAwaitable IOCoroutineRing::read(int fd, void* buf, unsigned size, uint64_t offset)
+{
+    struct io_uring_sqe* sqe = this->prepare(MetricStage::Read);
+    io_uring_prep_read(sqe, fd, buf, size, offset);
+    return this->submit(sqe);
 }
 
-void RSHookServer::process_fread_result(IOFileReadEvent* event)
+RingTask RSHookServer::process_http_file_access(IOEventSlot* slot, const char* file_path, bool memoize)
 {
-    //Add null terminator for uniformity on the read file (note we made sure there was an extra byte allocated)
-    event->file_data[event->size] = '\0';
+    IOCoroutineRing ring(this, slot);
+    UserRequest* req = slot->req;
+
+    struct statx stat_buf;
+    int32_t res = co_await ring.statx(file_path, &stat_buf);
+    if(res < 0) {
+        CONSOLE_LOG_PRINT("Error processing file stat from client socket %d: %s\n", req->client_socket, strerror(-res));
+
+        if(res == -ENOENT || res == -ENOTDIR) {
+            //remember the miss so repeat probes get an immediate 404 without touching the filesystem
+            this->file_cache_mgr.putMissing(req->route, s_now_ms());
+            this->process_file_error(slot, memoize, RSErrorCode::ROUTE_NOT_FOUND);
+        }
+        else {
+            this->process_file_error(slot, memoize, RSErrorCode::INTERNAL_SERVER_ERROR);
+        }
+        co_return;
+    }
+
+    int32_t file_fd = co_await ring.openat(file_path, O_RDONLY | O_NONBLOCK);
+    if(file_fd < 0) {
+        CONSOLE_LOG_PRINT("Error opening file for client socket %d: %s\n", req->client_socket, strerror(-file_fd));
+        this->process_file_error(slot, memoize, RSErrorCode::INTERNAL_SERVER_ERROR);
+        co_return;
+    }
 
     ////
-    //Setup the response to the user now that we have the file data and handle any caching
-    //Right now everything is cached permanently 
-    const char* cdata = this->file_cache_mgr.put(event->req->route, s_strlen(event->req->route), s_allocator.strcopyp2(event->file_data), event->size);
-    this->send_cache_file_content(event->req->clone(), event->size, cdata);
+    //Read straight into the buffer the cache will own (sized from the stat) so the body is never copied
+    //Right now everything is cached permanently
+    size_t size = stat_buf.stx_size;
+    char header[HEADER_BUFFER_MAX];
+    int header_len = build_file_headers(req->route, size, header);
+
+    SharedFileCacheBlob* fill = nullptr;
+    char* cdata = nullptr;
+    if(this->shared_file_cache != nullptr) {
+        fill = SharedFileCacheBlob::allocate(size, header, header_len, stat_buf.stx_mtime);
+        cdata = fill->body();
+    }
+    else {
+        cdata = (char*)s_allocator.allocatebytesp2(size + 1); //room for a null terminator
+    }
+
+    //a read can come back short (the file shrank after the statx, or the kernel capped the transfer) -- the cache must never keep a partly filled buffer
+    size_t done = 0;
+    while(done < size) {
+        res = co_await ring.read(file_fd, cdata + done, (unsigned)std::min<size_t>(size - done, FILE_READ_CHUNK_MAX), done);
+        if(res <= 0) {
+            break;
+        }
+        done += (size_t)res;
+    }
+
+    if(done != size) {
+        CONSOLE_LOG_PRINT("Error reading file for client socket %d: %s\n", req->client_socket, res < 0 ? strerror(-res) : "file truncated while reading");
+        if(fill != nullptr) {
+            fill->unpin();
+        }
+        else {
+            s_allocator.freebytesp2((uint8_t*)cdata, size + 1);
+        }
+        close(file_fd);
+        this->process_file_error(slot, memoize, RSErrorCode::INTERNAL_SERVER_ERROR);
+        co_return;
+    }
+
+    if(fill != nullptr) {
+        SharedFileCacheBlob* blob = this->shared_file_cache->put(req->route, s_strlen(req->route), fill);
+        if(blob == nullptr) {
+            close(file_fd);
+            this->process_file_error(slot, memoize, RSErrorCode::INTERNAL_SERVER_ERROR);
+            co_return;
+        }
+
+        //Answer everyone who was parked on this load from the single fill -- each response holds its own pin (ours goes to the handler slot)
+        std::vector<UserRequest*> waiters = this->file_cache_mgr.completeLoad(req->route);
+        for(size_t i = 0; i < waiters.size(); ++i) {
+            IOEventSlot* wslot = this->acquire_response_slot(waiters[i]);
+            if(wslot != nullptr) {
+                blob->pin();
+                this->send_shared_file_content(wslot, blob);
+            }
+        }
+        this->send_shared_file_content(slot, blob);
+    }
+    else {
+        //Add null terminator for uniformity on the read file (note we made sure there was an extra byte allocated)
+        cdata[size] = '\0';
+
+        const char* cheader = s_allocator.strcopyp2(header, header_len);
+        const FileCachePermanentEntry* entry = this->file_cache_mgr.put(req->route, s_strlen(req->route), cdata, size, cheader, header_len, stat_buf.stx_mtime);
+
+        //Answer everyone who was parked on this load from the single fill (the handler slot moves on to our own response)
+        std::vector<UserRequest*> waiters = this->file_cache_mgr.completeLoad(req->route);
+        this->send_cache_file_content(slot, entry);
+        for(size_t i = 0; i < waiters.size(); ++i) {
+            IOEventSlot* wslot = this->acquire_response_slot(waiters[i]);
+            if(wslot != nullptr) {
+                this->send_cache_file_content(wslot, entry);
+            }
+        }
+    }
 
     ////
     //Setup the close event to clean up the file descriptor
-    struct io_uring_sqe* sqe = io_uring_get_sqe(&this->ring);
-    IOFileCloseEvent* evt = IOFileCloseEvent::create(event);
+    IOEventSlot* cslot = this->event_slots.acquire(RING_EVENT_IO_FILE_CLOSE, nullptr);
+    if(cslot == nullptr) {
+        close(file_fd);
+        co_return;
+    }
+    cslot->as.file_close.file_fd = file_fd;
 
-    io_uring_prep_close(sqe, event->file_fd);
-    io_uring_sqe_set_data(sqe, evt);
+    struct io_uring_sqe* sqe = this->get_sqe();
+    io_uring_prep_close(sqe, file_fd);
+    this->submit_slot(sqe, cslot);
+}
 
-    this->submission_count++; //track number of submissions for batching
+bool RSHookServer::try_send_cached_file(IOEventSlot* slot)
+{
+    if(this->shared_file_cache != nullptr) {
+        SharedFileCacheBlob* blob = this->shared_file_cache->tryGetPinned(this->shared_file_cache_reader, slot->req->route);
+        if(blob == nullptr) {
+            return false;
+        }
+
+        this->send_shared_file_content(slot, blob);
+        return true;
+    }
+
+    const FileCachePermanentEntry* entry = this->file_cache_mgr.tryGet(slot->req->route);
+    if(entry == nullptr) {
+        return false;
+    }
+
+    this->send_cache_file_content(slot, entry);
+    return true;
 }
 
-void RSHookServer::process_fclose_result(IOFileCloseEvent* event)
+void RSHookServer::process_fclose_result(IOEventSlot* slot)
 {
     //no continuation as of now -- just stop processing
 }
 
-void RSHookServer::process_job_request(IOUserRequestEvent* event, int64_t value)
+void RSHookServer::process_file_error(IOEventSlot* slot, bool memoize, RSErrorCode error_code)
 {
-    struct io_uring_sqe* sqe = io_uring_get_sqe(&this->ring);
+    if(memoize) {
+        //fail any requests parked on this load too
+        std::vector<UserRequest*> waiters = this->file_cache_mgr.completeLoad(slot->req->route);
+        for(size_t i = 0; i < waiters.size(); ++i) {
+            IOEventSlot* wslot = this->acquire_response_slot(waiters[i]);
+            if(wslot != nullptr) {
+                this->send_error_code(wslot, error_code);
+            }
+        }
+    }
+
+    this->handle_error_code(slot, error_code);
+}
+
+void RSHookServer::process_job_request(IOEventSlot* slot, JobFunction fn, int64_t value, JobPriority priority, uint64_t deadline_ms, const char* memo_key)
+{
+    //deterministic routes pass a memo key -- answer inline from the result cache or join an identical computation already in flight
+    uint64_t memo_hash = 0;
+    if(memo_key != nullptr) {
+        size_t memo_size = s_strlen(memo_key);
+        memo_hash = ResultCacheManager::hashKey(memo_key, memo_size);
+
+        const ResultCacheEntry* cached_result = this->result_cache_mgr.tryGet(memo_hash, memo_key, memo_size, s_now_ms());
+        if(cached_result != nullptr) {
+            CONSOLE_LOG_PRINT("Result cache hit for %s\n", memo_key);
+
+            //copy out since the entry may be evicted before the write completes
+            const char* data = slot->req->arena.strcopy(cached_result->m_data, cached_result->m_size);
+            this->send_immediate_fixed_content(slot, cached_result->m_size, data, "json");
+            return;
+        }
 
-    //setup a uni-pipe to signal the thread completion -- depending on thread pool we might want to save these per thread too
-    int pfd[2] = {0};
-    int pok = pipe(pfd);
+    }
+
+#if ENABLE_JOB_INLINE
+    //jobs the cost model has learned are cheaper than the handoff run right here
+    if(this->job_costs.shouldRunInline(fn, value)) {
+        this->run_job_inline(slot, fn, value, deadline_ms, memo_key, memo_hash);
+        return;
+    }
+#endif
 
-    assert(pok == 0);
+    if(memo_key != nullptr) {
+        if(this->result_cache_mgr.tryParkOnCompute(memo_hash, memo_key, s_strlen(memo_key), slot->user_data(), slot->req)) {
+            CONSOLE_LOG_PRINT("Computation in flight for %s -- parking request\n", memo_key);
+            slot->req = nullptr; //transfer ownership to the pending computation
+            return;
+        }
+    }
 
-    IOJobCompleteEvent* evt = IOJobCompleteEvent::create(event, pfd[0], pfd[1]);
+    if(this->admission.admitJob(this->jobs_inflight) != AdmissionDecision::Admit) {
+        CONSOLE_LOG_PRINT("Shedding job for client socket %d -- %zu jobs pending\n", slot->req->client_socket, this->jobs_inflight);
+        if(memo_key != nullptr) {
+            this->result_cache_mgr.completeCompute(memo_hash, slot->user_data());
+        }
+        this->handle_error_code(slot, RSErrorCode::SERVICE_UNAVAILABLE);
+        return;
+    }
 
-    //TODO: right now we are hacky in arg/result representation and just creating a new thread per request -- later we need to be buffer clean and use a thread-pool
-    //    - Also backpresure - both dropping requests and providing a standard way to check on load (maybe endpoint)
+    JobDescriptor* job = slot->req->arena.allocate<JobDescriptor>();
+    job->run = fn;
+    job->arg = value;
+    job->priority = priority;
+    job->status = JobStatus::Pending;
+    job->token.initialize(deadline_ms);
+    job->result = nullptr;
+    job->size = 0;
+    job->run_us = 0;
+    job->completion = &this->job_completions;
+    job->tag = slot->user_data();
+    job->m_next = nullptr;
+
+    //TODO: right now we are hacky in arg/result representation
     //    - Would be cool to use Bosque to support migration of tasks too
-    std::thread tl([value, evt]() {
-        CONSOLE_LOG_PRINT("Thread running...\n");
+    if(!this->job_pool.trySubmit(job)) {
+        CONSOLE_LOG_PRINT("Job queues full -- shedding job for client socket %d\n", slot->req->client_socket);
+        if(memo_key != nullptr) {
+            this->result_cache_mgr.completeCompute(memo_hash, slot->user_data());
+        }
+        this->handle_error_code(slot, RSErrorCode::SERVICE_UNAVAILABLE);
+        return;
+    }
 
-        int64_t result_value = fib(value);
+    this->jobs_inflight++;
 
-        evt->result = s_aio_allocator.allocAIOBuffer();
-        evt->size = std::snprintf((char*)evt->result, AIO_BUFFER_SIZE, "{\"value\": %ld}", result_value);
+    //no SQE for the job itself -- hold a pending count so the slot (and request) stay live until the job is posted back
+    slot->rearm(RING_EVENT_JOB_COMPLETE);
+    slot->as.job.job = job;
+    slot->as.job.memo_key = memo_key;
+    slot->as.job.memo_hash = memo_hash;
+    slot->as.job.watching = false;
+    slot->as.job.client_gone = false;
+    slot->pending++;
 
-        CONSOLE_LOG_PRINT("Thread done\n");
-        auto bw = write(evt->wpipe, "T", 1); //wake up the io_uring wait
-        assert(bw == 1);
-    });
-    evt->m_tid = tl.get_id();
+    //and watch the client so the job can be abandoned if they go away
+    this->arm_hangup_watch(slot);
+}
 
-    io_uring_prep_read(sqe, evt->rpipe, evt->status, 1, 0);
-    io_uring_sqe_set_data(sqe, evt);
+void RSHookServer::run_job_inline(IOEventSlot* slot, JobFunction fn, int64_t value, uint64_t deadline_ms, const char* memo_key, uint64_t memo_hash)
+{
+    JobDescriptor* job = slot->req->arena.allocate<JobDescriptor>();
+    job->run = fn;
+    job->arg = value;
+    job->priority = JobPriority::High;
+    job->status = JobStatus::Completed;
+    job->token.initialize(deadline_ms);
+    job->result = nullptr;
+    job->size = 0;
+    job->completion = nullptr;
+    job->tag = slot->user_data();
+    job->m_next = nullptr;
+
+    uint64_t start = s_now_us();
+    fn(job);
+    job->run_us = s_now_us() - start;
+    s_metrics_stage(MetricStage::Job, job->run_us);
+
+    if(job->status != JobStatus::Completed) {
+        s_aio_allocator.freeAIOBuffer(job->result);
+        this->handle_error_code(slot, RSErrorCode::GATEWAY_TIMEOUT);
+        return;
+    }
 
-    this->submission_count++; //track number of submissions for batching
-    tl.detach();
+    //keep measuring so a class that gets more expensive moves back to the pool
+    this->job_costs.record(fn, value, job->run_us);
+
+    if(memo_key != nullptr) {
+        this->result_cache_mgr.put(memo_hash, memo_key, s_strlen(memo_key), (const char*)job->result, job->size, s_now_ms());
+    }
+
+    //the write stage takes over the result buffer
+    this->send_compute_content(slot, job->size, (char*)job->result, "json");
+}
+
+void RSHookServer::arm_hangup_watch(IOEventSlot* slot)
+{
+    //io_uring reports POLLRDHUP whatever the mask so a peer half-close wakes this too -- process_client_hangup sorts it out
+    struct io_uring_sqe* sqe = this->get_sqe();
+    io_uring_prep_poll_add(sqe, slot->req->client_socket, POLLHUP | POLLERR);
+    this->submit_slot_watch(sqe, slot);
+
+    slot->as.job.watching = true;
 }
 
-void RSHookServer::process_job_complete(IOJobCompleteEvent* event)
+void RSHookServer::cancel_hangup_watch(IOEventSlot* slot)
 {
-    uint8_t* data = event->result;
-    event->result = nullptr;
+    //the poll itself then completes with -ECANCELED (on the watch op) and drops its pending count there
+    struct io_uring_sqe* sqe = this->get_sqe();
+    io_uring_prep_poll_remove(sqe, slot->watch_user_data());
+    io_uring_sqe_set_data64(sqe, RING_EVENT_TYPE_IGNORE);
+    this->submission_count++;
 
-    close(event->rpipe);
-    close(event->wpipe);
+    slot->as.job.watching = false;
+}
 
-    this->send_compute_content(event->req->clone(), event->size, (char*)data, "json");
+//a peer FIN looks the same for a half-close and a full close -- only a reset (or other pending socket error) says the client is really gone
+static bool s_peer_reset(int client_socket)
+{
+    char probe;
+    ssize_t rr = recv(client_socket, &probe, 1, MSG_PEEK | MSG_DONTWAIT);
+    return rr < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR;
 }
 
-RSHookServer::RSHookServer() : port(0), server_socket(-1), ring(), submission_count(0), file_cache_mgr()
+void RSHookServer::process_client_hangup(IOEventSlot* slot, int32_t res)
+{
+    if(res < 0 || slot->io_event_type != RING_EVENT_JOB_COMPLETE) {
+        //watch was removed (or the job finished first and the slot moved on to the response)
+        return;
+    }
+
+    IOJobState& st = slot->as.job;
+    if((res & (POLLHUP | POLLERR)) == 0 && !s_peer_reset(slot->req->client_socket)) {
+        //only POLLRDHUP -- an HTTP/1.0 client may shutdown(SHUT_WR) after its request and still read the response so let the job run
+        //(the watch is not re-armed since the half-close would fire it again at once -- a later reset shows up on the response write)
+        st.watching = false;
+        return;
+    }
+
+    if(st.memo_key != nullptr && this->result_cache_mgr.hasWaiters(st.memo_hash, slot->user_data())) {
+        //other requests are parked on this result so let the job finish and only drop our own response
+        CONSOLE_LOG_PRINT("Client socket %d hung up -- job kept for parked requests\n", slot->req->client_socket);
+
+        st.watching = false;
+        st.client_gone = true;
+        close(slot->req->client_socket);
+        return;
+    }
+
+    if(st.memo_key != nullptr) {
+        //nobody else is waiting -- release the in-flight marker so later identical requests start fresh
+        this->result_cache_mgr.completeCompute(st.memo_hash, slot->user_data());
+    }
+
+    CONSOLE_LOG_PRINT("Client socket %d hung up -- cancelling job\n", slot->req->client_socket);
+
+    //a queued job is skipped when a worker picks it up and a running one stops at its next poll of the token
+    //the slot (and request arena holding the descriptor) has to wait for the job to be posted back before it is released
+    slot->as.job.watching = false;
+    slot->as.job.client_gone = true;
+    slot->as.job.job->token.cancel();
+
+    close(slot->req->client_socket);
+}
+
+void RSHookServer::process_job_complete(IOEventSlot* slot)
+{
+    JobDescriptor* job = slot->as.job.job;
+    if(job->status != JobStatus::Completed) {
+        //ran out of time in the queue or while running -- drop any partial result
+        CONSOLE_LOG_PRINT("Job for client socket %d did not complete (%d)\n", slot->req->client_socket, (int)job->status);
+        s_aio_allocator.freeAIOBuffer(job->result);
+        this->handle_error_code(slot, RSErrorCode::GATEWAY_TIMEOUT);
+        return;
+    }
+
+    uint8_t* data = job->result;
+    size_t size = job->size;
+
+    //the write stage takes over the result buffer (freed as an AIO buffer when the write slot is released)
+    this->send_compute_content(slot, size, (char*)data, "json");
+}
+
+void RSHookServer::finish_memoized_job(IOEventSlot* slot)
+{
+    IOJobState& st = slot->as.job;
+    if(st.memo_key == nullptr) {
+        return;
+    }
+
+    JobDescriptor* job = st.job;
+    bool completed = (job->status == JobStatus::Completed);
+    if(completed) {
+        this->result_cache_mgr.put(st.memo_hash, st.memo_key, s_strlen(st.memo_key), (const char*)job->result, job->size, s_now_ms());
+    }
+
+    //answer everyone who was parked on this computation from the one result
+    std::vector<UserRequest*> waiters = this->result_cache_mgr.completeCompute(st.memo_hash, slot->user_data());
+    for(size_t i = 0; i < waiters.size(); ++i) {
+        IOEventSlot* wslot = this->acquire_response_slot(waiters[i]);
+        if(wslot == nullptr) {
+            continue;
+        }
+
+        if(completed) {
+            const char* data = waiters[i]->arena.strcopy((const char*)job->result, job->size);
+            this->send_immediate_fixed_content(wslot, job->size, data, "json");
+        }
+        else {
+            this->send_error_code(wslot, RSErrorCode::GATEWAY_TIMEOUT);
+        }
+    }
+}
+
+void RSHookServer::arm_job_signal(IOEventSlot* slot)
+{
+    struct io_uring_sqe* sqe = this->get_sqe();
+
+    slot->rearm(RING_EVENT_JOB_SIGNAL);
+    slot->as.job_signal.value = 0;
+
+    io_uring_prep_read(sqe, this->job_completions.getEventFD(), &slot->as.job_signal.value, sizeof(uint64_t), 0);
+    this->submit_slot(sqe, slot);
+}
+
+void RSHookServer::process_job_signal(IOEventSlot* slot)
+{
+    //one eventfd read covers every job posted since the last drain
+    JobDescriptor* job = this->job_completions.drain();
+    while(job != nullptr) {
+        JobDescriptor* next = job->m_next;
+
+        if(job->status == JobStatus::Completed) {
+            this->job_costs.record(job->run, job->arg, job->run_us);
+        }
+
+        if(IS_TASK_JOB_TAG(job->tag)) {
+            //async task -- the submitting connection is long gone, the result goes to the task table
+            this->jobs_inflight--;
+            this->process_task_complete(this->tasks.fromJobTag(job->tag));
+
+            job = next;
+            continue;
+        }
+
+        IOEventSlot* jslot = this->event_slots.lookup(job->tag);
+        assert(jslot != nullptr && jslot->io_event_type == RING_EVENT_JOB_COMPLETE);
+
+        CONSOLE_LOG_PRINT("Handling job request completion -- %x %s\n", jslot->req->client_socket, jslot->req->route);
+        jslot->pending--;
+        this->jobs_inflight--;
+
+        //fill the result cache and answer any parked duplicates first (before the slot state is reused for the response)
+        this->finish_memoized_job(jslot);
+
+        if(jslot->as.job.client_gone) {
+            //nobody to answer -- the result (if any) goes with the slot
+            CONSOLE_LOG_PRINT("Dropping job result for departed client\n");
+        }
+        else {
+            if(jslot->as.job.watching) {
+                this->cancel_hangup_watch(jslot);
+            }
+            this->process_job_complete(jslot);
+        }
+
+        if(jslot->pending == 0) {
+            this->event_slots.release(jslot);
+        }
+
+        job = next;
+    }
+
+    this->arm_job_signal(slot);
+}
+
+void RSHookServer::process_async_job_request(IOEventSlot* slot, JobFunction fn, int64_t value, JobPriority priority, const char* memo_key)
+{
+    uint64_t now = s_now_ms();
+
+    //a memoized result needs no task -- answer it inline like a blocking request
+    uint64_t memo_hash = 0;
+    if(memo_key != nullptr) {
+        size_t memo_size = s_strlen(memo_key);
+        memo_hash = ResultCacheManager::hashKey(memo_key, memo_size);
+
+        const ResultCacheEntry* cached_result = this->result_cache_mgr.tryGet(memo_hash, memo_key, memo_size, now);
+        if(cached_result != nullptr) {
+            CONSOLE_LOG_PRINT("Result cache hit for %s\n", memo_key);
+
+            const char* data = slot->req->arena.strcopy(cached_result->m_data, cached_result->m_size);
+            this->send_immediate_fixed_content(slot, cached_result->m_size, data, "json");
+            return;
+        }
+    }
+
+#if ENABLE_JOB_INLINE
+    //same for a job that is cheaper than the task bookkeeping (respond-async is only a preference)
+    if(this->job_costs.shouldRunInline(fn, value)) {
+        this->run_job_inline(slot, fn, value, now + TASK_DEFAULT_DEADLINE_MS, memo_key, memo_hash);
+        return;
+    }
+#endif
+
+    if(this->admission.admitJob(this->jobs_inflight) != AdmissionDecision::Admit) {
+        CONSOLE_LOG_PRINT("Shedding task for client socket %d -- %zu jobs pending\n", slot->req->client_socket, this->jobs_inflight);
+        this->handle_error_code(slot, RSErrorCode::SERVICE_UNAVAILABLE);
+        return;
+    }
+
+    TaskEntry* task = this->tasks.allocate(now);
+    if(task == nullptr) {
+        CONSOLE_LOG_PRINT("Task table full -- shedding task for client socket %d\n", slot->req->client_socket);
+        this->handle_error_code(slot, RSErrorCode::SERVICE_UNAVAILABLE);
+        return;
+    }
+
+    //the descriptor lives in the task entry since the request (and its arena) is released once the 202 is written
+    JobDescriptor* job = &task->m_job;
+    job->run = fn;
+    job->arg = value;
+    job->priority = priority;
+    job->status = JobStatus::Pending;
+    job->token.initialize(now + TASK_DEFAULT_DEADLINE_MS);
+    job->result = nullptr;
+    job->size = 0;
+    job->run_us = 0;
+    job->completion = &this->job_completions;
+    job->tag = task->jobTag();
+    job->m_next = nullptr;
+
+    task->m_memo_key = s_allocator.strcopyp2(memo_key);
+
+    if(!this->job_pool.trySubmit(job)) {
+        CONSOLE_LOG_PRINT("Job queues full -- shedding task for client socket %d\n", slot->req->client_socket);
+        this->tasks.release(task);
+        this->handle_error_code(slot, RSErrorCode::SERVICE_UNAVAILABLE);
+        return;
+    }
+
+    this->jobs_inflight++;
+    this->send_task_status(slot, task);
+}
+
+void RSHookServer::process_task_complete(TaskEntry* task)
+{
+    this->tasks.complete(task, s_now_ms());
+
+    if(task->m_state == TaskState::Completed && task->m_memo_key != nullptr) {
+        size_t memo_size = s_strlen(task->m_memo_key);
+        this->result_cache_mgr.put(ResultCacheManager::hashKey(task->m_memo_key, memo_size), task->m_memo_key, memo_size, task->m_result, task->m_result_size, s_now_ms());
+    }
+
+    if(task->m_waiters.empty()) {
+        return;
+    }
+
+    //flush first so every parked timeout SQE has been read by the kernel before its slot state is reused for the response
+    io_uring_submit(&this->ring);
+    this->submission_count = 0;
+
+    //answer the long-polls parked on the task -- each removed timeout completes on the watch op as -ECANCELED
+    for(size_t i = 0; i < task->m_waiters.size(); ++i) {
+        IOEventSlot* wslot = task->m_waiters[i];
+
+        struct io_uring_sqe* sqe = this->get_sqe();
+        io_uring_prep_timeout_remove(sqe, wslot->watch_user_data(), 0);
+        io_uring_sqe_set_data64(sqe, RING_EVENT_TYPE_IGNORE);
+        this->submission_count++;
+
+        this->send_task_status(wslot, task);
+    }
+    task->m_waiters.clear();
+}
+
+void RSHookServer::process_task_status(IOEventSlot* slot, uint64_t task_id, uint64_t wait_ms)
+{
+    TaskEntry* task = this->tasks.lookup(task_id);
+    if(task == nullptr) {
+        //never existed or the result has expired
+        this->handle_error_code(slot, RSErrorCode::ROUTE_NOT_FOUND);
+        return;
+    }
+
+    if(task->m_state != TaskState::Running || wait_ms == 0) {
+        this->send_task_status(slot, task);
+        return;
+    }
+
+    //long-poll -- park on the task until it finishes or the timeout (on the watch op) fires
+    slot->rearm(RING_EVENT_TASK_WAIT);
+    slot->as.task_wait.task_id = task_id;
+    slot->as.task_wait.timeout.tv_sec = wait_ms / 1000;
+    slot->as.task_wait.timeout.tv_nsec = (wait_ms % 1000) * 1000000;
+    task->m_waiters.push_back(slot);
+
+    struct io_uring_sqe* sqe = this->get_sqe();
+    io_uring_prep_timeout(sqe, &slot->as.task_wait.timeout, 0, 0);
+    this->submit_slot_watch(sqe, slot);
+}
+
+void RSHookServer::process_task_wait_timeout(IOEventSlot* slot, int32_t res)
+{
+    //a task with parked waiters is never recycled so it is still here (and still running)
+    TaskEntry* task = this->tasks.lookup(slot->as.task_wait.task_id);
+    assert(task != nullptr);
+
+    auto wpos = std::find(task->m_waiters.begin(), task->m_waiters.end(), slot);
+    if(wpos != task->m_waiters.end()) {
+        task->m_waiters.erase(wpos);
+    }
+
+    this->send_task_status(slot, task);
+}
+
+void RSHookServer::send_task_status(IOEventSlot* slot, const TaskEntry* task)
+{
+    if(task->m_state == TaskState::Failed) {
+        this->handle_error_code(slot, RSErrorCode::GATEWAY_TIMEOUT);
+    }
+    else if(task->m_state == TaskState::Completed) {
+        //copy out since the task may be recycled before the write completes
+        const char* data = slot->req->arena.strcopy(task->m_result, task->m_result_size);
+        this->send_immediate_fixed_content(slot, task->m_result_size, data, "json");
+    }
+    else {
+        char* response = (char*)slot->req->arena.allocate(HEADER_BUFFER_MAX);
+        int response_len = build_task_accepted_response(task->id(), response);
+        this->write_user_direct(slot, response_len, response);
+    }
+}
+
+void RSHookServer::send_metrics(IOEventSlot* slot)
+{
+    static const char* error_names[] = { "none", "malformed_request", "unsupported_verb", "route_not_found", "internal_server_error", "service_unavailable", "gateway_timeout" };
+
+    std::string body;
+    s_metrics.render(body, error_names, sizeof(error_names) / sizeof(error_names[0]));
+
+    char header[HEADER_BUFFER_MAX];
+    int header_len = std::snprintf(header, HEADER_BUFFER_MAX, "HTTP/1.0 200 OK\r\n%sContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", SERVER_STRING, body.size());
+
+    char* response = (char*)slot->req->arena.allocate(header_len + body.size());
+    memcpy(response, header, header_len);
+    memcpy(response + header_len, body.data(), body.size());
+
+    this->write_user_direct(slot, header_len + body.size(), response);
+}
+
+void RSHookServer::record_response_metrics(IOEventSlot* slot)
+{
+    UserRequest* req = slot->req;
+    uint64_t now = s_now_us();
+
+    s_metrics_stage(MetricStage::Write, now - req->stage_us);
+    s_metrics_request(req->metric_route, now - req->start_us);
+}
+
+//status from the start of the response ("HTTP/1.0 NNN ...") -- 0 if the write was not a status line
+static int s_response_status(const char* data, size_t size)
+{
+    if(data == nullptr || size < 12 || strncmp(data, "HTTP/", 5) != 0 || data[8] != ' ') {
+        return 0;
+    }
+
+    int status = 0;
+    for(size_t i = 9; i < 12; ++i) {
+        if(data[i] < '0' || data[i] > '9') {
+            return 0;
+        }
+        status = (status * 10) + (data[i] - '0');
+    }
+    return status;
+}
+
+void RSHookServer::log_access(IOEventSlot* slot, int32_t res)
+{
+#if ENABLE_ACCESS_LOG
+    UserRequest* req = slot->req;
+
+    //the slot still holds the response it just wrote -- the headers are the whole message or the first iovec
+    int status = 0;
+    if(slot->io_event_type == RING_EVENT_IO_CLIENT_WRITE) {
+        status = s_response_status(slot->as.write.msg_data, slot->as.write.size);
+    }
+    else {
+        status = s_response_status((const char*)slot->as.write_vectored.iov[0].iov_base, slot->as.write_vectored.iov[0].iov_len);
+    }
+
+    AccessLogEntry entry = { req->route, status, res, req->start_us, req->read_us, req->stage_us, s_now_us() };
+    this->access_log.record(entry);
+    this->submit_access_log();
+#endif
+}
+
+void RSHookServer::submit_access_log()
+{
+    AccessLogWrite write;
+    while(this->access_log.nextWrite(write)) {
+        struct io_uring_sqe* sqe = this->get_sqe();
+        io_uring_prep_write(sqe, write.fd, write.data, (unsigned)write.size, write.offset);
+        io_uring_sqe_set_data64(sqe, ACCESS_LOG_USER_DATA(write.tag));
+        this->submission_count++;
+    }
+
+    //a partly filled buffer goes out when the timer fires -- only armed while there is something to flush so an idle server stays asleep
+    if(this->access_log.needsTick()) {
+        struct io_uring_sqe* sqe = this->get_sqe();
+        io_uring_prep_timeout(sqe, this->access_log.armTick(), 0, 0);
+        io_uring_sqe_set_data64(sqe, ACCESS_LOG_USER_DATA(ACCESS_LOG_TICK_TAG));
+        this->submission_count++;
+    }
+}
+
+void RSHookServer::process_access_log(uint32_t tag, int32_t res)
+{
+    if(tag == ACCESS_LOG_TICK_TAG) {
+        this->access_log.tickComplete();
+    }
+    else {
+        if(res < 0) {
+            CONSOLE_LOG_PRINT("Error writing access log: %s\n", strerror(-res));
+        }
+        this->access_log.writeComplete(tag, res);
+    }
+
+    this->submit_access_log();
+}
+
+void RSHookServer::stop_accepting()
+{
+    //the accept then completes with -ECANCELED -- anything it hands over before that is shed by process_user_connect
+    struct io_uring_sqe* sqe = this->get_sqe();
+    io_uring_prep_cancel64(sqe, RING_EVENT_TYPE_ACCEPT, 0);
+    io_uring_sqe_set_data64(sqe, RING_EVENT_TYPE_IGNORE);
+    this->submission_count++;
+}
+
+void RSHookServer::flush_access_log()
+{
+    //hand the partly filled buffer to the ring now instead of waiting for the timer -- the runloop drains the writes before it returns
+    this->access_log.flush();
+    this->submit_access_log();
+
+    if(this->submission_count > 0) {
+        io_uring_submit(&this->ring);
+        this->submission_count = 0;
+    }
+}
+
+void RSHookServer::close_access_log()
+{
+    if(!this->access_log.isOpen()) {
+        return;
+    }
+
+    //the runloop has drained what it could -- anything still on the ring is abandoned and the rest is written out synchronously
+    this->access_log.close();
+
+    const AccessLogStats& lstats = this->access_log.getStats();
+    CONSOLE_STATUS_PRINT("Logged %lu requests (%lu bytes, %lu rotations) -- dropped %lu\n", lstats.records, lstats.bytes, lstats.rotations, lstats.dropped);
+}
+
+RSHookServer::RSHookServer() : port(0), server_socket(-1), topology(), ring(), submission_count(0), event_slots(), admission(), jobs_inflight(0), job_pool(), job_completions(), job_costs(), tasks(), capture(), access_log(), file_cache_mgr(), shared_file_cache(nullptr), shared_file_cache_reader(-1), result_cache_mgr(), embedded(false), cache_snapshot_path(), cache_snapshot_requested(0), trace_dump_requested(0), shutdown_requested(0)
 {
     ;
 }
@@ -498,14 +1498,68 @@ RSHookServer::~RSHookServer()
     ;
 }
 
-void RSHookServer::startup(int port, int server_socket)
+void RSHookServer::startup(int port, int server_socket, bool embedded)
 {
     this->port = port;
     this->server_socket = server_socket;
+    this->embedded = embedded;
+
+    //place ourselves first so everything allocated below lands on the reactor's node
+    this->topology.load();
+    s_page_source.enableNodeBinding(this->topology.getNodeCount());
+
+    CPUPlacement reactor = this->topology.reactorPlacement();
+    s_place_current_thread(reactor);
+    CONSOLE_STATUS_PRINT("Runloop on CPU %d (node %d of %zu)\n", reactor.cpu, reactor.node, this->topology.getNodeCount());
+
+#if ENABLE_TOPOLOGY_PLACEMENT && defined(SO_INCOMING_CPU)
+    //hint the stack to deliver the listener's connections on the reactor's CPU (NIC queue IRQ/RPS affinity is set up outside the server)
+    int32_t incoming_cpu = reactor.cpu;
+    setsockopt(server_socket, SOL_SOCKET, SO_INCOMING_CPU, &incoming_cpu, sizeof(incoming_cpu));
+#endif
 
     std::string resourcedir = getStaticRootDirectory() + "/static";
     this->resource_root = s_allocator.strcopyp2(resourcedir.c_str());
 
+#if ENABLE_SHARED_FILE_CACHE
+    //file bodies come from the one cache every runloop in the process shares (snapshots only cover the per-runloop cache)
+    SharedFileCacheManager* shared = getSharedFileCacheManager();
+    this->shared_file_cache_reader = shared->registerReader();
+    if(this->shared_file_cache_reader != -1) {
+        this->shared_file_cache = shared;
+    }
+    CONSOLE_STATUS_PRINT("Shared file cache %s\n", this->shared_file_cache != nullptr ? "enabled" : "unavailable (no free reader slot)");
+#endif
+
+    //warm the file cache from the last snapshot (entries are validated against the current file mtimes)
+    this->cache_snapshot_path = getStaticRootDirectory() + "/" + FILE_CACHE_SNAPSHOT_NAME;
+    if(this->shared_file_cache == nullptr && !this->embedded) {
+        size_t warm_count = this->file_cache_mgr.loadSnapshot(this->cache_snapshot_path.c_str(), this->resource_root);
+        CONSOLE_STATUS_PRINT("Loaded %zu cache entries from snapshot\n", warm_count);
+    }
+
+    this->event_slots.initialize();
+    this->job_completions.initialize();
+    this->tasks.initialize();
+    this->job_pool.start(this->topology.workerPlacement(reactor, JOB_WORKER_COUNT));
+    CONSOLE_STATUS_PRINT("Started %zu job workers\n", this->job_pool.getWorkerCount());
+
+#if ENABLE_REQUEST_CAPTURE
+    if(!this->embedded) {
+        std::string capture_path = getStaticRootDirectory() + "/" + REQUEST_CAPTURE_FILE_NAME;
+        bool capturing = this->capture.open(capture_path.c_str());
+        CONSOLE_STATUS_PRINT("Request capture to %s %s\n", capture_path.c_str(), capturing ? "started" : "failed");
+    }
+#endif
+
+#if ENABLE_ACCESS_LOG
+    if(!this->embedded) {
+        std::string access_log_path = getStaticRootDirectory() + "/" + ACCESS_LOG_FILE_NAME;
+        bool logging = this->access_log.open(access_log_path.c_str());
+        CONSOLE_STATUS_PRINT("Access log to %s %s\n", access_log_path.c_str(), logging ? "started" : "failed");
+    }
+#endif
+
     this->submission_count = 0;
     io_uring_queue_init(QUEUE_DEPTH, &this->ring, 0);
 
@@ -517,146 +1571,237 @@ void RSHookServer::shutdown()
     CONSOLE_STATUS_PRINT("Shutting down server...\n");
     //TODO: need to gracefully stop accepting new connections and wait for existing ones to finish then exit
 
+    this->close_access_log();
     io_uring_queue_exit(&this->ring);
+    this->job_pool.stop();
+    this->job_completions.close();
+    this->tasks.clear();
+
+    const AdmissionStats& astats = this->admission.getStats();
+    CONSOLE_STATUS_PRINT("Admitted %zu connections -- shed %zu (memory), %zu (in-flight), %zu (sq), %zu jobs\n", astats.admitted, astats.shed_memory, astats.shed_inflight, astats.shed_sq, astats.shed_jobs);
 
+    const JobCostStats& jstats = this->job_costs.getStats();
+    CONSOLE_STATUS_PRINT("Ran %zu compute jobs inline -- offloaded %zu\n", jstats.inlined, jstats.offloaded);
+
+    this->snapshot_cache();
+    this->dump_trace();
+
+#if ENABLE_REQUEST_CAPTURE
+    CONSOLE_STATUS_PRINT("Captured %lu requests\n", this->capture.getRecordCount());
+#endif
+    this->capture.close();
     this->file_cache_mgr.clear();
+    if(this->shared_file_cache != nullptr) {
+        //other runloops may still be serving from the shared cache so only our reader slot goes
+        this->shared_file_cache->unregisterReader(this->shared_file_cache_reader);
+        this->shared_file_cache = nullptr;
+    }
+    this->result_cache_mgr.clear();
 
     CONSOLE_STATUS_PRINT("Server shutdown complete.\n");
 }
 
+void RSHookServer::dump_trace()
+{
+    this->trace_dump_requested = 0;
+
+    if(this->embedded) {
+        return;
+    }
+
+#if ENABLE_RING_TRACE
+    std::string trace_path = getStaticRootDirectory() + "/" + RING_TRACE_FILE_NAME;
+    bool ok = s_ring_tracer.dump(trace_path.c_str());
+    CONSOLE_STATUS_PRINT("Ring trace %s %s\n", trace_path.c_str(), ok ? "written" : "failed");
+#endif
+}
+
+void RSHookServer::snapshot_cache()
+{
+    this->cache_snapshot_requested = 0;
+
+    if(this->shared_file_cache != nullptr || this->embedded) {
+        //nothing to write -- the bodies are in the shared cache, or this is a replay whose cache must not replace the server's warm restart state
+        return;
+    }
+
+    bool ok = this->file_cache_mgr.saveSnapshot(this->cache_snapshot_path.c_str());
+    CONSOLE_STATUS_PRINT("Cache snapshot %s\n", ok ? "written" : "failed");
+}
+
 void RSHookServer::runloop()
 {
     CONSOLE_STATUS_PRINT("Server starting...\n");
 
-    struct io_uring_sqe* sqe = io_uring_get_sqe(&this->ring);
+    struct io_uring_sqe* sqe = this->get_sqe();
     io_uring_prep_multishot_accept(sqe, this->server_socket, nullptr, nullptr, 0);
 
     io_uring_sqe_set_data64(sqe, RING_EVENT_TYPE_ACCEPT);
+
+    //worker pool completions all come back through one eventfd read
+    IOEventSlot* jsslot = this->event_slots.acquire(RING_EVENT_JOB_SIGNAL, nullptr);
+    this->arm_job_signal(jsslot);
+
     io_uring_submit(&this->ring);
+    this->submission_count = 0;
 
     CONSOLE_STATUS_PRINT("Server listening...\n");
 
+    uint64_t drain_deadline = 0;
     while (1) {
         assert(this->submission_count == 0);
+
+        if (this->shutdown_requested) {
+            //keep dispatching until the access log writes on the ring have landed (or we give up on them) then return for shutdown
+            if (drain_deadline == 0) {
+                drain_deadline = s_now_ms() + ACCESS_LOG_DRAIN_MS;
+                this->stop_accepting();
+                this->flush_access_log();
+            }
+
+            if (!this->access_log.hasInFlight() || s_now_ms() >= drain_deadline) {
+                break;
+            }
+        }
+
+        if (this->cache_snapshot_requested) {
+            this->snapshot_cache();
+        }
+
+        if (this->trace_dump_requested) {
+            this->dump_trace();
+        }
         
         struct io_uring_cqe* cqe;
-        int ret = io_uring_wait_cqe(&this->ring, &cqe);
+        int ret = 0;
+        if (drain_deadline == 0) {
+            ret = io_uring_wait_cqe(&this->ring, &cqe);
+        }
+        else {
+            struct __kernel_timespec ts = { 0, 100000000 };
+            ret = io_uring_wait_cqe_timeout(&this->ring, &cqe, &ts);
+            if (ret == -ETIME) {
+                continue;
+            }
+        }
+
         if (ret < 0) {
             CONSOLE_LOG_PRINT("Fatal error waiting for CQE: %s\n", strerror(-ret));
             continue;
         }
 
         while(1) {
-            if((cqe->user_data & RING_EVENT_TYPE_ACCEPT) == RING_EVENT_TYPE_ACCEPT) {
+            IOEventSlot* slot = nullptr;
+            if((cqe->user_data & 0x3) == RING_EVENT_TYPE_IGNORE) {
+                ;
+            }
+            else if((cqe->user_data & 0x3) == RING_EVENT_TYPE_ACCESS_LOG) {
+                this->process_access_log(ACCESS_LOG_USER_DATA_TAG(cqe->user_data), cqe->res);
+            }
+            else if((cqe->user_data & RING_EVENT_TYPE_ACCEPT) == RING_EVENT_TYPE_ACCEPT) {
+                s_trace_event(RingTraceKind::Accept, 0, 0, 0, cqe->res, 0);
                 this->process_user_connect(cqe->res);
             }
+            else if((slot = this->event_slots.lookup(cqe->user_data)) == nullptr) {
+                //completion for a slot that has already been released -- nothing left to do
+                CONSOLE_LOG_PRINT("Stale completion for event slot %u\n", IO_EVENT_SLOT_INDEX(cqe->user_data));
+            }
             else {
-                IOEvent* event = (IOEvent*)cqe->user_data;
-
-                switch (event->io_event_type) {
-                    case RING_EVENT_IO_CLIENT_READ: {
-                        CONSOLE_LOG_PRINT("Handling user request event -- %x\n", event->req->client_socket);
-
-                        if (cqe->res < 0) {
-                            CONSOLE_LOG_PRINT("Error reading from client socket %d: %s\n", event->req->client_socket, strerror(-cqe->res));
-                            handle_error_code(event->req, RSErrorCode::MALFORMED_REQUEST);
-                            break;
-                        }
+                s_trace_event(RingTraceKind::Complete, slot->index, slot->generation, slot->io_event_type, cqe->res, IO_EVENT_SLOT_OP(cqe->user_data));
+                slot->pending--;
 
-                        this->process_user_request((IOUserRequestEvent*)event, cqe->res);
-                        break;
+                if(IO_EVENT_SLOT_OP(cqe->user_data) == IO_EVENT_SLOT_OP_WATCH) {
+                    if(slot->io_event_type == RING_EVENT_TASK_WAIT) {
+                        this->process_task_wait_timeout(slot, cqe->res);
                     }
-                    case RING_EVENT_IO_CLIENT_WRITE: {
-                        CONSOLE_LOG_PRINT("Handling file write event -- %x %s\n", event->req->client_socket, event->req->route);
-                        
-                        if (cqe->res < 0) {
-                            CONSOLE_LOG_PRINT("Error writing to client socket %d: %s\n", event->req->client_socket, strerror(-cqe->res));
-                        }
-
-                        //either way the user has been responded to just cleanup
-                        close(event->req->client_socket);
-                        break;
+                    else {
+                        this->process_client_hangup(slot, cqe->res);
                     }
-                    case RING_EVENT_IO_CLIENT_WRITE_VECTORED: {
-                        CONSOLE_LOG_PRINT("Handling vectored write event -- %x %s\n", event->req->client_socket, event->req->route);
+                }
+                else {
+                    switch (slot->io_event_type) {
+                        case RING_EVENT_IO_CLIENT_READ: {
+                            CONSOLE_LOG_PRINT("Handling user request event -- %x\n", slot->req->client_socket);
+
+                            if (cqe->res < 0) {
+                                CONSOLE_LOG_PRINT("Error reading from client socket %d: %s\n", slot->req->client_socket, strerror(-cqe->res));
+                                handle_error_code(slot, RSErrorCode::MALFORMED_REQUEST);
+                                break;
+                            }
+
+                            this->process_user_request(slot, cqe->res);
+                            break;
+                        }
+                        case RING_EVENT_IO_CLIENT_WRITE: {
+                            CONSOLE_LOG_PRINT("Handling file write event -- %x %s\n", slot->req->client_socket, slot->req->route);
                         
-                        if (cqe->res < 0) {
-                            CONSOLE_LOG_PRINT("Error writing to client socket %d: %s\n", event->req->client_socket, strerror(-cqe->res));
+                            if (cqe->res < 0) {
+                                CONSOLE_LOG_PRINT("Error writing to client socket %d: %s\n", slot->req->client_socket, strerror(-cqe->res));
+                            }
+
+                            //either way the user has been responded to just cleanup
+                            this->record_response_metrics(slot);
+                            this->log_access(slot, cqe->res);
+                            close(slot->req->client_socket);
+                            break;
                         }
+                        case RING_EVENT_IO_CLIENT_WRITE_VECTORED: {
+                            CONSOLE_LOG_PRINT("Handling vectored write event -- %x %s\n", slot->req->client_socket, slot->req->route);
                         
-                        //either way the user has been responded to just cleanup
-                        close(event->req->client_socket);
-                        break;
-                    }
-                    case RING_EVENT_IO_FILE_STAT: {
-                        CONSOLE_LOG_PRINT("Handling file stat event -- %x %s\n", event->req->client_socket, event->req->route);
+                            if (cqe->res < 0) {
+                                CONSOLE_LOG_PRINT("Error writing to client socket %d: %s\n", slot->req->client_socket, strerror(-cqe->res));
+                            }
                         
-                        IOFileStatEvent* eevt = (IOFileStatEvent*)event;
-                        if (cqe->res < 0) {
-                            CONSOLE_LOG_PRINT("Error processing file stat from client socket %d: %s\n", event->req->client_socket, strerror(-cqe->res));
-                            handle_error_code(eevt->req, RSErrorCode::INTERNAL_SERVER_ERROR);
+                            //either way the user has been responded to just cleanup
+                            this->record_response_metrics(slot);
+                            this->log_access(slot, cqe->res);
+                            close(slot->req->client_socket);
                             break;
                         }
-                        this->process_fstat_result(eevt);
-                        break;
-                    }
-                    case RING_EVENT_IO_FILE_OPEN: {
-                        CONSOLE_LOG_PRINT("Handling file open event -- %x %s\n", event->req->client_socket, event->req->route);
-                        
-                        if (cqe->res < 0) {
-                            CONSOLE_LOG_PRINT("Error opening file for client socket %d: %s\n", event->req->client_socket, strerror(-cqe->res));
-                            handle_error_code(event->req, RSErrorCode::INTERNAL_SERVER_ERROR);
+                        case RING_EVENT_IO_COROUTINE: {
+                            CONSOLE_LOG_PRINT("Resuming handler -- %x %s\n", slot->req->client_socket, slot->req->route);
+
+                            s_metrics_stage(slot->as.coroutine.stage, s_now_us() - slot->req->stage_us);
+
+                            //errors are reported to the handler through the result
+                            slot->as.coroutine.res = cqe->res;
+                            std::coroutine_handle<>::from_address(slot->as.coroutine.frame).resume();
                             break;
                         }
+                        case RING_EVENT_IO_FILE_CLOSE: {
+                            CONSOLE_LOG_PRINT("Handling file close event -- %d\n", slot->as.file_close.file_fd);
                         
-                        this->process_fopen_result((IOFileOpenEvent*)event, cqe->res);
-                        break;
-                    }
-                    case RING_EVENT_IO_FILE_READ: {
-                        CONSOLE_LOG_PRINT("Handling file read event -- %x %s\n", event->req->client_socket, event->req->route);
+                            if (cqe->res < 0) {
+                                //the user has already been responded to so just note it
+                                CONSOLE_LOG_PRINT("Error closing file %d: %s\n", slot->as.file_close.file_fd, strerror(-cqe->res));
+                                break;
+                            }
                         
-                        if (cqe->res < 0) {
-                            CONSOLE_LOG_PRINT("Error reading file for client socket %d: %s\n", event->req->client_socket, strerror(-cqe->res));
-                            handle_error_code(event->req, RSErrorCode::INTERNAL_SERVER_ERROR);
+                            this->process_fclose_result(slot);
                             break;
                         }
+                        case RING_EVENT_JOB_SIGNAL: {
+                            if (cqe->res < 0) {
+                                CONSOLE_LOG_PRINT("Error reading job completion signal: %s\n", strerror(-cqe->res));
+                            }
 
-                        this->process_fread_result((IOFileReadEvent*)event);
-                        break;
-                    }
-                    case RING_EVENT_IO_FILE_CLOSE: {
-                        CONSOLE_LOG_PRINT("Handling file close event -- %x %s\n", event->req->client_socket, event->req->route);
-                        
-                        if (cqe->res < 0) {
-                            CONSOLE_LOG_PRINT("Error closing file for client socket %d: %s\n", event->req->client_socket, strerror(-cqe->res));
-                            handle_error_code(event->req, RSErrorCode::INTERNAL_SERVER_ERROR);
+                            //drain either way (a failed read still leaves posted jobs to pick up) and re-arm
+                            this->process_job_signal(slot);
                             break;
                         }
+                        default: {
+                            CONSOLE_LOG_PRINT("Unexpected req type %d\n", slot->io_event_type);
                         
-                        this->process_fclose_result((IOFileCloseEvent*)event);
-                        break;
-                    }
-                    case RING_EVENT_JOB_COMPLETE: {
-                        CONSOLE_LOG_PRINT("Handling job request completion event -- %x %s\n", event->req->client_socket, event->req->route);
-                        
-                        if (cqe->res < 0) {
-                            CONSOLE_LOG_PRINT("Error processing job request for client socket %d: %s\n", event->req->client_socket, strerror(-cqe->res));
-                            handle_error_code(event->req, RSErrorCode::INTERNAL_SERVER_ERROR);
+                            handle_error_code(slot, RSErrorCode::INTERNAL_SERVER_ERROR);
                             break;
                         }
-                        
-                        this->process_job_complete((IOJobCompleteEvent*)event);
-                        break;
-                    }
-                    default: {
-                        CONSOLE_LOG_PRINT("Unexpected req type %d\n", event->io_event_type);
-                        
-                        handle_error_code(event->req, RSErrorCode::INTERNAL_SERVER_ERROR);
-                        break;
                     }
                 }
 
-                event->release();
+                //the slot goes back to the table once nothing is in flight on it (stages that continue have resubmitted it)
+                if(slot->pending == 0) {
+                    this->event_slots.release(slot);
+                }
             }
 
             io_uring_cqe_seen(&this->ring, cqe);
@@ -680,5 +1825,8 @@ void RSHookServer::runloop()
             io_uring_submit(&this->ring);
             this->submission_count = 0;
         }
+
+        s_allocator.trim(s_now_ms());
+        this->admission.refresh(s_page_source.getResidentBytes());
     }
 }
@@ -4,13 +4,34 @@
 #include "alloc.h"
 #include "fixedmsgs.h"
 #include "filemgr.h"
+#include "sharedcache.h"
 #include "events.h"
+#include "admission.h"
+#include "resultcache.h"
+#include "tasks.h"
+#include "jobcost.h"
+#include "ringcoro.h"
+#include "capture.h"
+#include "accesslog.h"
 
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <poll.h>
 #include <netinet/in.h>
+#include <csignal>
+#include <cerrno>
+
+#include <string>
+
+#define FILE_CACHE_SNAPSHOT_NAME "rshook-cache.snap"
 
 #define RING_EVENT_TYPE_IO 0x0
 #define RING_EVENT_TYPE_ACCEPT 0x1
+#define RING_EVENT_TYPE_IGNORE 0x2 //completions nobody waits on (e.g. poll removal)
+#define RING_EVENT_TYPE_ACCESS_LOG 0x3 //access log batch writes and the flush timer -- the buffer (or tick) tag is in the upper bits
+
+#define ACCESS_LOG_USER_DATA(TAG) ((((uint64_t)(TAG)) << 8) | RING_EVENT_TYPE_ACCESS_LOG)
+#define ACCESS_LOG_USER_DATA_TAG(UD) ((uint32_t)((UD) >> 8))
 
 union event {
     struct { int32_t fd; uint32_t op; } data_as_accept;
@@ -26,66 +47,180 @@ enum class RSErrorCode
     MALFORMED_REQUEST,
     UNSUPPORTED_VERB,
     ROUTE_NOT_FOUND,
-    INTERNAL_SERVER_ERROR
+    INTERNAL_SERVER_ERROR,
+    SERVICE_UNAVAILABLE,
+    GATEWAY_TIMEOUT
 };
 
+#define HEADER_BUFFER_MAX 512
+
+//Response header builders and request parsers (server.cpp) -- the send buffer must hold HEADER_BUFFER_MAX bytes
+int build_dynamic_headers(size_t contents_size, char* send_buffer);
+int build_file_headers(const char* path, size_t contents_size, char* send_buffer);
+
+std::pair<const char*, const char*> extractHTTPVerb(const char* http_request_data);
+std::pair<const char*, const char*> extractHTTPPath(const char* http_request_data);
+size_t extractHTTPContentLength(const char* http_request_data);
+const char* extractHTTPHeaderValue(const char* http_request_data, const char* header);
+std::pair<const char*, const char*> extractHTTPData(const char* http_request_data, size_t content_length);
+bool pathMatchsRoute(const std::pair<const char*, const char*>& path, const char* match);
+
 class RSHookServer
 {
 private:
+    friend class IOCoroutineRing;
+
     int port;
     int server_socket;
     const char* resource_root;
 
+    CPUTopology topology;
+
     struct io_uring ring;
     size_t submission_count;
+    IOEventSlotTable event_slots;
+
+    AdmissionController admission;
+    size_t jobs_inflight;
+
+    JobWorkerPool job_pool;
+    JobCompletionQueue job_completions;
+    JobCostModel job_costs;
+    TaskTable tasks;
+
+    RequestCapture capture;
+    AccessLog access_log;
+
+    FileCacheManager file_cache_mgr; //negative entries and parked loads always live here -- bodies too unless shared_file_cache is set
+    SharedFileCacheManager* shared_file_cache;
+    int32_t shared_file_cache_reader;
+    ResultCacheManager result_cache_mgr;
+    bool embedded; //hosted inside a tool (replay) -- the snapshot, capture, access log, and trace files in the static root are left alone
+    std::string cache_snapshot_path;
+    volatile sig_atomic_t cache_snapshot_requested;
+    volatile sig_atomic_t trace_dump_requested;
+    volatile sig_atomic_t shutdown_requested;
+
+    struct io_uring_sqe* get_sqe();
+    void submit_slot(struct io_uring_sqe* sqe, IOEventSlot* slot);
+    void submit_slot_watch(struct io_uring_sqe* sqe, IOEventSlot* slot);
+    IOEventSlot* acquire_response_slot(UserRequest* req);
+
+    void write_user_direct(IOEventSlot* slot, size_t size, const char* data);
+    void write_user_direct_wheaders(IOEventSlot* slot, size_t size, const char* data, const char* dkind);
+    void write_user_direct_aio_wheaders(IOEventSlot* slot, size_t size, const char* data, const char* dkind);
+    void write_user_file_contents(IOEventSlot* slot, const FileCachePermanentEntry* entry);
+    void write_user_shared_file_contents(IOEventSlot* slot, SharedFileCacheBlob* blob);
+    void write_user_dynamic_response(IOEventSlot* slot, size_t size, const char* data);
+
+    void send_static_content(IOEventSlot* slot, const char* str) {
+        this->write_user_direct(slot, strlen(str), str);
+    }
 
-    FileCacheManager file_cache_mgr;
-
-    void write_user_direct(UserRequest* req, size_t size, const char* data);
-    void write_user_direct_wheaders(UserRequest* req, size_t size, const char* data, const char* dkind);
-    void write_user_direct_aio_wheaders(UserRequest* req, size_t size, const char* data, const char* dkind);
-    void write_user_file_contents(UserRequest* req, size_t size, const char* data, bool should_release);
-    void write_user_dynamic_response(UserRequest* req, size_t size, const char* data);
-
-    void send_static_content(UserRequest* req, const char* str) {
-        this->write_user_direct(req, strlen(str), str);
+    void send_immediate_fixed_content(IOEventSlot* slot,  size_t size, const char* data, const char* dkind) {
+        this->write_user_direct_wheaders(slot, size, data, dkind);
     }
 
-    void send_immediate_fixed_content(UserRequest* req,  size_t size, const char* data, const char* dkind) {
-        this->write_user_direct_wheaders(req, size, data, dkind);
+    void send_compute_content(IOEventSlot* slot,  size_t size, const char* data, const char* dkind) {
+        this->write_user_direct_aio_wheaders(slot, size, data, dkind);
     }
 
-    void send_compute_content(UserRequest* req,  size_t size, const char* data, const char* dkind) {
-        this->write_user_direct_aio_wheaders(req, size, data, dkind);
+    void send_cache_file_content(IOEventSlot* slot, const FileCachePermanentEntry* entry) {
+        this->write_user_file_contents(slot, entry);
     }
 
-    void send_cache_file_content(UserRequest* req, size_t size, const char* data) {
-        this->write_user_file_contents(req, size, data, false);
+    //takes over one pin on the blob
+    void send_shared_file_content(IOEventSlot* slot, SharedFileCacheBlob* blob) {
+        this->write_user_shared_file_contents(slot, blob);
     }
 
-    void handle_error_code(UserRequest* req, RSErrorCode error_code);
+    bool try_send_cached_file(IOEventSlot* slot);
 
-    void process_user_connect(int listen_socket);
-    void process_user_request(IOUserRequestEvent* event, size_t read_size);
+    void send_metrics(IOEventSlot* slot);
+    void record_response_metrics(IOEventSlot* slot);
 
-    //TODO: process a user action request
-    void process_http_file_access(IOUserRequestEvent* req, const char* file_path, bool memoize);
+    void log_access(IOEventSlot* slot, int32_t res);
+    void submit_access_log();
+    void process_access_log(uint32_t tag, int32_t res);
+    void stop_accepting();
+    void flush_access_log();
+    void close_access_log();
+
+    void send_error_code(IOEventSlot* slot, RSErrorCode error_code);
+    void handle_error_code(IOEventSlot* slot, RSErrorCode error_code);
 
-    void process_fstat_result(IOFileStatEvent* event);
-    void process_fopen_result(IOFileOpenEvent* event, int file_descriptor);
-    void process_fread_result(IOFileReadEvent* event);
-    void process_fclose_result(IOFileCloseEvent* event);
+    void shed_user_connect(int client_socket);
+    void process_user_connect(int listen_socket);
+    void process_user_request(IOEventSlot* slot, size_t read_size);
 
-    void process_job_request(IOUserRequestEvent* event, int64_t value);
-    void process_job_complete(IOJobCompleteEvent* event);
+    //TODO: process a user action request
+    RingTask process_http_file_access(IOEventSlot* slot, const char* file_path, bool memoize);
+    void process_file_error(IOEventSlot* slot, bool memoize, RSErrorCode error_code);
+    void process_fclose_result(IOEventSlot* slot);
+
+    void process_job_request(IOEventSlot* slot, JobFunction fn, int64_t value, JobPriority priority, uint64_t deadline_ms, const char* memo_key);
+    void run_job_inline(IOEventSlot* slot, JobFunction fn, int64_t value, uint64_t deadline_ms, const char* memo_key, uint64_t memo_hash);
+    void finish_memoized_job(IOEventSlot* slot);
+    void process_job_complete(IOEventSlot* slot);
+    void arm_job_signal(IOEventSlot* slot);
+    void arm_hangup_watch(IOEventSlot* slot);
+    void cancel_hangup_watch(IOEventSlot* slot);
+    void process_client_hangup(IOEventSlot* slot, int32_t res);
+    void process_job_signal(IOEventSlot* slot);
+
+    void process_async_job_request(IOEventSlot* slot, JobFunction fn, int64_t value, JobPriority priority, const char* memo_key);
+    void process_task_complete(TaskEntry* task);
+    void process_task_status(IOEventSlot* slot, uint64_t task_id, uint64_t wait_ms);
+    void process_task_wait_timeout(IOEventSlot* slot, int32_t res);
+    void send_task_status(IOEventSlot* slot, const TaskEntry* task);
 
 public:
     RSHookServer();
     ~RSHookServer();
 
-    void startup(int port, int server_socket);
+    void startup(int port, int server_socket, bool embedded = false);
+
+    //Run on the runloop's thread once runloop has returned -- never from a signal handler
     void shutdown();
 
+    //Ask the runloop to return at its next wakeup so the caller can run shutdown (safe to call from a signal handler)
+    void request_shutdown() {
+        this->shutdown_requested = 1;
+        this->job_completions.wake();
+    }
+
+    //Ask the runloop to write a cache snapshot at the next wakeup (safe to call from a signal handler)
+    void request_cache_snapshot() {
+        this->cache_snapshot_requested = 1;
+        this->job_completions.wake();
+    }
+
+    void snapshot_cache();
+
+    //Ask the runloop to write the ring trace buffers at the next wakeup (safe to call from a signal handler -- no-op unless ENABLE_RING_TRACE)
+    void request_trace_dump() {
+        this->trace_dump_requested = 1;
+        this->job_completions.wake();
+    }
+
+    void dump_trace();
+
+    //Replace the default load shedding limits (call before the runloop starts)
+    void configure_admission(const AdmissionWatermarks& watermarks) {
+        this->admission.configure(watermarks);
+    }
+
+    //Replace the default budget for running predicted-cheap compute jobs inline on the runloop (0 always offloads)
+    void configure_inline_budget(uint64_t budget_us) {
+        this->job_costs.setBudget(budget_us);
+    }
+
+    //Ring for posting completions from another ring with MSG_RING -- a connected socket sent as the result of a RING_EVENT_TYPE_ACCEPT
+    //completion is served exactly as if the listener had accepted it (the replay tool feeds socketpairs in this way)
+    int get_ring_fd() const {
+        return this->ring.ring_fd;
+    }
+
     void runloop();
 };
 
@@ -0,0 +1,245 @@
+#include "sharedcache.h"
+
+#if ENABLE_SHARED_FILE_CACHE
+SharedFileCacheManager* getSharedFileCacheManager()
+{
+    static SharedFileCacheManager* s_shared_file_cache = new SharedFileCacheManager();
+    return s_shared_file_cache;
+}
+#endif
+
+SharedFileCacheBlob::SharedFileCacheBlob(const char* data, size_t size, const char* header, size_t header_size, struct statx_timestamp mtime): m_refcount(1), m_data(data), m_size(size), m_header(header), m_header_size(header_size), m_mtime(mtime)
+{
+    ;
+}
+
+SharedFileCacheBlob* SharedFileCacheBlob::create(const char* data, size_t size, const char* header, size_t header_size, struct statx_timestamp mtime)
+{
+    SharedFileCacheBlob* blob = SharedFileCacheBlob::allocate(size, header, header_size, mtime);
+    memcpy(blob->body(), data, size);
+
+    return blob;
+}
+
+SharedFileCacheBlob* SharedFileCacheBlob::allocate(size_t size, const char* header, size_t header_size, struct statx_timestamp mtime)
+{
+    //one block -- [blob][data + null][header + null]
+    uint8_t* mem = s_allocator.allocatebytesp2(sizeof(SharedFileCacheBlob) + size + 1 + header_size + 1);
+
+    char* cdata = (char*)(mem + sizeof(SharedFileCacheBlob));
+    cdata[size] = '\0';
+
+    char* cheader = cdata + size + 1;
+    memcpy(cheader, header, header_size);
+    cheader[header_size] = '\0';
+
+    return new (mem) SharedFileCacheBlob(cdata, size, cheader, header_size, mtime);
+}
+
+SharedFileCacheIndex* SharedFileCacheIndex::create(size_t count)
+{
+    SharedFileCacheIndex* index = s_allocator.allocate<SharedFileCacheIndex>();
+    index->m_count = count;
+    index->m_entries = (std::pair<FileCacheSmallKey<SMALL_CACHE_PATH>, SharedFileCacheBlob*>*)s_allocator.allocatebytesp2(std::max<size_t>(1, count) * sizeof(std::pair<FileCacheSmallKey<SMALL_CACHE_PATH>, SharedFileCacheBlob*>));
+
+    return index;
+}
+
+void SharedFileCacheIndex::destroy(SharedFileCacheIndex* index)
+{
+    s_allocator.freebytesp2((uint8_t*)index->m_entries, std::max<size_t>(1, index->m_count) * sizeof(std::pair<FileCacheSmallKey<SMALL_CACHE_PATH>, SharedFileCacheBlob*>));
+    s_allocator.freep2<SharedFileCacheIndex>(index);
+}
+
+SharedFileCacheBlob* SharedFileCacheIndex::find(const FileCacheSmallKey<SMALL_CACHE_PATH>& key) const
+{
+    size_t lo = 0;
+    size_t hi = this->m_count;
+    while(lo < hi) {
+        size_t mid = lo + ((hi - lo) / 2);
+        if(this->m_entries[mid].first < key) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    if(lo < this->m_count && this->m_entries[lo].first == key) {
+        return this->m_entries[lo].second;
+    }
+    else {
+        return nullptr;
+    }
+}
+
+SharedFileCacheManager::SharedFileCacheManager(): m_readers(), m_global_epoch(1), m_index(SharedFileCacheIndex::create(0)), m_writer_lock(), m_retired()
+{
+    for(size_t i = 0; i < SHARED_CACHE_MAX_READERS; ++i) {
+        this->m_readers[i].m_epoch.store(0, std::memory_order_relaxed);
+        this->m_readers[i].m_inuse.store(false, std::memory_order_relaxed);
+    }
+}
+
+SharedFileCacheManager::~SharedFileCacheManager()
+{
+    this->clear();
+    SharedFileCacheIndex::destroy(this->m_index.load(std::memory_order_relaxed));
+}
+
+int32_t SharedFileCacheManager::registerReader()
+{
+    for(int32_t i = 0; i < SHARED_CACHE_MAX_READERS; ++i) {
+        bool expected = false;
+        if(this->m_readers[i].m_inuse.compare_exchange_strong(expected, true, std::memory_order_acq_rel)) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+void SharedFileCacheManager::unregisterReader(int32_t reader)
+{
+    this->m_readers[reader].m_epoch.store(0, std::memory_order_release);
+    this->m_readers[reader].m_inuse.store(false, std::memory_order_release);
+}
+
+SharedFileCacheBlob* SharedFileCacheManager::tryGetPinned(int32_t reader, const char* path)
+{
+    size_t len = strlen(path);
+    if(len > SMALL_CACHE_PATH) {
+        return nullptr; //TODO: later implement larger key caching
+    }
+
+    FileCacheSmallKey<SMALL_CACHE_PATH> key(path, len);
+    ReaderSlot& slot = this->m_readers[reader];
+
+    //announce the epoch before touching the index so a writer will not reclaim anything we can see
+    slot.m_epoch.store(this->m_global_epoch.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+
+    SharedFileCacheIndex* index = this->m_index.load(std::memory_order_seq_cst);
+    SharedFileCacheBlob* blob = index->find(key);
+    if(blob != nullptr) {
+        blob->pin();
+    }
+
+    slot.m_epoch.store(0, std::memory_order_release);
+
+    return blob;
+}
+
+SharedFileCacheBlob* SharedFileCacheManager::put(const char* path, size_t pathsize, const char* data, size_t datasize, const char* header, size_t headersize, struct statx_timestamp mtime)
+{
+    if(pathsize > SMALL_CACHE_PATH) {
+        return nullptr; //TODO: later implement larger key caching
+    }
+
+    return this->put(path, pathsize, SharedFileCacheBlob::create(data, datasize, header, headersize, mtime));
+}
+
+SharedFileCacheBlob* SharedFileCacheManager::put(const char* path, size_t pathsize, SharedFileCacheBlob* blob)
+{
+    if(pathsize > SMALL_CACHE_PATH) {
+        blob->unpin();
+        return nullptr; //TODO: later implement larger key caching
+    }
+
+    FileCacheSmallKey<SMALL_CACHE_PATH> key(path, pathsize);
+    blob->pin(); //the caller's reference (the cache holds the one from allocate)
+
+    std::lock_guard<std::mutex> lock(this->m_writer_lock);
+
+    //copy on write -- build the new sorted index with the entry inserted (or replaced)
+    SharedFileCacheIndex* oldindex = this->m_index.load(std::memory_order_relaxed);
+    SharedFileCacheBlob* replaced = oldindex->find(key);
+
+    SharedFileCacheIndex* newindex = SharedFileCacheIndex::create(oldindex->m_count + (replaced != nullptr ? 0 : 1));
+
+    size_t j = 0;
+    bool placed = false;
+    for(size_t i = 0; i < oldindex->m_count; ++i) {
+        const auto& entry = oldindex->m_entries[i];
+        if(!placed && !(entry.first < key)) {
+            new (&newindex->m_entries[j++]) std::pair<FileCacheSmallKey<SMALL_CACHE_PATH>, SharedFileCacheBlob*>(key, blob);
+            placed = true;
+
+            if(entry.first == key) {
+                continue;
+            }
+        }
+
+        new (&newindex->m_entries[j++]) std::pair<FileCacheSmallKey<SMALL_CACHE_PATH>, SharedFileCacheBlob*>(entry);
+    }
+
+    if(!placed) {
+        new (&newindex->m_entries[j++]) std::pair<FileCacheSmallKey<SMALL_CACHE_PATH>, SharedFileCacheBlob*>(key, blob);
+    }
+    assert(j == newindex->m_count);
+
+    this->m_index.store(newindex, std::memory_order_seq_cst);
+
+    uint64_t retire_epoch = this->m_global_epoch.fetch_add(1, std::memory_order_seq_cst);
+    this->m_retired.push_back(RetiredIndex{retire_epoch, oldindex, replaced});
+
+    this->reclaim();
+
+    return blob;
+}
+
+uint64_t SharedFileCacheManager::minActiveEpoch() const
+{
+    uint64_t minepoch = UINT64_MAX;
+    for(size_t i = 0; i < SHARED_CACHE_MAX_READERS; ++i) {
+        uint64_t epoch = this->m_readers[i].m_epoch.load(std::memory_order_seq_cst);
+        if(epoch != 0) {
+            minepoch = std::min(minepoch, epoch);
+        }
+    }
+
+    return minepoch;
+}
+
+void SharedFileCacheManager::reclaim()
+{
+    //called with the writer lock held
+    uint64_t minepoch = this->minActiveEpoch();
+
+    size_t keep = 0;
+    for(size_t i = 0; i < this->m_retired.size(); ++i) {
+        RetiredIndex& retired = this->m_retired[i];
+        if(retired.m_epoch < minepoch) {
+            SharedFileCacheIndex::destroy(retired.m_index);
+            if(retired.m_replaced != nullptr) {
+                retired.m_replaced->unpin(); //drop the cache reference -- in-flight users still hold theirs
+            }
+        }
+        else {
+            this->m_retired[keep++] = retired;
+        }
+    }
+    this->m_retired.resize(keep);
+}
+
+void SharedFileCacheManager::clear()
+{
+    std::lock_guard<std::mutex> lock(this->m_writer_lock);
+
+    SharedFileCacheIndex* oldindex = this->m_index.load(std::memory_order_relaxed);
+    this->m_index.store(SharedFileCacheIndex::create(0), std::memory_order_seq_cst);
+
+    uint64_t retire_epoch = this->m_global_epoch.fetch_add(1, std::memory_order_seq_cst);
+
+    //wait out any lookups that could still see the old index then drop every cache reference it held
+    while(this->minActiveEpoch() <= retire_epoch) {
+        std::this_thread::yield();
+    }
+
+    for(size_t i = 0; i < oldindex->m_count; ++i) {
+        oldindex->m_entries[i].second->unpin();
+    }
+    SharedFileCacheIndex::destroy(oldindex);
+
+    //nothing can be reading the earlier retired indices now either
+    this->reclaim();
+}
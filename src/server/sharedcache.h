@@ -0,0 +1,153 @@
+#pragma once
+
+#include "common.h"
+#include "filemgr.h"
+
+#include <atomic>
+#include <mutex>
+
+//Serve static files from the process wide SharedFileCacheManager instead of a FileCacheManager per runloop
+#define ENABLE_SHARED_FILE_CACHE 0
+
+#define SHARED_CACHE_MAX_READERS 64
+#define SHARED_CACHE_CACHE_LINE 64
+
+/**
+ * Immutable cached file body + pre-rendered headers shared by all reader threads.
+ * The cache holds one reference, readers pin it for the duration of any async I/O that uses the buffers.
+ **/
+class SharedFileCacheBlob
+{
+private:
+    std::atomic<uint32_t> m_refcount;
+
+    SharedFileCacheBlob(const char* data, size_t size, const char* header, size_t header_size, struct statx_timestamp mtime);
+
+public:
+    const char* m_data;
+    size_t m_size;
+
+    const char* m_header;
+    size_t m_header_size;
+
+    struct statx_timestamp m_mtime;
+
+    static SharedFileCacheBlob* create(const char* data, size_t size, const char* header, size_t header_size, struct statx_timestamp mtime);
+
+    //blob with the header copied in and room for size body bytes that the caller fills through body() (e.g. reading the file straight into it) before putting it
+    static SharedFileCacheBlob* allocate(size_t size, const char* header, size_t header_size, struct statx_timestamp mtime);
+
+    char* body()
+    {
+        return (char*)this->m_data;
+    }
+
+    //the blob from its m_data pointer (the body follows the blob in the same block) -- how a write releases the pin it was given
+    static SharedFileCacheBlob* fromData(const void* data)
+    {
+        return (SharedFileCacheBlob*)((uint8_t*)data - sizeof(SharedFileCacheBlob));
+    }
+
+    void pin()
+    {
+        this->m_refcount.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void unpin()
+    {
+        if(this->m_refcount.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            s_allocator.freebytesp2((uint8_t*)this, sizeof(SharedFileCacheBlob) + this->m_size + 1 + this->m_header_size + 1);
+        }
+    }
+};
+
+/**
+ * Sorted immutable snapshot of the key -> blob mapping -- replaced wholesale by writers and searched without locks by readers
+ **/
+class SharedFileCacheIndex
+{
+public:
+    size_t m_count;
+    std::pair<FileCacheSmallKey<SMALL_CACHE_PATH>, SharedFileCacheBlob*>* m_entries;
+
+    static SharedFileCacheIndex* create(size_t count);
+    static void destroy(SharedFileCacheIndex* index);
+
+    SharedFileCacheBlob* find(const FileCacheSmallKey<SMALL_CACHE_PATH>& key) const;
+};
+
+/**
+ * File cache variant that several runloop threads can share with one copy of each file.
+ *   - Lookups are lock free -- a reader announces the current epoch in its slot, searches the current index snapshot, and pins the blob it returns.
+ *   - Writers are serialized on a mutex (fills are off the hot path), publish a new index copy, and retire the old one with the current epoch.
+ *   - Retired indices (and the cache's reference to replaced blobs) are reclaimed once no reader slot is still in an epoch at or before the retirement.
+ *
+ * Blobs and indices may be freed from whichever thread drops the last reference -- s_allocator is a per-thread heap and a free of another
+ * thread's block goes onto the owning slab's remote free list, so this is safe with any number of runloops.
+ **/
+class SharedFileCacheManager
+{
+private:
+    class alignas(SHARED_CACHE_CACHE_LINE) ReaderSlot
+    {
+    public:
+        std::atomic<uint64_t> m_epoch; //0 when not inside a lookup
+        std::atomic<bool> m_inuse;
+    };
+
+    class RetiredIndex
+    {
+    public:
+        uint64_t m_epoch;
+        SharedFileCacheIndex* m_index;
+        SharedFileCacheBlob* m_replaced;
+    };
+
+    ReaderSlot m_readers[SHARED_CACHE_MAX_READERS];
+
+    alignas(SHARED_CACHE_CACHE_LINE) std::atomic<uint64_t> m_global_epoch;
+    alignas(SHARED_CACHE_CACHE_LINE) std::atomic<SharedFileCacheIndex*> m_index;
+
+    std::mutex m_writer_lock;
+    std::vector<RetiredIndex> m_retired;
+
+    uint64_t minActiveEpoch() const;
+    void reclaim();
+
+public:
+    SharedFileCacheManager();
+    ~SharedFileCacheManager();
+
+    /**
+     * Claim a reader slot for the calling thread (once per runloop thread) -- returns -1 if all slots are taken
+     **/
+    int32_t registerReader();
+    void unregisterReader(int32_t reader);
+
+    /**
+     * Lock free lookup -- on a hit the returned blob is pinned and the caller must unpin it when the response using it completes
+     **/
+    SharedFileCacheBlob* tryGetPinned(int32_t reader, const char* path);
+
+    /**
+     * Copy the data + headers into a new shared blob and publish it (replacing any existing entry for the path).
+     * Returns the blob pinned for the caller (nullptr if the path is too long to cache).
+     **/
+    SharedFileCacheBlob* put(const char* path, size_t pathsize, const char* data, size_t datasize, const char* header, size_t headersize, struct statx_timestamp mtime);
+
+    /**
+     * Publish a blob the caller filled (from SharedFileCacheBlob::allocate) -- the cache takes over the reference from allocate.
+     * Returns the blob pinned for the caller (nullptr, with the blob released, if the path is too long to cache).
+     **/
+    SharedFileCacheBlob* put(const char* path, size_t pathsize, SharedFileCacheBlob* blob);
+
+    void clear();
+};
+
+#if ENABLE_SHARED_FILE_CACHE
+/**
+ * The process wide cache -- created on first use and never destroyed since other runloops may still hold pins (and the thread local
+ * s_allocator it frees through is already gone) at exit
+ **/
+SharedFileCacheManager* getSharedFileCacheManager();
+#endif
@@ -0,0 +1,195 @@
+#pragma once
+
+#include "common.h"
+#include "alloc.h"
+#include "jobs.h"
+#include "events.h"
+
+#include <vector>
+
+#define TASK_TABLE_SIZE 1024
+#define TASK_RESULT_TTL_MS 60000
+#define TASK_DEFAULT_DEADLINE_MS 300000
+#define TASK_MAX_WAIT_MS 30000
+
+#define TASK_STATUS_ROUTE "/hyper-status/"
+
+//job tags for tasks have both low bits set -- event slot tags (user_data) always have them clear
+#define JOB_TAG_TASK 0x3
+#define IS_TASK_JOB_TAG(T) (((T) & 0x3) == JOB_TAG_TASK)
+
+enum class TaskState : uint8_t
+{
+    Free,
+    Running,
+    Completed,
+    Failed
+};
+
+/**
+ * An async compute request that has already been answered with 202 -- the job descriptor lives here (not in a request arena) since
+ * the submitting connection is gone by the time the job finishes. Results are copied out of the AIO buffer and kept until they expire.
+ **/
+class TaskEntry
+{
+public:
+    uint32_t m_index;
+    uint32_t m_generation;
+    TaskState m_state;
+
+    JobDescriptor m_job;
+    const char* m_memo_key; //s_allocator owned copy (nullptr if the route is not deterministic)
+
+    const char* m_result;
+    size_t m_result_size;
+    uint64_t m_expires;
+
+    //long-poll status requests parked until the task finishes (or their timeout fires)
+    std::vector<IOEventSlot*> m_waiters;
+
+    uint64_t id() const
+    {
+        return (((uint64_t)this->m_generation) << 32) | this->m_index;
+    }
+
+    uint64_t jobTag() const
+    {
+        return (((uint64_t)this->m_index) << 2) | JOB_TAG_TASK;
+    }
+};
+
+/**
+ * Bounded table of async tasks -- ids carry a generation so a recycled entry never answers for an older task
+ **/
+class TaskTable
+{
+private:
+    TaskEntry* m_entries;
+    size_t m_cursor;
+
+    void reset(TaskEntry* task)
+    {
+        if(task->m_memo_key != nullptr) {
+            s_allocator.freebytesp2((uint8_t*)task->m_memo_key, s_strlen(task->m_memo_key) + 1);
+            task->m_memo_key = nullptr;
+        }
+
+        if(task->m_result != nullptr) {
+            s_allocator.freebytesp2((uint8_t*)task->m_result, task->m_result_size + 1);
+            task->m_result = nullptr;
+        }
+
+        task->m_result_size = 0;
+        task->m_generation++;
+        task->m_state = TaskState::Free;
+    }
+
+public:
+    TaskTable(): m_entries(nullptr), m_cursor(0) { ; }
+
+    ~TaskTable()
+    {
+        this->clear();
+        delete[] this->m_entries;
+    }
+
+    void initialize()
+    {
+        this->m_entries = new TaskEntry[TASK_TABLE_SIZE];
+        for(uint32_t i = 0; i < TASK_TABLE_SIZE; ++i) {
+            TaskEntry& task = this->m_entries[i];
+            task.m_index = i;
+            task.m_generation = 1;
+            task.m_state = TaskState::Free;
+            task.m_memo_key = nullptr;
+            task.m_result = nullptr;
+            task.m_result_size = 0;
+            task.m_expires = 0;
+        }
+    }
+
+    /**
+     * Find a free entry (recycling finished ones whose results have expired) -- nullptr when the table is full of live tasks
+     **/
+    TaskEntry* allocate(uint64_t now)
+    {
+        for(size_t i = 0; i < TASK_TABLE_SIZE; ++i) {
+            TaskEntry* task = this->m_entries + ((this->m_cursor + i) % TASK_TABLE_SIZE);
+
+            bool recyclable = (task->m_state == TaskState::Completed || task->m_state == TaskState::Failed) && task->m_expires <= now && task->m_waiters.empty();
+            if(recyclable) {
+                this->reset(task);
+            }
+
+            if(task->m_state == TaskState::Free) {
+                this->m_cursor = (task->m_index + 1) % TASK_TABLE_SIZE;
+                task->m_state = TaskState::Running;
+                return task;
+            }
+        }
+
+        return nullptr;
+    }
+
+    /**
+     * Give back an entry whose job never started (e.g. the pool rejected it)
+     **/
+    void release(TaskEntry* task)
+    {
+        this->reset(task);
+    }
+
+    TaskEntry* lookup(uint64_t id)
+    {
+        uint32_t idx = (uint32_t)(id & 0xFFFFFFFF);
+        if(idx >= TASK_TABLE_SIZE) {
+            return nullptr;
+        }
+
+        TaskEntry* task = this->m_entries + idx;
+        if(task->m_state == TaskState::Free || task->id() != id) {
+            return nullptr;
+        }
+
+        return task;
+    }
+
+    TaskEntry* fromJobTag(uint64_t tag)
+    {
+        return this->m_entries + (tag >> 2);
+    }
+
+    /**
+     * Record the finished job -- the result is copied out of its AIO buffer (which goes back to the allocator) and kept for the TTL
+     **/
+    void complete(TaskEntry* task, uint64_t now)
+    {
+        JobDescriptor& job = task->m_job;
+        if(job.status == JobStatus::Completed) {
+            task->m_result = s_allocator.strcopyp2((const char*)job.result, job.size);
+            task->m_result_size = job.size;
+            task->m_state = TaskState::Completed;
+        }
+        else {
+            task->m_state = TaskState::Failed;
+        }
+
+        s_aio_allocator.freeAIOBuffer(job.result);
+        job.result = nullptr;
+
+        task->m_expires = now + TASK_RESULT_TTL_MS;
+    }
+
+    void clear()
+    {
+        if(this->m_entries == nullptr) {
+            return;
+        }
+
+        for(size_t i = 0; i < TASK_TABLE_SIZE; ++i) {
+            if(this->m_entries[i].m_state != TaskState::Free) {
+                this->reset(this->m_entries + i);
+            }
+        }
+    }
+};
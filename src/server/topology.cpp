@@ -0,0 +1,177 @@
+#include "topology.h"
+
+#include <algorithm>
+
+#define TOPOLOGY_LINE_MAX 4096
+
+static bool s_read_sysfs_line(const char* path, char* buf, size_t size)
+{
+    FILE* f = fopen(path, "r");
+    if(f == nullptr) {
+        return false;
+    }
+
+    bool ok = (fgets(buf, (int)size, f) != nullptr);
+    fclose(f);
+
+    return ok;
+}
+
+std::vector<int32_t> CPUTopology::parseCPUList(const char* list)
+{
+    std::vector<int32_t> cpus;
+
+    const char* pos = list;
+    while(*pos != '\0' && *pos != '\n') {
+        char* end = nullptr;
+        long first = strtol(pos, &end, 10);
+        if(end == pos) {
+            break;
+        }
+
+        long last = first;
+        pos = end;
+        if(*pos == '-') {
+            last = strtol(pos + 1, &end, 10);
+            pos = end;
+        }
+
+        for(long cpu = first; cpu <= last; ++cpu) {
+            cpus.push_back((int32_t)cpu);
+        }
+
+        if(*pos == ',') {
+            pos++;
+        }
+    }
+
+    return cpus;
+}
+
+void CPUTopology::load()
+{
+    char line[TOPOLOGY_LINE_MAX];
+
+    std::vector<int32_t> online;
+    if(s_read_sysfs_line(TOPOLOGY_SYSFS_CPU_ONLINE, line, sizeof(line))) {
+        online = CPUTopology::parseCPUList(line);
+    }
+    if(online.empty()) {
+        for(size_t i = 0; i < std::max<size_t>(1, std::thread::hardware_concurrency()); ++i) {
+            online.push_back((int32_t)i);
+        }
+    }
+
+    //only the CPUs we are allowed on (cgroups and taskset both shrink this)
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    bool have_mask = (sched_getaffinity(0, sizeof(cpu_set_t), &allowed) == 0);
+
+    this->m_cpus.clear();
+    for(size_t i = 0; i < online.size(); ++i) {
+        if(!have_mask || CPU_ISSET(online[i], &allowed)) {
+            this->m_cpus.push_back(online[i]);
+        }
+    }
+    if(this->m_cpus.empty()) {
+        this->m_cpus.push_back(0);
+    }
+
+    this->m_cpu_node.assign(this->m_cpus.back() + 1, ALLOC_NODE_ANY);
+    for(size_t i = 0; i < this->m_cpus.size(); ++i) {
+        this->m_cpu_node[this->m_cpus[i]] = 0;
+    }
+
+    //node ids can be sparse so probe them all
+    this->m_node_count = 0;
+    for(int32_t node = 0; node < TOPOLOGY_MAX_NODES; ++node) {
+        char path[128];
+        std::snprintf(path, sizeof(path), TOPOLOGY_SYSFS_NODE_CPULIST, node);
+        if(!s_read_sysfs_line(path, line, sizeof(line))) {
+            continue;
+        }
+
+        bool used = false;
+        std::vector<int32_t> ncpus = CPUTopology::parseCPUList(line);
+        for(size_t i = 0; i < ncpus.size(); ++i) {
+            int32_t cpu = ncpus[i];
+            if(cpu >= 0 && (size_t)cpu < this->m_cpu_node.size() && this->m_cpu_node[cpu] != ALLOC_NODE_ANY) {
+                this->m_cpu_node[cpu] = node;
+                used = true;
+            }
+        }
+
+        if(used) {
+            this->m_node_count++;
+        }
+    }
+
+    this->m_node_count = std::max<size_t>(1, this->m_node_count);
+}
+
+CPUPlacement CPUTopology::reactorPlacement() const
+{
+    int32_t best = this->m_cpus[0];
+    for(size_t i = 1; i < this->m_cpus.size(); ++i) {
+        if(this->getNodeOf(this->m_cpus[i]) < this->getNodeOf(best)) {
+            best = this->m_cpus[i];
+        }
+    }
+
+    return CPUPlacement{best, this->getNodeOf(best)};
+}
+
+std::vector<CPUPlacement> CPUTopology::workerPlacement(const CPUPlacement& reactor, size_t count) const
+{
+    std::vector<CPUPlacement> order;
+    for(size_t i = 0; i < this->m_cpus.size(); ++i) {
+        int32_t cpu = this->m_cpus[i];
+        if(cpu != reactor.cpu) {
+            order.push_back(CPUPlacement{cpu, this->getNodeOf(cpu)});
+        }
+    }
+
+    //reactor's node first, then by node, keeping id order within a node
+    std::stable_sort(order.begin(), order.end(), [&reactor](const CPUPlacement& a, const CPUPlacement& b) {
+        bool alocal = (a.node == reactor.node);
+        bool blocal = (b.node == reactor.node);
+        if(alocal != blocal) {
+            return alocal;
+        }
+        return a.node < b.node;
+    });
+
+    if(order.empty()) {
+        //single CPU -- workers share it with the reactor
+        order.push_back(reactor);
+    }
+
+    if(count == 0) {
+        count = order.size();
+    }
+
+    std::vector<CPUPlacement> placement;
+    for(size_t i = 0; i < count; ++i) {
+        placement.push_back(order[i % order.size()]);
+    }
+
+    return placement;
+}
+
+bool s_place_current_thread(const CPUPlacement& placement)
+{
+#if ENABLE_TOPOLOGY_PLACEMENT
+    s_alloc_numa_node = placement.node;
+
+    if(placement.cpu < 0) {
+        return false;
+    }
+
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(placement.cpu, &cpuset);
+    return sched_setaffinity(0, sizeof(cpu_set_t), &cpuset) == 0;
+#else
+    return true;
+#endif
+}
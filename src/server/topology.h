@@ -0,0 +1,75 @@
+#pragma once
+
+#include "common.h"
+#include "alloc.h"
+
+#include <vector>
+#include <sched.h>
+#include <pthread.h>
+
+#define ENABLE_TOPOLOGY_PLACEMENT 1
+
+#define TOPOLOGY_SYSFS_CPU_ONLINE "/sys/devices/system/cpu/online"
+#define TOPOLOGY_SYSFS_NODE_CPULIST "/sys/devices/system/node/node%d/cpulist"
+#define TOPOLOGY_MAX_NODES 64
+
+/**
+ * Where one thread runs -- the CPU it is pinned to and the NUMA node its allocations are bound to
+ **/
+class CPUPlacement
+{
+public:
+    int32_t cpu;
+    int32_t node;
+};
+
+/**
+ * CPU and NUMA layout read from sysfs (restricted to the CPUs this process may run on).
+ * Machines (or containers) without the node entries are treated as a single node holding every usable CPU.
+ **/
+class CPUTopology
+{
+private:
+    std::vector<int32_t> m_cpus; //usable CPUs in id order
+    std::vector<int32_t> m_cpu_node; //indexed by CPU id (ALLOC_NODE_ANY for unusable ones)
+    size_t m_node_count;
+
+public:
+    CPUTopology(): m_cpus(), m_cpu_node(), m_node_count(1) { ; }
+
+    //"0-3,8,10-11" style lists as used throughout sysfs
+    static std::vector<int32_t> parseCPUList(const char* list);
+
+    void load();
+
+    size_t getNodeCount() const
+    {
+        return this->m_node_count;
+    }
+
+    size_t getCPUCount() const
+    {
+        return this->m_cpus.size();
+    }
+
+    int32_t getNodeOf(int32_t cpu) const
+    {
+        return (cpu >= 0 && (size_t)cpu < this->m_cpu_node.size()) ? this->m_cpu_node[cpu] : ALLOC_NODE_ANY;
+    }
+
+    /**
+     * The runloop takes the first usable CPU (on node 0 when there is one) -- it owns the listener so accepted sockets are steered there
+     **/
+    CPUPlacement reactorPlacement() const;
+
+    /**
+     * Worker CPUs -- the rest of the reactor's node first (to share its cache and memory), then the other nodes in order.
+     * A count of 0 picks one worker per usable CPU other than the reactor's.
+     **/
+    std::vector<CPUPlacement> workerPlacement(const CPUPlacement& reactor, size_t count) const;
+};
+
+/**
+ * Pin the calling thread and bind its future allocations (slabs, arenas, AIO buffers) to the placement's node
+ **/
+bool s_place_current_thread(const CPUPlacement& placement);
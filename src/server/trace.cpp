@@ -0,0 +1,75 @@
+#include "trace.h"
+
+#include <cstdio>
+#include <algorithm>
+#include <time.h>
+
+RingTracer s_ring_tracer;
+thread_local RingTraceBuffer* s_thread_trace = nullptr;
+
+void RingTraceBuffer::record(RingTraceKind kind, uint32_t slot_index, uint32_t slot_generation, uint32_t event_type, int32_t res, uint8_t op)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    uint64_t head = this->m_head.load(std::memory_order_relaxed);
+    RingTraceRecord& rec = this->m_records[head & (RING_TRACE_BUFFER_RECORDS - 1)];
+
+    rec.ts_ns = ((uint64_t)ts.tv_sec * 1000000000) + (uint64_t)ts.tv_nsec;
+    rec.slot_index = slot_index;
+    rec.slot_generation = slot_generation;
+    rec.event_type = event_type;
+    rec.res = res;
+    rec.kind = kind;
+    rec.op = op;
+    rec.reserved = 0;
+    rec.reserved2 = 0;
+
+    this->m_head.store(head + 1, std::memory_order_release);
+}
+
+RingTraceBuffer* RingTracer::registerBuffer()
+{
+    RingTraceBuffer* buffer = new RingTraceBuffer();
+    buffer->m_head.store(0, std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> lock(this->m_lock);
+    buffer->m_thread_id = this->m_thread_count++;
+    buffer->m_next = this->m_buffers;
+    this->m_buffers = buffer;
+
+    return buffer;
+}
+
+bool RingTracer::dump(const char* path)
+{
+    std::lock_guard<std::mutex> lock(this->m_lock);
+
+    FILE* f = fopen(path, "wb");
+    if(f == nullptr) {
+        return false;
+    }
+
+    RingTraceFileHeader header = { RING_TRACE_MAGIC, RING_TRACE_VERSION, (uint32_t)sizeof(RingTraceRecord), this->m_thread_count };
+    bool ok = (fwrite(&header, sizeof(header), 1, f) == 1);
+
+    for(RingTraceBuffer* buffer = this->m_buffers; buffer != nullptr && ok; buffer = buffer->m_next) {
+        uint64_t head = buffer->m_head.load(std::memory_order_acquire);
+        uint64_t count = (head < RING_TRACE_BUFFER_RECORDS) ? head : RING_TRACE_BUFFER_RECORDS;
+
+        RingTraceThreadHeader theader = { buffer->m_thread_id, (uint32_t)count };
+        ok = (fwrite(&theader, sizeof(theader), 1, f) == 1);
+
+        //oldest first -- the ring may have wrapped so this can take two writes
+        uint64_t start = head - count;
+        for(uint64_t i = 0; i < count && ok; ) {
+            size_t pos = (size_t)((start + i) & (RING_TRACE_BUFFER_RECORDS - 1));
+            size_t run = std::min<size_t>(count - i, RING_TRACE_BUFFER_RECORDS - pos);
+
+            ok = (fwrite(buffer->m_records + pos, sizeof(RingTraceRecord), run, f) == run);
+            i += run;
+        }
+    }
+
+    return (fclose(f) == 0) && ok;
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <atomic>
+#include <mutex>
+
+//Opt-in since every submission and completion pays for a clock read and a record write
+#define ENABLE_RING_TRACE 0
+
+#define RING_TRACE_BUFFER_RECORDS (1 << 16) //per thread -- the buffer wraps and keeps the most recent records
+#define RING_TRACE_FILE_NAME "rshook-trace.bin"
+
+#define RING_TRACE_MAGIC 0x43525452 //"RTRC"
+#define RING_TRACE_VERSION 1
+
+enum class RingTraceKind : uint8_t
+{
+    Accept, //res is the new socket (or error)
+    Submit, //SQE queued for the slot
+    Complete, //CQE picked up for the slot (before its handler runs)
+    Release, //slot went back to the table
+    JobStart, //worker picked up a job -- the slot fields hold the raw job tag (low word in slot_index, high word in slot_generation)
+    JobEnd
+};
+
+/**
+ * One fixed size record -- the file is these plus small headers so the converter can read it without parsing
+ **/
+class RingTraceRecord
+{
+public:
+    uint64_t ts_ns; //CLOCK_MONOTONIC
+    uint32_t slot_index;
+    uint32_t slot_generation;
+    uint32_t event_type; //RING_EVENT_* of the slot at the time
+    int32_t res;
+    RingTraceKind kind;
+    uint8_t op; //stage or watch
+    uint16_t reserved;
+    uint32_t reserved2;
+};
+static_assert(sizeof(RingTraceRecord) == 32, "Trace records should stay compact");
+
+class RingTraceFileHeader
+{
+public:
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t thread_count;
+};
+
+//followed by record_count records
+class RingTraceThreadHeader
+{
+public:
+    uint32_t thread_id;
+    uint32_t record_count;
+};
+
+/**
+ * Single writer ring of records for one thread -- the dump copies whatever is there (records being overwritten during a dump may be torn)
+ **/
+class RingTraceBuffer
+{
+public:
+    RingTraceRecord m_records[RING_TRACE_BUFFER_RECORDS];
+    std::atomic<uint64_t> m_head;
+    uint32_t m_thread_id;
+
+    RingTraceBuffer* m_next;
+
+    void record(RingTraceKind kind, uint32_t slot_index, uint32_t slot_generation, uint32_t event_type, int32_t res, uint8_t op);
+};
+
+class RingTracer
+{
+private:
+    std::mutex m_lock;
+    RingTraceBuffer* m_buffers;
+    uint32_t m_thread_count;
+
+public:
+    RingTracer(): m_lock(), m_buffers(nullptr), m_thread_count(0) { ; }
+
+    RingTraceBuffer* registerBuffer();
+
+    /**
+     * Write every thread's buffer to the file -- returns false if it could not be written
+     **/
+    bool dump(const char* path);
+};
+
+extern RingTracer s_ring_tracer;
+extern thread_local RingTraceBuffer* s_thread_trace;
+
+inline void s_trace_event(RingTraceKind kind, uint32_t slot_index, uint32_t slot_generation, uint32_t event_type, int32_t res, uint8_t op)
+{
+#if ENABLE_RING_TRACE
+    if(s_thread_trace == nullptr) {
+        s_thread_trace = s_ring_tracer.registerBuffer();
+    }
+    s_thread_trace->record(kind, slot_index, slot_generation, event_type, res, op);
+#endif
+}
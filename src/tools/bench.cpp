@@ -0,0 +1,408 @@
+#include "../server/server.h"
+
+#include "json.hpp"
+typedef nlohmann::json json;
+
+#include <cstdio>
+#include <cstring>
+#include <cinttypes>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#define BENCH_SAMPLES 11
+#define BENCH_SAMPLE_NS 20000000 //iterations are calibrated so one sample takes about this long
+#define BENCH_MAX_ITERATIONS ((uint64_t)1 << 32)
+
+#define BENCH_SUITE_NAME "rshook-microbench"
+#define BENCH_FORMAT_VERSION 1
+
+static uint64_t s_bench_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000) + (uint64_t)ts.tv_nsec;
+}
+
+//keep a value (and everything it depends on) from being optimized away without adding a store to the measured loop
+template<typename T>
+inline void s_bench_keep(const T& value)
+{
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+class BenchState
+{
+public:
+    uint64_t iterations;
+    uint64_t ops_per_iteration; //for cases that do a batch per iteration -- results are reported per op
+};
+
+typedef void (*BenchFunction)(BenchState& state);
+
+class BenchCase
+{
+public:
+    const char* name;
+    BenchFunction fn;
+    uint64_t ops_per_iteration;
+};
+
+class BenchResult
+{
+public:
+    const char* name;
+    uint64_t iterations;
+    double ns_median;
+    double ns_min;
+    double ns_max;
+};
+
+////////////////////////////////
+//Inputs
+
+//request shapes seen in practice -- a small API call (curl) and a browser navigation with the usual header load
+static const char* s_request_curl = "GET /fib HTTP/1.1\r\nHost: localhost:8000\r\nUser-Agent: curl/8.5.0\r\nAccept: */*\r\nContent-Type: application/json\r\nContent-Length: 13\r\n\r\n{\"value\": 20}";
+
+static const char* s_request_browser = "GET /static/js/app.bundle.js HTTP/1.1\r\nHost: localhost:8000\r\nConnection: keep-alive\r\nsec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\nsec-ch-ua-mobile: ?0\r\nUser-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\nsec-ch-ua-platform: \"Linux\"\r\nAccept: */*\r\nSec-Fetch-Site: same-origin\r\nSec-Fetch-Mode: no-cors\r\nSec-Fetch-Dest: script\r\nReferer: http://localhost:8000/index.html\r\nAccept-Encoding: gzip, deflate, br, zstd\r\nAccept-Language: en-US,en;q=0.9\r\nCookie: session=6b1f0c2e9a7d4e3f8c5b2a1d0e9f8c7b; theme=dark\r\n\r\n";
+
+static const char* s_static_paths[] = {
+    "/index.html", "/sample.json", "/favicon.ico", "/css/site.css", "/css/theme.css", "/js/app.js", "/js/vendor.js", "/js/worker.js",
+    "/img/logo.png", "/img/hero.jpg", "/img/icon.svg", "/fonts/body.woff2", "/docs/intro.html", "/docs/api.html", "/docs/faq.html", "/robots.txt",
+    "/manifest.json", "/data/config.json", "/data/users.json", "/data/items.json", "/about.html", "/contact.html", "/404.html", "/sitemap.xml"
+};
+#define BENCH_STATIC_PATH_COUNT (sizeof(s_static_paths) / sizeof(s_static_paths[0]))
+
+static const char* s_missing_paths[] = { "/index.htm", "/js/app.min.js", "/img/logo.gif", "/wp-login.php", "/.env", "/data/orders.json", "/docs/faq", "/style.css" };
+#define BENCH_MISSING_PATH_COUNT (sizeof(s_missing_paths) / sizeof(s_missing_paths[0]))
+
+//request sizes in bytes -- mostly small headers/strings with the occasional larger body
+static const size_t s_alloc_sizes[] = { 24, 40, 64, 100, 128, 200, 256, 520, 1024, 1500, 4000, 9000 };
+#define BENCH_ALLOC_SIZE_COUNT (sizeof(s_alloc_sizes) / sizeof(s_alloc_sizes[0]))
+
+class Bench64
+{
+public:
+    uint64_t words[8];
+};
+
+////////////////////////////////
+//Allocator
+
+static void bench_alloc_small_pair(BenchState& state)
+{
+    for(uint64_t i = 0; i < state.iterations; ++i) {
+        Bench64* obj = s_allocator.allocate<Bench64>();
+        s_bench_keep(obj);
+        s_allocator.freep2(obj);
+    }
+}
+
+static void bench_alloc_small_batch(BenchState& state)
+{
+    Bench64* objs[64];
+    for(uint64_t i = 0; i < state.iterations; ++i) {
+        for(size_t j = 0; j < 64; ++j) {
+            objs[j] = s_allocator.allocate<Bench64>();
+        }
+        s_bench_keep(objs);
+        for(size_t j = 0; j < 64; ++j) {
+            s_allocator.freep2(objs[j]);
+        }
+    }
+}
+
+static void bench_alloc_bytesp2_mixed(BenchState& state)
+{
+    for(uint64_t i = 0; i < state.iterations; ++i) {
+        size_t size = s_alloc_sizes[i % BENCH_ALLOC_SIZE_COUNT];
+        uint8_t* block = s_allocator.allocatebytesp2(size);
+        s_bench_keep(block);
+        s_allocator.freebytesp2(block, size);
+    }
+}
+
+static void bench_alloc_binidx(BenchState& state)
+{
+    size_t acc = 0;
+    for(uint64_t i = 0; i < state.iterations; ++i) {
+        size_t size = s_alloc_sizes[i % BENCH_ALLOC_SIZE_COUNT];
+        s_bench_keep(size); //runtime value, as on the allocatebytesp2 path
+        acc += s_binidx(size);
+    }
+    s_bench_keep(acc);
+}
+
+////////////////////////////////
+//File cache
+
+static FileCacheManager* s_bench_file_cache()
+{
+    static FileCacheManager* cache = nullptr;
+    if(cache == nullptr) {
+        cache = new FileCacheManager();
+
+        char header[HEADER_BUFFER_MAX];
+        struct statx_timestamp mtime = {};
+        for(size_t i = 0; i < BENCH_STATIC_PATH_COUNT; ++i) {
+            int hsize = build_file_headers(s_static_paths[i], 1024, header);
+            char* hcopy = s_allocator.strcopyp2(header, hsize);
+            char* data = (char*)s_allocator.allocatebytesp2(1024 + 1);
+            memset(data, 'x', 1024);
+
+            cache->put(s_static_paths[i], strlen(s_static_paths[i]), data, 1024, hcopy, hsize, mtime);
+        }
+    }
+    return cache;
+}
+
+static void bench_filecache_hit(BenchState& state)
+{
+    FileCacheManager* cache = s_bench_file_cache();
+    for(uint64_t i = 0; i < state.iterations; ++i) {
+        const FileCachePermanentEntry* entry = cache->tryGet(s_static_paths[i % BENCH_STATIC_PATH_COUNT]);
+        s_bench_keep(entry);
+    }
+}
+
+static void bench_filecache_miss(BenchState& state)
+{
+    FileCacheManager* cache = s_bench_file_cache();
+    for(uint64_t i = 0; i < state.iterations; ++i) {
+        const FileCachePermanentEntry* entry = cache->tryGet(s_missing_paths[i % BENCH_MISSING_PATH_COUNT]);
+        s_bench_keep(entry);
+    }
+}
+
+////////////////////////////////
+//HTTP
+
+static void bench_build_file_headers(BenchState& state)
+{
+    char header[HEADER_BUFFER_MAX];
+    for(uint64_t i = 0; i < state.iterations; ++i) {
+        int hsize = build_file_headers(s_static_paths[i % BENCH_STATIC_PATH_COUNT], 1024 + (i & 0xFFFF), header);
+        s_bench_keep(hsize);
+        s_bench_keep(header);
+    }
+}
+
+static void bench_build_dynamic_headers(BenchState& state)
+{
+    char header[HEADER_BUFFER_MAX];
+    for(uint64_t i = 0; i < state.iterations; ++i) {
+        int hsize = build_dynamic_headers(13 + (i & 0xFF), header);
+        s_bench_keep(hsize);
+        s_bench_keep(header);
+    }
+}
+
+template<const char** REQUEST>
+static void bench_extract_verb(BenchState& state)
+{
+    const char* request = *REQUEST;
+    for(uint64_t i = 0; i < state.iterations; ++i) {
+        s_bench_keep(request);
+        std::pair<const char*, const char*> verb = extractHTTPVerb(request);
+        s_bench_keep(verb);
+    }
+}
+
+template<const char** REQUEST>
+static void bench_extract_path(BenchState& state)
+{
+    const char* request = *REQUEST;
+    for(uint64_t i = 0; i < state.iterations; ++i) {
+        s_bench_keep(request);
+        std::pair<const char*, const char*> path = extractHTTPPath(request);
+        s_bench_keep(path);
+    }
+}
+
+template<const char** REQUEST>
+static void bench_extract_content_length(BenchState& state)
+{
+    const char* request = *REQUEST;
+    for(uint64_t i = 0; i < state.iterations; ++i) {
+        s_bench_keep(request);
+        size_t length = extractHTTPContentLength(request);
+        s_bench_keep(length);
+    }
+}
+
+template<const char** REQUEST>
+static void bench_extract_data(BenchState& state)
+{
+    const char* request = *REQUEST;
+    for(uint64_t i = 0; i < state.iterations; ++i) {
+        s_bench_keep(request);
+        std::pair<const char*, const char*> data = extractHTTPData(request, 13);
+        s_bench_keep(data);
+    }
+}
+
+template<const char** REQUEST>
+static void bench_extract_header(BenchState& state)
+{
+    const char* request = *REQUEST;
+    for(uint64_t i = 0; i < state.iterations; ++i) {
+        s_bench_keep(request);
+        const char* value = extractHTTPHeaderValue(request, "X-Priority: "); //absent -- the common case scans the whole request
+        s_bench_keep(value);
+    }
+}
+
+//the parsing process_user_request does before it dispatches (verb, path, route match, body)
+template<const char** REQUEST>
+static void bench_parse_request(BenchState& state)
+{
+    const char* request = *REQUEST;
+    for(uint64_t i = 0; i < state.iterations; ++i) {
+        s_bench_keep(request);
+        std::pair<const char*, const char*> verb = extractHTTPVerb(request);
+        std::pair<const char*, const char*> path = extractHTTPPath(request);
+        bool isfib = pathMatchsRoute(path, "/fib");
+        size_t datalen = extractHTTPContentLength(request);
+
+        s_bench_keep(verb);
+        s_bench_keep(isfib);
+        if(datalen != 0) {
+            std::pair<const char*, const char*> data = extractHTTPData(request, datalen);
+            s_bench_keep(data);
+        }
+    }
+}
+
+////////////////////////////////
+//JSON arguments
+
+static void bench_json_parse_fib(BenchState& state)
+{
+    const char* body = "{\"value\": 20}";
+    const char* bend = body + strlen(body);
+    for(uint64_t i = 0; i < state.iterations; ++i) {
+        s_bench_keep(body);
+        auto jpayload = json::parse(body, bend, nullptr, false, false);
+        int64_t value = jpayload["value"].get<int64_t>();
+        s_bench_keep(value);
+    }
+}
+
+static void bench_json_parse_helloname(BenchState& state)
+{
+    const char* body = "{\"name\": \"bob\"}";
+    const char* bend = body + strlen(body);
+    for(uint64_t i = 0; i < state.iterations; ++i) {
+        s_bench_keep(body);
+        auto jpayload = json::parse(body, bend, nullptr, false, false);
+        std::string name = jpayload["name"].get<std::string>();
+        s_bench_keep(name.data());
+    }
+}
+
+//the canonical argument form the result cache keys on
+static void bench_json_canonical_dump(BenchState& state)
+{
+    const char* body = "{\"value\": 20, \"mode\": \"fast\", \"tags\": [\"a\", \"b\"]}";
+    auto jpayload = json::parse(body, body + strlen(body), nullptr, false, false);
+    for(uint64_t i = 0; i < state.iterations; ++i) {
+        std::string canonical = jpayload.dump();
+        s_bench_keep(canonical.data());
+    }
+}
+
+static const BenchCase s_bench_cases[] = {
+    { "alloc/allocate_small_pair", bench_alloc_small_pair, 1 },
+    { "alloc/allocate_small_batch64", bench_alloc_small_batch, 64 },
+    { "alloc/allocatebytesp2_mixed_pair", bench_alloc_bytesp2_mixed, 1 },
+    { "alloc/binidx_mixed", bench_alloc_binidx, 1 },
+
+    { "filecache/tryGet_hit", bench_filecache_hit, 1 },
+    { "filecache/tryGet_miss", bench_filecache_miss, 1 },
+
+    { "http/build_file_headers", bench_build_file_headers, 1 },
+    { "http/build_dynamic_headers", bench_build_dynamic_headers, 1 },
+    { "http/extractHTTPVerb_curl", bench_extract_verb<&s_request_curl>, 1 },
+    { "http/extractHTTPVerb_browser", bench_extract_verb<&s_request_browser>, 1 },
+    { "http/extractHTTPPath_curl", bench_extract_path<&s_request_curl>, 1 },
+    { "http/extractHTTPPath_browser", bench_extract_path<&s_request_browser>, 1 },
+    { "http/extractHTTPContentLength_curl", bench_extract_content_length<&s_request_curl>, 1 },
+    { "http/extractHTTPContentLength_browser", bench_extract_content_length<&s_request_browser>, 1 },
+    { "http/extractHTTPData_curl", bench_extract_data<&s_request_curl>, 1 },
+    { "http/extractHTTPHeaderValue_absent_curl", bench_extract_header<&s_request_curl>, 1 },
+    { "http/extractHTTPHeaderValue_absent_browser", bench_extract_header<&s_request_browser>, 1 },
+    { "http/parse_request_curl", bench_parse_request<&s_request_curl>, 1 },
+    { "http/parse_request_browser", bench_parse_request<&s_request_browser>, 1 },
+
+    { "json/parse_fib_args", bench_json_parse_fib, 1 },
+    { "json/parse_helloname_args", bench_json_parse_helloname, 1 },
+    { "json/canonical_dump", bench_json_canonical_dump, 1 }
+};
+#define BENCH_CASE_COUNT (sizeof(s_bench_cases) / sizeof(s_bench_cases[0]))
+
+////////////////////////////////
+//Driver
+
+static uint64_t s_bench_time(const BenchCase& bc, uint64_t iterations)
+{
+    BenchState state = { iterations, bc.ops_per_iteration };
+
+    uint64_t start = s_bench_now_ns();
+    bc.fn(state);
+    return s_bench_now_ns() - start;
+}
+
+/**
+ * Grow the iteration count until a sample takes BENCH_SAMPLE_NS (this also warms caches and the allocator), then take
+ * BENCH_SAMPLES samples -- the median is the headline number and min/max show the noise
+ **/
+static BenchResult s_bench_run(const BenchCase& bc)
+{
+    uint64_t iterations = 1;
+    while(iterations < BENCH_MAX_ITERATIONS) {
+        uint64_t elapsed = s_bench_time(bc, iterations);
+        if(elapsed >= BENCH_SAMPLE_NS) {
+            break;
+        }
+
+        uint64_t scaled = (elapsed == 0) ? iterations * 100 : (iterations * BENCH_SAMPLE_NS * 11) / (elapsed * 10);
+        iterations = std::clamp<uint64_t>(scaled, iterations + 1, iterations * 100);
+    }
+
+    double samples[BENCH_SAMPLES];
+    for(size_t i = 0; i < BENCH_SAMPLES; ++i) {
+        samples[i] = (double)s_bench_time(bc, iterations) / (double)(iterations * bc.ops_per_iteration);
+    }
+    std::sort(samples, samples + BENCH_SAMPLES);
+
+    return BenchResult{ bc.name, iterations * bc.ops_per_iteration, samples[BENCH_SAMPLES / 2], samples[0], samples[BENCH_SAMPLES - 1] };
+}
+
+int main(int argc, char** argv)
+{
+    //bench [filter] -- runs the cases whose name contains filter and writes one JSON document (one result per line) to stdout
+    const char* filter = (argc > 1) ? argv[1] : nullptr;
+
+    std::vector<BenchResult> results;
+    for(size_t i = 0; i < BENCH_CASE_COUNT; ++i) {
+        if(filter != nullptr && strstr(s_bench_cases[i].name, filter) == nullptr) {
+            continue;
+        }
+
+        fprintf(stderr, "%-48s", s_bench_cases[i].name);
+        BenchResult result = s_bench_run(s_bench_cases[i]);
+        fprintf(stderr, "%10.2f ns/op\n", result.ns_median);
+
+        results.push_back(result);
+    }
+
+    printf("{\"suite\": \"%s\", \"version\": %d, \"compiler\": \"%s\", \"results\": [\n", BENCH_SUITE_NAME, BENCH_FORMAT_VERSION, __VERSION__);
+    for(size_t i = 0; i < results.size(); ++i) {
+        const BenchResult& r = results[i];
+        printf("  {\"name\": \"%s\", \"ns_per_op\": %.3f, \"ns_per_op_min\": %.3f, \"ns_per_op_max\": %.3f, \"ops\": %" PRIu64 "}%s\n", r.name, r.ns_median, r.ns_min, r.ns_max, r.iterations, (i + 1 < results.size()) ? "," : "");
+    }
+    printf("]}\n");
+
+    return 0;
+}
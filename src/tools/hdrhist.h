@@ -0,0 +1,118 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+//HDR histogram in ns -- values below 2^HDR_SUB_BITS are exact and each power of two above is split into 2^HDR_SUB_BITS buckets (~0.4% precision)
+#define HDR_SUB_BITS 8
+#define HDR_SUB_COUNT (1 << HDR_SUB_BITS)
+#define HDR_MAX_EXPONENT 40
+#define HDR_BUCKET_COUNT (HDR_SUB_COUNT + (HDR_MAX_EXPONENT - HDR_SUB_BITS) * HDR_SUB_COUNT)
+
+/**
+ * Log-linear histogram of latencies -- fixed buckets so per thread histograms merge by adding counts
+ **/
+class HDRHistogram
+{
+public:
+    std::vector<uint64_t> m_counts;
+    uint64_t m_total;
+    uint64_t m_sum;
+    uint64_t m_max;
+
+    HDRHistogram(): m_counts(HDR_BUCKET_COUNT, 0), m_total(0), m_sum(0), m_max(0) { ; }
+
+    static size_t bucketOf(uint64_t v)
+    {
+        if(v < HDR_SUB_COUNT) {
+            return (size_t)v;
+        }
+
+        size_t e = 63 - __builtin_clzll(v);
+        if(e >= HDR_MAX_EXPONENT) {
+            return HDR_BUCKET_COUNT - 1;
+        }
+
+        size_t sub = (size_t)(v >> (e - HDR_SUB_BITS)) & (HDR_SUB_COUNT - 1);
+        return HDR_SUB_COUNT + (e - HDR_SUB_BITS) * HDR_SUB_COUNT + sub;
+    }
+
+    //largest value that lands in the bucket
+    static uint64_t bucketHighest(size_t idx)
+    {
+        if(idx < HDR_SUB_COUNT) {
+            return idx;
+        }
+
+        size_t e = HDR_SUB_BITS + (idx - HDR_SUB_COUNT) / HDR_SUB_COUNT;
+        uint64_t sub = (idx - HDR_SUB_COUNT) % HDR_SUB_COUNT;
+        return ((HDR_SUB_COUNT + sub + 1) << (e - HDR_SUB_BITS)) - 1;
+    }
+
+    void record(uint64_t v, uint64_t count = 1)
+    {
+        this->m_counts[bucketOf(v)] += count;
+        this->m_total += count;
+        this->m_sum += v * count;
+        this->m_max = std::max(this->m_max, v);
+    }
+
+    void add(const HDRHistogram& other)
+    {
+        for(size_t i = 0; i < HDR_BUCKET_COUNT; ++i) {
+            this->m_counts[i] += other.m_counts[i];
+        }
+        this->m_total += other.m_total;
+        this->m_sum += other.m_sum;
+        this->m_max = std::max(this->m_max, other.m_max);
+    }
+
+    uint64_t quantile(double q) const
+    {
+        uint64_t target = std::max<uint64_t>(1, (uint64_t)std::ceil(q * this->m_total));
+
+        uint64_t seen = 0;
+        for(size_t i = 0; i < HDR_BUCKET_COUNT; ++i) {
+            seen += this->m_counts[i];
+            if(seen >= target) {
+                return std::min(bucketHighest(i), this->m_max);
+            }
+        }
+
+        return this->m_max;
+    }
+
+    uint64_t mean() const
+    {
+        return (this->m_total != 0) ? (this->m_sum / this->m_total) : 0;
+    }
+
+    /**
+     * Closed loop correction for coordinated omission (as in HdrHistogram's copyCorrectedForCoordinatedOmission) -- a sample that took
+     * longer than the expected interval stalled the requests that connection would have sent meanwhile, so fill in those missing samples
+     **/
+    HDRHistogram correctedFor(uint64_t expected_interval) const
+    {
+        HDRHistogram corrected;
+        for(size_t i = 0; i < HDR_BUCKET_COUNT; ++i) {
+            uint64_t count = this->m_counts[i];
+            if(count == 0) {
+                continue;
+            }
+
+            uint64_t value = std::min(bucketHighest(i), this->m_max);
+            corrected.record(value, count);
+
+            if(expected_interval != 0) {
+                for(uint64_t missing = value - std::min(value, expected_interval); missing >= expected_interval; missing -= expected_interval) {
+                    corrected.record(missing, count);
+                }
+            }
+        }
+        return corrected;
+    }
+};
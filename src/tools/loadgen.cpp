@@ -0,0 +1,988 @@
+#include <liburing.h>
+
+#include "hdrhist.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <cinttypes>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define LOADGEN_DEFAULT_PORT 8000
+#define LOADGEN_DEFAULT_THREADS 2
+#define LOADGEN_DEFAULT_CONNECTIONS 32
+#define LOADGEN_DEFAULT_DURATION_S 10
+#define LOADGEN_DEFAULT_WARMUP_S 2
+#define LOADGEN_DEFAULT_TIMEOUT_MS 5000
+
+#define LOADGEN_RECV_BUFFER 16384
+#define LOADGEN_MAX_BACKLOG (1 << 20) //open loop requests waiting for a free connection before the generator starts dropping
+#define LOADGEN_TICK_NS 10000000 //longest wait in the event loop (timeouts are checked at this granularity)
+#define LOADGEN_MAX_RING_ENTRIES 32768
+
+#define LOADGEN_OP_CONNECT 0x1
+#define LOADGEN_OP_SEND 0x2
+#define LOADGEN_OP_RECV 0x3
+
+#define LOADGEN_USER_DATA(CONN, GEN, OP) ((((uint64_t)(GEN)) << 32) | (((uint64_t)(CONN)) << 8) | ((uint64_t)(OP)))
+#define LOADGEN_USER_DATA_CONN(UD) ((uint32_t)(((UD) & 0xFFFFFFFF) >> 8))
+#define LOADGEN_USER_DATA_GEN(UD) ((uint32_t)((UD) >> 32))
+#define LOADGEN_USER_DATA_OP(UD) ((uint32_t)((UD) & 0xFF))
+
+static uint64_t s_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000) + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * One request kind in the mix -- same fields as the ops in the test/load scripts
+ **/
+class ScenarioOp
+{
+public:
+    std::string endpoint;
+    std::string verb;
+    std::string argdata; //empty for null
+    int expected_status;
+    bool check_data;
+    std::string expected_data;
+
+    std::string label;
+    std::string wire; //the full request, built once
+};
+
+class LoadConfig
+{
+public:
+    std::string host;
+    int port;
+    size_t threads;
+    size_t connections;
+    double duration_s;
+    double warmup_s;
+    double rate; //total req/s -- 0 runs closed loop
+    size_t pipeline;
+    bool keepalive;
+    uint64_t timeout_ns;
+    uint64_t expected_interval_ns; //closed loop coordinated omission correction -- 0 uses the mean latency
+    std::string scenario_path;
+
+    struct sockaddr_in addr;
+    std::vector<ScenarioOp> ops;
+};
+
+enum class LoadError : uint8_t
+{
+    Connect,
+    IO,
+    Closed,
+    Timeout,
+    Status,
+    Body,
+    Count
+};
+
+static const char* s_error_names[(size_t)LoadError::Count] = { "connect", "io", "closed", "timeout", "status", "body" };
+
+class OutstandingRequest
+{
+public:
+    uint32_t op;
+    uint64_t intended_ns; //when the schedule wanted it sent -- latency measured from here is free of coordinated omission
+    uint64_t sent_ns;
+};
+
+enum class ConnState : uint8_t
+{
+    Idle,
+    Connecting,
+    Open,
+    Closing //waiting for the ring to give back the old socket's operations before the buffers are reused
+};
+
+class LoadConnection
+{
+public:
+    int fd;
+    uint32_t gen;
+    ConnState state;
+    uint32_t ops_inflight;
+
+    std::deque<OutstandingRequest> outstanding;
+
+    std::string out_pending;
+    std::string out_sending;
+    size_t sent_offset;
+    bool send_inflight;
+
+    std::string in;
+    char recv_buffer[LOADGEN_RECV_BUFFER];
+
+    LoadConnection(): fd(-1), gen(0), state(ConnState::Idle), ops_inflight(0), outstanding(), out_pending(), out_sending(), sent_offset(0), send_inflight(false), in() { ; }
+};
+
+/**
+ * Per thread results -- merged after the run
+ **/
+class LoadStats
+{
+public:
+    std::vector<HDRHistogram> corrected;
+    std::vector<HDRHistogram> raw;
+    std::vector<uint64_t> completed;
+    uint64_t errors[(size_t)LoadError::Count];
+    uint64_t dropped;
+    int connect_errno; //first failure reason -- usually refused or out of local ports
+
+    LoadStats(size_t opcount): corrected(opcount), raw(opcount), completed(opcount, 0), errors{0}, dropped(0), connect_errno(0) { ; }
+};
+
+class LoadThread
+{
+private:
+    const LoadConfig& m_cfg;
+    size_t m_thread_id;
+    struct io_uring m_ring;
+
+    std::vector<LoadConnection*> m_conns;
+    size_t m_depth;
+    size_t m_conn_cursor;
+    size_t m_op_cursor;
+
+    std::deque<OutstandingRequest> m_backlog;
+    uint64_t m_next_send;
+    uint64_t m_interval_ns;
+
+    uint64_t m_measure_start;
+    uint64_t m_end;
+
+public:
+    LoadStats stats;
+
+    LoadThread(const LoadConfig& cfg, size_t thread_id, size_t conn_count): m_cfg(cfg), m_thread_id(thread_id), m_ring(), m_conns(), m_depth(cfg.keepalive ? cfg.pipeline : 1), m_conn_cursor(0), m_op_cursor(thread_id), m_backlog(), m_next_send(0), m_interval_ns(0), m_measure_start(0), m_end(0), stats(cfg.ops.size())
+    {
+        for(size_t i = 0; i < conn_count; ++i) {
+            this->m_conns.push_back(new LoadConnection());
+        }
+    }
+
+    ~LoadThread()
+    {
+        for(size_t i = 0; i < this->m_conns.size(); ++i) {
+            delete this->m_conns[i];
+        }
+    }
+
+    void run(uint64_t start);
+
+private:
+    struct io_uring_sqe* get_sqe()
+    {
+        struct io_uring_sqe* sqe = io_uring_get_sqe(&this->m_ring);
+        if(sqe == nullptr) {
+            io_uring_submit(&this->m_ring);
+            sqe = io_uring_get_sqe(&this->m_ring);
+        }
+        return sqe;
+    }
+
+    uint32_t next_op()
+    {
+        return (uint32_t)(this->m_op_cursor++ % this->m_cfg.ops.size());
+    }
+
+    bool has_capacity(const LoadConnection* conn) const
+    {
+        if(conn->state == ConnState::Closing) {
+            return false;
+        }
+        if(!this->m_cfg.keepalive && conn->state != ConnState::Idle) {
+            return false;
+        }
+        return conn->outstanding.size() < this->m_depth;
+    }
+
+    void open_conn(uint32_t idx);
+    void close_conn(uint32_t idx);
+    void fail_outstanding(LoadConnection* conn, LoadError error);
+    void queue_request(uint32_t idx, const OutstandingRequest& req);
+    void flush_sends(uint32_t idx);
+    void arm_recv(uint32_t idx);
+
+    void dispatch(uint64_t now);
+    void check_timeouts(uint64_t now);
+    void process_cqe(struct io_uring_cqe* cqe);
+    void process_responses(uint32_t idx, bool eof);
+    void record_response(const OutstandingRequest& req, int status, const char* body, size_t body_len);
+};
+
+void LoadThread::open_conn(uint32_t idx)
+{
+    LoadConnection* conn = this->m_conns[idx];
+
+    conn->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(conn->fd == -1) {
+        if(this->stats.connect_errno == 0) {
+            this->stats.connect_errno = errno;
+        }
+        this->fail_outstanding(conn, LoadError::Connect);
+        return;
+    }
+
+    int one = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    conn->state = ConnState::Connecting;
+    conn->ops_inflight++;
+
+    struct io_uring_sqe* sqe = this->get_sqe();
+    io_uring_prep_connect(sqe, conn->fd, (const struct sockaddr*)&this->m_cfg.addr, sizeof(this->m_cfg.addr));
+    io_uring_sqe_set_data64(sqe, LOADGEN_USER_DATA(idx, conn->gen, LOADGEN_OP_CONNECT));
+}
+
+void LoadThread::close_conn(uint32_t idx)
+{
+    LoadConnection* conn = this->m_conns[idx];
+
+    if(conn->fd != -1) {
+        //shutdown first so any recv/send still on the ring completes (the ring holds its own reference to the socket)
+        shutdown(conn->fd, SHUT_RDWR);
+        close(conn->fd);
+        conn->fd = -1;
+    }
+
+    conn->gen++;
+    conn->state = (conn->ops_inflight == 0) ? ConnState::Idle : ConnState::Closing;
+
+    conn->out_pending.clear();
+    conn->out_sending.clear();
+    conn->sent_offset = 0;
+    conn->send_inflight = false;
+    conn->in.clear();
+}
+
+void LoadThread::fail_outstanding(LoadConnection* conn, LoadError error)
+{
+    this->stats.errors[(size_t)error] += conn->outstanding.size();
+    conn->outstanding.clear();
+}
+
+void LoadThread::queue_request(uint32_t idx, const OutstandingRequest& req)
+{
+    LoadConnection* conn = this->m_conns[idx];
+
+    OutstandingRequest sent = req;
+    sent.sent_ns = s_now_ns();
+    conn->outstanding.push_back(sent);
+    conn->out_pending += this->m_cfg.ops[req.op].wire;
+
+    if(conn->state == ConnState::Idle) {
+        this->open_conn(idx);
+    }
+    else if(conn->state == ConnState::Open) {
+        this->flush_sends(idx);
+    }
+}
+
+void LoadThread::flush_sends(uint32_t idx)
+{
+    LoadConnection* conn = this->m_conns[idx];
+    if(conn->send_inflight || conn->out_pending.empty()) {
+        return;
+    }
+
+    conn->out_sending.swap(conn->out_pending);
+    conn->out_pending.clear();
+    conn->sent_offset = 0;
+    conn->send_inflight = true;
+    conn->ops_inflight++;
+
+    struct io_uring_sqe* sqe = this->get_sqe();
+    io_uring_prep_send(sqe, conn->fd, conn->out_sending.data(), conn->out_sending.size(), MSG_NOSIGNAL);
+    io_uring_sqe_set_data64(sqe, LOADGEN_USER_DATA(idx, conn->gen, LOADGEN_OP_SEND));
+}
+
+void LoadThread::arm_recv(uint32_t idx)
+{
+    LoadConnection* conn = this->m_conns[idx];
+    conn->ops_inflight++;
+
+    struct io_uring_sqe* sqe = this->get_sqe();
+    io_uring_prep_recv(sqe, conn->fd, conn->recv_buffer, LOADGEN_RECV_BUFFER, 0);
+    io_uring_sqe_set_data64(sqe, LOADGEN_USER_DATA(idx, conn->gen, LOADGEN_OP_RECV));
+}
+
+void LoadThread::dispatch(uint64_t now)
+{
+    size_t count = this->m_conns.size();
+    bool closed_loop = (this->m_cfg.rate == 0.0);
+
+    //one pass over the connections (starting where the last dispatch left off) handing each free one requests until it is full
+    for(size_t i = 0; i < count; ++i) {
+        uint32_t idx = (uint32_t)((this->m_conn_cursor + i) % count);
+        LoadConnection* conn = this->m_conns[idx];
+
+        while(this->has_capacity(conn)) {
+            if(closed_loop) {
+                if(now >= this->m_end) {
+                    return;
+                }
+                this->queue_request(idx, OutstandingRequest{this->next_op(), now, 0});
+            }
+            else {
+                if(this->m_backlog.empty()) {
+                    this->m_conn_cursor = idx;
+                    return;
+                }
+                this->queue_request(idx, this->m_backlog.front());
+                this->m_backlog.pop_front();
+            }
+
+            if(!this->m_cfg.keepalive) {
+                break;
+            }
+        }
+    }
+}
+
+void LoadThread::check_timeouts(uint64_t now)
+{
+    for(uint32_t idx = 0; idx < this->m_conns.size(); ++idx) {
+        LoadConnection* conn = this->m_conns[idx];
+        //requests dispatched this iteration were stamped after now was read
+        if(!conn->outstanding.empty() && now > conn->outstanding.front().sent_ns && now - conn->outstanding.front().sent_ns > this->m_cfg.timeout_ns) {
+            this->fail_outstanding(conn, LoadError::Timeout);
+            this->close_conn(idx);
+        }
+    }
+}
+
+void LoadThread::record_response(const OutstandingRequest& req, int status, const char* body, size_t body_len)
+{
+    const ScenarioOp& op = this->m_cfg.ops[req.op];
+
+    if(status != op.expected_status) {
+        this->stats.errors[(size_t)LoadError::Status]++;
+        return;
+    }
+    if(op.check_data && (body_len != op.expected_data.size() || memcmp(body, op.expected_data.data(), body_len) != 0)) {
+        this->stats.errors[(size_t)LoadError::Body]++;
+        return;
+    }
+
+    if(req.intended_ns < this->m_measure_start || req.intended_ns >= this->m_end) {
+        return;
+    }
+
+    uint64_t now = s_now_ns();
+    this->stats.corrected[req.op].record(now - req.intended_ns);
+    this->stats.raw[req.op].record(now - req.sent_ns);
+    this->stats.completed[req.op]++;
+}
+
+static bool s_header_value(const char* headers, size_t len, const char* name, size_t& value)
+{
+    size_t namelen = strlen(name);
+    for(const char* line = headers; line < headers + len; ) {
+        const char* eol = (const char*)memchr(line, '\n', (headers + len) - line);
+        if(eol == nullptr) {
+            eol = headers + len;
+        }
+
+        if((size_t)(eol - line) > namelen && strncasecmp(line, name, namelen) == 0 && line[namelen] == ':') {
+            value = (size_t)strtoull(line + namelen + 1, nullptr, 10);
+            return true;
+        }
+        line = eol + 1;
+    }
+    return false;
+}
+
+void LoadThread::process_responses(uint32_t idx, bool eof)
+{
+    LoadConnection* conn = this->m_conns[idx];
+
+    while(!conn->outstanding.empty()) {
+        const char* data = conn->in.data();
+        size_t size = conn->in.size();
+
+        const char* hend = (const char*)memmem(data, size, "\r\n\r\n", 4);
+        if(hend == nullptr) {
+            break;
+        }
+
+        size_t header_len = (size_t)(hend - data) + 4;
+        int status = (size > 9) ? atoi(data + 9) : 0; //"HTTP/1.x NNN"
+
+        size_t content_length = 0;
+        size_t body_len;
+        if(s_header_value(data, header_len, "Content-Length", content_length)) {
+            if(size < header_len + content_length) {
+                break;
+            }
+            body_len = content_length;
+        }
+        else {
+            //no length (the fixed error pages) -- the body runs to the close
+            if(!eof) {
+                break;
+            }
+            body_len = size - header_len;
+        }
+
+        OutstandingRequest req = conn->outstanding.front();
+        conn->outstanding.pop_front();
+
+        this->record_response(req, status, data + header_len, body_len);
+        conn->in.erase(0, header_len + body_len);
+    }
+}
+
+void LoadThread::process_cqe(struct io_uring_cqe* cqe)
+{
+    uint32_t idx = LOADGEN_USER_DATA_CONN(cqe->user_data);
+    LoadConnection* conn = this->m_conns[idx];
+    conn->ops_inflight--;
+
+    if(LOADGEN_USER_DATA_GEN(cqe->user_data) != conn->gen) {
+        //left over from a socket already closed -- once the last one is back the connection can be reused
+        if(conn->state == ConnState::Closing && conn->ops_inflight == 0) {
+            conn->state = ConnState::Idle;
+        }
+        return;
+    }
+
+    switch(LOADGEN_USER_DATA_OP(cqe->user_data)) {
+        case LOADGEN_OP_CONNECT: {
+            if(cqe->res < 0) {
+                if(this->stats.connect_errno == 0) {
+                    this->stats.connect_errno = -cqe->res;
+                }
+                this->fail_outstanding(conn, LoadError::Connect);
+                this->close_conn(idx);
+                break;
+            }
+
+            conn->state = ConnState::Open;
+            this->arm_recv(idx);
+            this->flush_sends(idx);
+            break;
+        }
+        case LOADGEN_OP_SEND: {
+            if(cqe->res < 0) {
+                this->fail_outstanding(conn, LoadError::IO);
+                this->close_conn(idx);
+                break;
+            }
+
+            conn->sent_offset += (size_t)cqe->res;
+            if(conn->sent_offset < conn->out_sending.size()) {
+                conn->ops_inflight++;
+                struct io_uring_sqe* sqe = this->get_sqe();
+                io_uring_prep_send(sqe, conn->fd, conn->out_sending.data() + conn->sent_offset, conn->out_sending.size() - conn->sent_offset, MSG_NOSIGNAL);
+                io_uring_sqe_set_data64(sqe, LOADGEN_USER_DATA(idx, conn->gen, LOADGEN_OP_SEND));
+                break;
+            }
+
+            conn->send_inflight = false;
+            this->flush_sends(idx);
+            break;
+        }
+        case LOADGEN_OP_RECV: {
+            if(cqe->res < 0) {
+                this->fail_outstanding(conn, LoadError::IO);
+                this->close_conn(idx);
+                break;
+            }
+
+            bool eof = (cqe->res == 0);
+            conn->in.append(conn->recv_buffer, (size_t)cqe->res);
+            this->process_responses(idx, eof);
+
+            if(eof) {
+                //anything still queued on this connection was sent to a server that hung up (no keep-alive, or fewer responses than requests)
+                this->fail_outstanding(conn, LoadError::Closed);
+                this->close_conn(idx);
+            }
+            else if(!this->m_cfg.keepalive && conn->outstanding.empty()) {
+                this->close_conn(idx);
+            }
+            else {
+                this->arm_recv(idx);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+void LoadThread::run(uint64_t start)
+{
+    size_t entries = 64;
+    while(entries < std::min<size_t>(this->m_conns.size() * 4 + 64, LOADGEN_MAX_RING_ENTRIES)) {
+        entries <<= 1;
+    }
+
+    int ret = io_uring_queue_init((unsigned)entries, &this->m_ring, 0);
+    if(ret < 0) {
+        fprintf(stderr, "io_uring_queue_init failed: %s\n", strerror(-ret));
+        return;
+    }
+
+    this->m_measure_start = start + (uint64_t)(this->m_cfg.warmup_s * 1000000000.0);
+    this->m_end = this->m_measure_start + (uint64_t)(this->m_cfg.duration_s * 1000000000.0);
+
+    if(this->m_cfg.rate != 0.0) {
+        //stagger the threads' schedules so the combined arrivals stay evenly spaced
+        double thread_rate = this->m_cfg.rate / this->m_cfg.threads;
+        this->m_interval_ns = std::max<uint64_t>(1, (uint64_t)(1000000000.0 / thread_rate));
+        this->m_next_send = start + (this->m_interval_ns * this->m_thread_id) / this->m_cfg.threads;
+    }
+
+    uint64_t last_timeout_check = start;
+    while(true) {
+        uint64_t now = s_now_ns();
+
+        if(this->m_interval_ns != 0) {
+            while(this->m_next_send <= now && this->m_next_send < this->m_end) {
+                if(this->m_backlog.size() < LOADGEN_MAX_BACKLOG) {
+                    this->m_backlog.push_back(OutstandingRequest{this->next_op(), this->m_next_send, 0});
+                }
+                else {
+                    this->stats.dropped++;
+                }
+                this->m_next_send += this->m_interval_ns;
+            }
+        }
+
+        this->dispatch(now);
+
+        if(now - last_timeout_check >= LOADGEN_TICK_NS) {
+            this->check_timeouts(now);
+            last_timeout_check = now;
+        }
+
+        if(now >= this->m_end) {
+            bool drained = this->m_backlog.empty();
+            for(size_t i = 0; i < this->m_conns.size() && drained; ++i) {
+                drained = this->m_conns[i]->outstanding.empty();
+            }
+
+            if(drained || now >= this->m_end + this->m_cfg.timeout_ns) {
+                break;
+            }
+        }
+
+        uint64_t wait_ns = LOADGEN_TICK_NS;
+        if(this->m_interval_ns != 0 && this->m_next_send < this->m_end) {
+            wait_ns = std::min<uint64_t>(wait_ns, (this->m_next_send > now) ? (this->m_next_send - now) : 0);
+        }
+
+        io_uring_submit(&this->m_ring);
+
+        struct io_uring_cqe* cqe = nullptr;
+        if(wait_ns != 0) {
+            struct __kernel_timespec ts = { (long long)(wait_ns / 1000000000), (long long)(wait_ns % 1000000000) };
+            io_uring_wait_cqe_timeout(&this->m_ring, &cqe, &ts);
+        }
+
+        while(io_uring_peek_cqe(&this->m_ring, &cqe) == 0) {
+            this->process_cqe(cqe);
+            io_uring_cqe_seen(&this->m_ring, cqe);
+        }
+    }
+
+    //whatever was never sent still counts against the run
+    this->stats.errors[(size_t)LoadError::Timeout] += this->m_backlog.size();
+    for(uint32_t idx = 0; idx < this->m_conns.size(); ++idx) {
+        this->fail_outstanding(this->m_conns[idx], LoadError::Timeout);
+        this->close_conn(idx);
+    }
+
+    io_uring_queue_exit(&this->m_ring);
+}
+
+////////////////////////////////
+//Scenarios
+
+//quoted JS string (single or double quotes) or null at pos -- returns false if neither
+static bool s_parse_js_string(const std::string& text, size_t pos, std::string& value, bool& isnull)
+{
+    while(pos < text.size() && isspace((unsigned char)text[pos])) {
+        pos++;
+    }
+
+    isnull = false;
+    if(text.compare(pos, 4, "null") == 0) {
+        isnull = true;
+        value.clear();
+        return true;
+    }
+
+    if(pos >= text.size() || (text[pos] != '\'' && text[pos] != '"')) {
+        return false;
+    }
+
+    char quote = text[pos++];
+    value.clear();
+    while(pos < text.size() && text[pos] != quote) {
+        if(text[pos] == '\\' && pos + 1 < text.size()) {
+            pos++;
+        }
+        value.push_back(text[pos++]);
+    }
+    return pos < text.size();
+}
+
+static size_t s_find_field(const std::string& text, const char* field, size_t begin, size_t end)
+{
+    size_t pos = text.find(field, begin);
+    if(pos == std::string::npos || pos >= end) {
+        return std::string::npos;
+    }
+    return pos + strlen(field);
+}
+
+/**
+ * Pull the ops array out of a load script (test/load/simple.js style) -- each op starts at its `endpoint:` field and owns the fields up to the next one
+ **/
+static bool s_parse_scenario(const std::string& text, std::vector<ScenarioOp>& ops)
+{
+    size_t pos = s_find_field(text, "endpoint:", 0, text.size());
+    while(pos != std::string::npos) {
+        size_t next = s_find_field(text, "endpoint:", pos, text.size());
+        size_t end = (next != std::string::npos) ? next : text.size();
+
+        ScenarioOp op;
+        bool isnull = false;
+        if(!s_parse_js_string(text, pos, op.endpoint, isnull) || isnull) {
+            return false;
+        }
+
+        op.verb = "GET";
+        size_t fpos = s_find_field(text, "verb:", pos, end);
+        if(fpos != std::string::npos) {
+            s_parse_js_string(text, fpos, op.verb, isnull);
+        }
+
+        fpos = s_find_field(text, "argdata:", pos, end);
+        if(fpos != std::string::npos) {
+            s_parse_js_string(text, fpos, op.argdata, isnull);
+        }
+
+        op.expected_status = 200;
+        fpos = s_find_field(text, "expectedStatusCode:", pos, end);
+        if(fpos != std::string::npos) {
+            op.expected_status = atoi(text.c_str() + fpos);
+        }
+
+        op.check_data = false;
+        fpos = s_find_field(text, "expectedData:", pos, end);
+        if(fpos != std::string::npos) {
+            op.check_data = s_parse_js_string(text, fpos, op.expected_data, isnull) && !isnull;
+        }
+
+        ops.push_back(op);
+        pos = next;
+    }
+
+    return !ops.empty();
+}
+
+static void s_default_scenario(std::vector<ScenarioOp>& ops)
+{
+    //the mix from test/load/simple.js
+    ops.push_back(ScenarioOp{"/hello", "get", "", 200, true, "{\"message\": \"Hello, world!\"}", "", ""});
+    ops.push_back(ScenarioOp{"/fib", "get", "{\"value\": 10}", 200, true, "{\"value\": 55}", "", ""});
+    ops.push_back(ScenarioOp{"/helloname", "get", "{\"name\": \"bob\"}", 200, true, "{\"message\": \"Hello, bob!\"}", "", ""});
+    ops.push_back(ScenarioOp{"/fib", "get", "{\"value\": 20}", 200, true, "{\"value\": 6765}", "", ""});
+    ops.push_back(ScenarioOp{"/sample.json", "get", "", 200, false, "", "", ""});
+}
+
+static void s_build_requests(LoadConfig& cfg)
+{
+    for(size_t i = 0; i < cfg.ops.size(); ++i) {
+        ScenarioOp& op = cfg.ops[i];
+
+        std::string verb = op.verb;
+        std::transform(verb.begin(), verb.end(), verb.begin(), ::toupper);
+
+        op.label = verb + " " + op.endpoint + (op.argdata.empty() ? "" : " " + op.argdata);
+
+        op.wire = verb + " " + op.endpoint + " HTTP/1.1\r\nHost: " + cfg.host + "\r\n";
+        op.wire += "Content-Type: application/json\r\nContent-Length: " + std::to_string(op.argdata.size()) + "\r\n";
+        op.wire += cfg.keepalive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+        op.wire += "\r\n" + op.argdata;
+    }
+}
+
+////////////////////////////////
+//Driver
+
+static void s_usage()
+{
+    fprintf(stderr, "Usage: loadgen [options]\n");
+    fprintf(stderr, "  --host H             server address (default 127.0.0.1)\n");
+    fprintf(stderr, "  --port N             server port (default %d)\n", LOADGEN_DEFAULT_PORT);
+    fprintf(stderr, "  --threads N          generator threads, one ring each (default %d)\n", LOADGEN_DEFAULT_THREADS);
+    fprintf(stderr, "  --connections N      total connections across threads (default %d)\n", LOADGEN_DEFAULT_CONNECTIONS);
+    fprintf(stderr, "  --rate R             open loop at R req/s total -- omit (or 0) for closed loop\n");
+    fprintf(stderr, "  --duration S         measured seconds (default %d)\n", LOADGEN_DEFAULT_DURATION_S);
+    fprintf(stderr, "  --warmup S           unmeasured seconds first (default %d)\n", LOADGEN_DEFAULT_WARMUP_S);
+    fprintf(stderr, "  --keepalive          reuse connections (default is a connection per request)\n");
+    fprintf(stderr, "  --pipeline D         requests in flight per keep-alive connection (default 1)\n");
+    fprintf(stderr, "  --timeout MS         per request timeout (default %d)\n", LOADGEN_DEFAULT_TIMEOUT_MS);
+    fprintf(stderr, "  --expected-us US     closed loop coordinated omission interval (default the mean latency)\n");
+    fprintf(stderr, "  --scenario FILE      load script with an ops array like test/load/simple.js (default is that mix)\n");
+}
+
+static bool s_parse_args(int argc, char** argv, LoadConfig& cfg)
+{
+    cfg.host = "127.0.0.1";
+    cfg.port = LOADGEN_DEFAULT_PORT;
+    cfg.threads = LOADGEN_DEFAULT_THREADS;
+    cfg.connections = LOADGEN_DEFAULT_CONNECTIONS;
+    cfg.duration_s = LOADGEN_DEFAULT_DURATION_S;
+    cfg.warmup_s = LOADGEN_DEFAULT_WARMUP_S;
+    cfg.rate = 0.0;
+    cfg.pipeline = 1;
+    cfg.keepalive = false;
+    cfg.timeout_ns = (uint64_t)LOADGEN_DEFAULT_TIMEOUT_MS * 1000000;
+    cfg.expected_interval_ns = 0;
+
+    for(int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        const char* val = (i + 1 < argc) ? argv[i + 1] : nullptr;
+
+        if(strcmp(arg, "--keepalive") == 0) {
+            cfg.keepalive = true;
+            continue;
+        }
+
+        if(val == nullptr) {
+            return false;
+        }
+        i++;
+
+        if(strcmp(arg, "--host") == 0) {
+            cfg.host = val;
+        }
+        else if(strcmp(arg, "--port") == 0) {
+            cfg.port = atoi(val);
+        }
+        else if(strcmp(arg, "--threads") == 0) {
+            cfg.threads = (size_t)std::max(1, atoi(val));
+        }
+        else if(strcmp(arg, "--connections") == 0) {
+            cfg.connections = (size_t)std::max(1, atoi(val));
+        }
+        else if(strcmp(arg, "--rate") == 0) {
+            cfg.rate = std::max(0.0, atof(val));
+        }
+        else if(strcmp(arg, "--duration") == 0) {
+            cfg.duration_s = atof(val);
+        }
+        else if(strcmp(arg, "--warmup") == 0) {
+            cfg.warmup_s = atof(val);
+        }
+        else if(strcmp(arg, "--pipeline") == 0) {
+            cfg.pipeline = (size_t)std::max(1, atoi(val));
+        }
+        else if(strcmp(arg, "--timeout") == 0) {
+            cfg.timeout_ns = (uint64_t)std::max(1, atoi(val)) * 1000000;
+        }
+        else if(strcmp(arg, "--expected-us") == 0) {
+            cfg.expected_interval_ns = (uint64_t)(atof(val) * 1000.0);
+        }
+        else if(strcmp(arg, "--scenario") == 0) {
+            cfg.scenario_path = val;
+        }
+        else {
+            return false;
+        }
+    }
+
+    cfg.threads = std::min(cfg.threads, cfg.connections);
+    return true;
+}
+
+static bool s_resolve(LoadConfig& cfg)
+{
+    memset(&cfg.addr, 0, sizeof(cfg.addr));
+    cfg.addr.sin_family = AF_INET;
+    cfg.addr.sin_port = htons(cfg.port);
+
+    if(inet_pton(AF_INET, cfg.host.c_str(), &cfg.addr.sin_addr) == 1) {
+        return true;
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo* res = nullptr;
+    if(getaddrinfo(cfg.host.c_str(), nullptr, &hints, &res) != 0 || res == nullptr) {
+        return false;
+    }
+
+    cfg.addr.sin_addr = ((struct sockaddr_in*)res->ai_addr)->sin_addr;
+    freeaddrinfo(res);
+    return true;
+}
+
+static bool s_load_scenario(LoadConfig& cfg)
+{
+    if(cfg.scenario_path.empty()) {
+        s_default_scenario(cfg.ops);
+        return true;
+    }
+
+    FILE* f = fopen(cfg.scenario_path.c_str(), "r");
+    if(f == nullptr) {
+        return false;
+    }
+
+    std::string text;
+    char buffer[4096];
+    size_t n;
+    while((n = fread(buffer, 1, sizeof(buffer), f)) != 0) {
+        text.append(buffer, n);
+    }
+    fclose(f);
+
+    return s_parse_scenario(text, cfg.ops);
+}
+
+static void s_print_row(const char* label, const HDRHistogram& hist)
+{
+    printf("  %-40s %10" PRIu64 " %10.1f %10.1f %10.1f %10.1f %10.1f\n", label, hist.m_total, hist.mean() / 1000.0, hist.quantile(0.5) / 1000.0, hist.quantile(0.99) / 1000.0, hist.quantile(0.999) / 1000.0, hist.m_max / 1000.0);
+}
+
+static void s_print_table(const char* title, const LoadConfig& cfg, const std::vector<HDRHistogram>& hists, const HDRHistogram& total)
+{
+    printf("\n%s (us)\n", title);
+    printf("  %-40s %10s %10s %10s %10s %10s %10s\n", "route", "count", "mean", "p50", "p99", "p999", "max");
+    for(size_t i = 0; i < cfg.ops.size(); ++i) {
+        s_print_row(cfg.ops[i].label.c_str(), hists[i]);
+    }
+    s_print_row("all", total);
+}
+
+int main(int argc, char** argv)
+{
+    LoadConfig cfg;
+    if(!s_parse_args(argc, argv, cfg)) {
+        s_usage();
+        return 1;
+    }
+
+    if(!s_resolve(cfg)) {
+        fprintf(stderr, "Cannot resolve %s\n", cfg.host.c_str());
+        return 1;
+    }
+
+    if(!s_load_scenario(cfg)) {
+        fprintf(stderr, "Cannot load a scenario from %s\n", cfg.scenario_path.c_str());
+        return 1;
+    }
+    s_build_requests(cfg);
+
+    if(cfg.keepalive == false && cfg.pipeline > 1) {
+        fprintf(stderr, "Pipelining needs --keepalive -- running with one request per connection\n");
+    }
+
+    std::vector<LoadThread*> workers;
+    for(size_t t = 0; t < cfg.threads; ++t) {
+        size_t conns = (cfg.connections / cfg.threads) + ((t < cfg.connections % cfg.threads) ? 1 : 0);
+        workers.push_back(new LoadThread(cfg, t, conns));
+    }
+
+    if(cfg.rate != 0.0) {
+        printf("Open loop at %.0f req/s", cfg.rate);
+    }
+    else {
+        printf("Closed loop");
+    }
+    printf(" -- %zu threads, %zu connections, %s, pipeline %zu, %.1fs warmup + %.1fs measured against %s:%d\n", cfg.threads, cfg.connections, cfg.keepalive ? "keep-alive" : "connection per request", cfg.keepalive ? cfg.pipeline : 1, cfg.warmup_s, cfg.duration_s, cfg.host.c_str(), cfg.port);
+
+    uint64_t start = s_now_ns();
+    std::vector<std::thread> threads;
+    for(size_t t = 0; t < workers.size(); ++t) {
+        threads.emplace_back([&workers, t, start]() { workers[t]->run(start); });
+    }
+    for(size_t t = 0; t < threads.size(); ++t) {
+        threads[t].join();
+    }
+
+    LoadStats totals(cfg.ops.size());
+    for(size_t t = 0; t < workers.size(); ++t) {
+        for(size_t i = 0; i < cfg.ops.size(); ++i) {
+            totals.corrected[i].add(workers[t]->stats.corrected[i]);
+            totals.raw[i].add(workers[t]->stats.raw[i]);
+            totals.completed[i] += workers[t]->stats.completed[i];
+        }
+        for(size_t e = 0; e < (size_t)LoadError::Count; ++e) {
+            totals.errors[e] += workers[t]->stats.errors[e];
+        }
+        totals.dropped += workers[t]->stats.dropped;
+        if(totals.connect_errno == 0) {
+            totals.connect_errno = workers[t]->stats.connect_errno;
+        }
+    }
+
+    HDRHistogram raw_all;
+    for(size_t i = 0; i < cfg.ops.size(); ++i) {
+        raw_all.add(totals.raw[i]);
+    }
+
+    if(cfg.rate == 0.0) {
+        //closed loop never sees the requests a stalled connection did not send -- backfill them at the expected interval
+        uint64_t interval = (cfg.expected_interval_ns != 0) ? cfg.expected_interval_ns : raw_all.mean();
+        for(size_t i = 0; i < cfg.ops.size(); ++i) {
+            totals.corrected[i] = totals.raw[i].correctedFor(interval);
+        }
+        printf("Coordinated omission correction interval %.1f us\n", interval / 1000.0);
+    }
+
+    HDRHistogram corrected_all;
+    for(size_t i = 0; i < cfg.ops.size(); ++i) {
+        corrected_all.add(totals.corrected[i]);
+    }
+
+    printf("\nCompleted %" PRIu64 " requests in %.2fs -- %.1f req/s\n", raw_all.m_total, cfg.duration_s, raw_all.m_total / cfg.duration_s);
+    printf("Errors:");
+    for(size_t e = 0; e < (size_t)LoadError::Count; ++e) {
+        printf(" %s %" PRIu64, s_error_names[e], totals.errors[e]);
+    }
+    printf(" dropped %" PRIu64 "\n", totals.dropped);
+    if(totals.connect_errno != 0) {
+        printf("First connect error: %s\n", strerror(totals.connect_errno));
+    }
+
+    s_print_table("Latency corrected for coordinated omission", cfg, totals.corrected, corrected_all);
+    s_print_table("Latency from send (uncorrected)", cfg, totals.raw, raw_all);
+
+    for(size_t t = 0; t < workers.size(); ++t) {
+        delete workers[t];
+    }
+    return 0;
+}
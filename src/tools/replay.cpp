@@ -0,0 +1,665 @@
+#include "../server/server.h"
+
+#include "hdrhist.h"
+
+#include <cinttypes>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define REPLAY_DEFAULT_PORT 8000
+#define REPLAY_DEFAULT_CONCURRENCY 256
+#define REPLAY_DEFAULT_TIMEOUT_MS 5000
+
+#define REPLAY_RECV_BUFFER 16384
+#define REPLAY_TICK_NS 10000000
+#define REPLAY_MAX_ROUTES 16 //routes beyond this (by count) are folded into the total only
+
+#define REPLAY_OP_INJECT 0x1 //MSG_RING of the server end of a socketpair into the server's ring
+#define REPLAY_OP_CONNECT 0x2
+#define REPLAY_OP_SEND 0x3
+#define REPLAY_OP_RECV 0x4
+
+#define REPLAY_USER_DATA(SLOT, GEN, OP) ((((uint64_t)(GEN)) << 32) | (((uint64_t)(SLOT)) << 8) | ((uint64_t)(OP)))
+#define REPLAY_USER_DATA_SLOT(UD) ((uint32_t)(((UD) & 0xFFFFFFFF) >> 8))
+#define REPLAY_USER_DATA_GEN(UD) ((uint32_t)((UD) >> 32))
+#define REPLAY_USER_DATA_OP(UD) ((uint32_t)((UD) & 0xFF))
+
+static uint64_t s_replay_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000) + (uint64_t)ts.tv_nsec;
+}
+
+enum class ReplayMode : uint8_t
+{
+    Pair, //server runs in this process and each request gets a socketpair -- no network stack involved
+    Loopback //requests go to a running server over TCP
+};
+
+class ReplayConfig
+{
+public:
+    std::string capture_path;
+    ReplayMode mode;
+    std::string host;
+    int port;
+    double speed; //1 replays at the recorded pace, 0 as fast as the concurrency allows
+    size_t concurrency;
+    uint64_t timeout_ns;
+
+    struct sockaddr_in addr;
+};
+
+class CapturedRequest
+{
+public:
+    uint64_t arrival_us;
+    const char* data;
+    uint32_t size;
+    uint32_t route; //index into the route names
+};
+
+class ReplayCapture
+{
+public:
+    std::vector<uint8_t> bytes;
+    std::vector<CapturedRequest> requests;
+    std::vector<std::string> routes;
+};
+
+class ReplaySlot
+{
+public:
+    int fd;
+    uint32_t gen;
+    uint32_t ops_inflight;
+    bool busy;
+    bool done; //response finished (or failed) -- the slot frees once the ring gives back its last operation
+    bool failed;
+    bool timed_out;
+
+    size_t request;
+    uint64_t scheduled_ns;
+    uint64_t sent_ns;
+    size_t sent_offset;
+
+    std::string response;
+    char recv_buffer[REPLAY_RECV_BUFFER];
+
+    ReplaySlot(): fd(-1), gen(0), ops_inflight(0), busy(false), done(false), failed(false), timed_out(false), request(0), scheduled_ns(0), sent_ns(0), sent_offset(0), response() { ; }
+};
+
+class ReplayStats
+{
+public:
+    std::vector<HDRHistogram> scheduled; //from the recorded (scaled) arrival -- includes any time spent waiting for a free slot
+    std::vector<HDRHistogram> service; //from the send
+    std::map<int, uint64_t> statuses;
+    uint64_t io_errors;
+    uint64_t timeouts;
+    uint64_t digest; //order independent combination of (request index, response bytes) -- equal across runs that got the same answers
+
+    ReplayStats(size_t routes): scheduled(routes), service(routes), statuses(), io_errors(0), timeouts(0), digest(0) { ; }
+};
+
+class ReplayDriver
+{
+private:
+    const ReplayConfig& m_cfg;
+    const ReplayCapture& m_capture;
+    int m_server_ring_fd;
+
+    struct io_uring m_ring;
+    std::vector<ReplaySlot*> m_slots;
+    std::vector<uint32_t> m_free;
+
+public:
+    ReplayStats stats;
+
+    ReplayDriver(const ReplayConfig& cfg, const ReplayCapture& capture, int server_ring_fd): m_cfg(cfg), m_capture(capture), m_server_ring_fd(server_ring_fd), m_ring(), m_slots(), m_free(), stats(capture.routes.size())
+    {
+        for(size_t i = 0; i < cfg.concurrency; ++i) {
+            this->m_slots.push_back(new ReplaySlot());
+            this->m_free.push_back((uint32_t)(cfg.concurrency - 1 - i));
+        }
+    }
+
+    ~ReplayDriver()
+    {
+        for(size_t i = 0; i < this->m_slots.size(); ++i) {
+            delete this->m_slots[i];
+        }
+    }
+
+    bool run();
+
+private:
+    struct io_uring_sqe* get_sqe()
+    {
+        struct io_uring_sqe* sqe = io_uring_get_sqe(&this->m_ring);
+        if(sqe == nullptr) {
+            io_uring_submit(&this->m_ring);
+            sqe = io_uring_get_sqe(&this->m_ring);
+        }
+        return sqe;
+    }
+
+    void submit_op(uint32_t idx, uint32_t op);
+    bool start_request(size_t request, uint64_t scheduled_ns);
+    void process_cqe(struct io_uring_cqe* cqe);
+    void maybe_finish(uint32_t idx);
+    void check_timeouts(uint64_t now);
+};
+
+void ReplayDriver::submit_op(uint32_t idx, uint32_t op)
+{
+    ReplaySlot* slot = this->m_slots[idx];
+    const CapturedRequest& req = this->m_capture.requests[slot->request];
+
+    struct io_uring_sqe* sqe = this->get_sqe();
+    switch(op) {
+        case REPLAY_OP_CONNECT:
+            io_uring_prep_connect(sqe, slot->fd, (const struct sockaddr*)&this->m_cfg.addr, sizeof(this->m_cfg.addr));
+            break;
+        case REPLAY_OP_SEND:
+            io_uring_prep_send(sqe, slot->fd, req.data + slot->sent_offset, req.size - slot->sent_offset, MSG_NOSIGNAL);
+            break;
+        default:
+            io_uring_prep_recv(sqe, slot->fd, slot->recv_buffer, REPLAY_RECV_BUFFER, 0);
+            break;
+    }
+
+    io_uring_sqe_set_data64(sqe, REPLAY_USER_DATA(idx, slot->gen, op));
+    slot->ops_inflight++;
+}
+
+bool ReplayDriver::start_request(size_t request, uint64_t scheduled_ns)
+{
+    uint32_t idx = this->m_free.back();
+    ReplaySlot* slot = this->m_slots[idx];
+
+    slot->busy = true;
+    slot->done = false;
+    slot->failed = false;
+    slot->timed_out = false;
+    slot->request = request;
+    slot->scheduled_ns = scheduled_ns;
+    slot->sent_ns = s_replay_now_ns();
+    slot->sent_offset = 0;
+    slot->response.clear();
+
+    if(this->m_cfg.mode == ReplayMode::Pair) {
+        int pair[2];
+        if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) != 0) {
+            return false;
+        }
+        this->m_free.pop_back();
+        slot->fd = pair[0];
+
+        //the server end is served as if the listener had accepted it (the server closes it after responding)
+        struct io_uring_sqe* sqe = this->get_sqe();
+        io_uring_prep_msg_ring(sqe, this->m_server_ring_fd, (unsigned)pair[1], RING_EVENT_TYPE_ACCEPT, 0);
+        io_uring_sqe_set_data64(sqe, REPLAY_USER_DATA(idx, slot->gen, REPLAY_OP_INJECT));
+        slot->ops_inflight++;
+
+        this->submit_op(idx, REPLAY_OP_SEND);
+        this->submit_op(idx, REPLAY_OP_RECV);
+    }
+    else {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(fd == -1) {
+            return false;
+        }
+        this->m_free.pop_back();
+        slot->fd = fd;
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        this->submit_op(idx, REPLAY_OP_CONNECT);
+    }
+
+    return true;
+}
+
+void ReplayDriver::maybe_finish(uint32_t idx)
+{
+    ReplaySlot* slot = this->m_slots[idx];
+    if(!slot->done || slot->ops_inflight != 0) {
+        return;
+    }
+
+    uint64_t now = s_replay_now_ns();
+    const CapturedRequest& req = this->m_capture.requests[slot->request];
+
+    if(slot->timed_out) {
+        this->stats.timeouts++;
+    }
+    else if(slot->failed || slot->response.size() < 12) {
+        this->stats.io_errors++;
+    }
+    else {
+        int status = atoi(slot->response.c_str() + 9); //"HTTP/1.x NNN"
+        this->stats.statuses[status]++;
+
+        this->stats.scheduled[req.route].record(now - slot->scheduled_ns);
+        this->stats.service[req.route].record(now - slot->sent_ns);
+
+        //FNV-1a over the response, mixed with the request index so the sum is order independent but still ties answers to requests
+        uint64_t hash = 0xcbf29ce484222325;
+        for(size_t i = 0; i < slot->response.size(); ++i) {
+            hash = (hash ^ (uint8_t)slot->response[i]) * 0x100000001b3;
+        }
+        this->stats.digest += hash * ((slot->request << 1) | 1);
+    }
+
+    close(slot->fd);
+    slot->fd = -1;
+    slot->gen++;
+    slot->busy = false;
+    this->m_free.push_back(idx);
+}
+
+void ReplayDriver::process_cqe(struct io_uring_cqe* cqe)
+{
+    uint32_t idx = REPLAY_USER_DATA_SLOT(cqe->user_data);
+    ReplaySlot* slot = this->m_slots[idx];
+    slot->ops_inflight--;
+
+    switch(REPLAY_USER_DATA_OP(cqe->user_data)) {
+        case REPLAY_OP_INJECT: {
+            if(cqe->res < 0) {
+                //the server never got its end -- close it here and let the recv see the hangup
+                slot->failed = true;
+                shutdown(slot->fd, SHUT_RDWR);
+            }
+            break;
+        }
+        case REPLAY_OP_CONNECT: {
+            if(cqe->res < 0) {
+                slot->failed = true;
+                slot->done = true;
+                break;
+            }
+
+            this->submit_op(idx, REPLAY_OP_SEND);
+            this->submit_op(idx, REPLAY_OP_RECV);
+            break;
+        }
+        case REPLAY_OP_SEND: {
+            if(cqe->res < 0) {
+                slot->failed = true;
+                shutdown(slot->fd, SHUT_RDWR);
+                break;
+            }
+
+            slot->sent_offset += (size_t)cqe->res;
+            if(slot->sent_offset < this->m_capture.requests[slot->request].size) {
+                this->submit_op(idx, REPLAY_OP_SEND);
+            }
+            break;
+        }
+        case REPLAY_OP_RECV: {
+            if(cqe->res <= 0) {
+                //the server closes after every response so the hangup ends it
+                slot->failed = slot->failed || (cqe->res < 0);
+                slot->done = true;
+                break;
+            }
+
+            slot->response.append(slot->recv_buffer, (size_t)cqe->res);
+            this->submit_op(idx, REPLAY_OP_RECV);
+            break;
+        }
+        default:
+            break;
+    }
+
+    this->maybe_finish(idx);
+}
+
+void ReplayDriver::check_timeouts(uint64_t now)
+{
+    for(uint32_t idx = 0; idx < this->m_slots.size(); ++idx) {
+        ReplaySlot* slot = this->m_slots[idx];
+        if(slot->busy && !slot->timed_out && now > slot->sent_ns && now - slot->sent_ns > this->m_cfg.timeout_ns) {
+            //shutdown makes the outstanding recv (and any send) complete so the slot can be recycled
+            slot->timed_out = true;
+            shutdown(slot->fd, SHUT_RDWR);
+        }
+    }
+}
+
+bool ReplayDriver::run()
+{
+    size_t entries = 64;
+    while(entries < std::min<size_t>(this->m_cfg.concurrency * 4 + 64, 32768)) {
+        entries <<= 1;
+    }
+
+    int ret = io_uring_queue_init((unsigned)entries, &this->m_ring, 0);
+    if(ret < 0) {
+        fprintf(stderr, "io_uring_queue_init failed: %s\n", strerror(-ret));
+        return false;
+    }
+
+    const std::vector<CapturedRequest>& requests = this->m_capture.requests;
+    uint64_t start = s_replay_now_ns();
+    uint64_t first_us = requests.front().arrival_us; //arrivals count from when the server opened the capture
+    uint64_t last_timeout_check = start;
+
+    size_t next = 0;
+    while(next < requests.size() || this->m_free.size() != this->m_slots.size()) {
+        uint64_t now = s_replay_now_ns();
+
+        //issue everything that is due (recorded pace scaled by the speed -- or right away at max speed) while there are free slots
+        uint64_t due_ns = now;
+        while(next < requests.size() && !this->m_free.empty()) {
+            if(this->m_cfg.speed != 0.0) {
+                due_ns = start + (uint64_t)((double)(requests[next].arrival_us - first_us) * 1000.0 / this->m_cfg.speed);
+                if(due_ns > now) {
+                    break;
+                }
+            }
+
+            if(!this->start_request(next, due_ns)) {
+                fprintf(stderr, "Cannot create a socket for request %zu: %s\n", next, strerror(errno));
+                io_uring_queue_exit(&this->m_ring);
+                return false;
+            }
+            next++;
+        }
+
+        if(now - last_timeout_check >= REPLAY_TICK_NS) {
+            this->check_timeouts(now);
+            last_timeout_check = now;
+        }
+
+        uint64_t wait_ns = REPLAY_TICK_NS;
+        if(next < requests.size() && !this->m_free.empty() && due_ns > now) {
+            wait_ns = std::min<uint64_t>(wait_ns, due_ns - now);
+        }
+
+        io_uring_submit(&this->m_ring);
+
+        struct io_uring_cqe* cqe = nullptr;
+        struct __kernel_timespec ts = { (long long)(wait_ns / 1000000000), (long long)(wait_ns % 1000000000) };
+        io_uring_wait_cqe_timeout(&this->m_ring, &cqe, &ts);
+
+        while(io_uring_peek_cqe(&this->m_ring, &cqe) == 0) {
+            this->process_cqe(cqe);
+            io_uring_cqe_seen(&this->m_ring, cqe);
+        }
+    }
+
+    io_uring_queue_exit(&this->m_ring);
+    return true;
+}
+
+////////////////////////////////
+//Capture loading
+
+static bool s_load_capture(const char* path, ReplayCapture& capture)
+{
+    FILE* f = fopen(path, "rb");
+    if(f == nullptr) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return false;
+    }
+
+    uint8_t buffer[65536];
+    size_t n;
+    while((n = fread(buffer, 1, sizeof(buffer), f)) != 0) {
+        capture.bytes.insert(capture.bytes.end(), buffer, buffer + n);
+    }
+    fclose(f);
+
+    RequestCaptureFileHeader header;
+    if(capture.bytes.size() < sizeof(header)) {
+        fprintf(stderr, "%s is not a request capture\n", path);
+        return false;
+    }
+
+    memcpy(&header, capture.bytes.data(), sizeof(header));
+    if(header.magic != REQUEST_CAPTURE_MAGIC || header.version != REQUEST_CAPTURE_VERSION) {
+        fprintf(stderr, "%s is not a request capture (or was written by a different version)\n", path);
+        return false;
+    }
+
+    std::map<std::string, uint32_t> route_ids;
+    size_t pos = sizeof(header);
+    while(pos + sizeof(RequestCaptureRecord) <= capture.bytes.size()) {
+        RequestCaptureRecord rec;
+        memcpy(&rec, capture.bytes.data() + pos, sizeof(rec));
+        pos += sizeof(rec);
+
+        if(pos + rec.size > capture.bytes.size()) {
+            fprintf(stderr, "%s is truncated -- replaying the %zu complete requests\n", path, capture.requests.size());
+            break;
+        }
+
+        const char* data = (const char*)capture.bytes.data() + pos;
+        pos += rec.size;
+
+        //group by path (without the query) for the report
+        const char* pstart = (const char*)memchr(data, ' ', rec.size);
+        std::string route = "?";
+        if(pstart != nullptr) {
+            pstart++;
+            const char* pend = pstart;
+            while(pend < data + rec.size && *pend != ' ' && *pend != '?' && *pend != '\r') {
+                pend++;
+            }
+            route.assign(pstart, pend - pstart);
+        }
+
+        auto rit = route_ids.find(route);
+        if(rit == route_ids.end()) {
+            rit = route_ids.emplace(route, (uint32_t)capture.routes.size()).first;
+            capture.routes.push_back(route);
+        }
+
+        capture.requests.push_back(CapturedRequest{rec.arrival_us, data, rec.size, rit->second});
+    }
+
+    return !capture.requests.empty();
+}
+
+////////////////////////////////
+//Driver
+
+//in process server for --pair
+static RSHookServer s_server;
+
+static void s_stop_server(std::thread& runloop)
+{
+    //the runloop returns at its next wakeup and shuts the server down on its own thread
+    if(runloop.joinable()) {
+        s_server.request_shutdown();
+        runloop.join();
+    }
+}
+
+static void s_usage()
+{
+    fprintf(stderr, "Usage: replay <capture> [options]\n");
+    fprintf(stderr, "  --pair               serve the requests in this process over socketpairs (default)\n");
+    fprintf(stderr, "  --loopback           send the requests to a running server over TCP\n");
+    fprintf(stderr, "  --host H             server address for --loopback (default 127.0.0.1)\n");
+    fprintf(stderr, "  --port N             server port for --loopback (default %d)\n", REPLAY_DEFAULT_PORT);
+    fprintf(stderr, "  --speed X            replay at X times the recorded pace (default 1)\n");
+    fprintf(stderr, "  --max                ignore the recorded pace and keep --concurrency requests in flight\n");
+    fprintf(stderr, "  --concurrency N      most requests in flight (default %d)\n", REPLAY_DEFAULT_CONCURRENCY);
+    fprintf(stderr, "  --timeout MS         per request timeout (default %d)\n", REPLAY_DEFAULT_TIMEOUT_MS);
+}
+
+static bool s_parse_args(int argc, char** argv, ReplayConfig& cfg)
+{
+    cfg.mode = ReplayMode::Pair;
+    cfg.host = "127.0.0.1";
+    cfg.port = REPLAY_DEFAULT_PORT;
+    cfg.speed = 1.0;
+    cfg.concurrency = REPLAY_DEFAULT_CONCURRENCY;
+    cfg.timeout_ns = (uint64_t)REPLAY_DEFAULT_TIMEOUT_MS * 1000000;
+
+    for(int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        const char* val = (i + 1 < argc) ? argv[i + 1] : nullptr;
+
+        if(arg[0] != '-') {
+            cfg.capture_path = arg;
+            continue;
+        }
+
+        if(strcmp(arg, "--pair") == 0) {
+            cfg.mode = ReplayMode::Pair;
+            continue;
+        }
+        else if(strcmp(arg, "--loopback") == 0) {
+            cfg.mode = ReplayMode::Loopback;
+            continue;
+        }
+        else if(strcmp(arg, "--max") == 0) {
+            cfg.speed = 0.0;
+            continue;
+        }
+
+        if(val == nullptr) {
+            return false;
+        }
+        i++;
+
+        if(strcmp(arg, "--host") == 0) {
+            cfg.host = val;
+        }
+        else if(strcmp(arg, "--port") == 0) {
+            cfg.port = atoi(val);
+        }
+        else if(strcmp(arg, "--speed") == 0) {
+            cfg.speed = atof(val);
+            if(cfg.speed <= 0.0) {
+                return false;
+            }
+        }
+        else if(strcmp(arg, "--concurrency") == 0) {
+            cfg.concurrency = (size_t)std::max(1, atoi(val));
+        }
+        else if(strcmp(arg, "--timeout") == 0) {
+            cfg.timeout_ns = (uint64_t)std::max(1, atoi(val)) * 1000000;
+        }
+        else {
+            return false;
+        }
+    }
+
+    memset(&cfg.addr, 0, sizeof(cfg.addr));
+    cfg.addr.sin_family = AF_INET;
+    cfg.addr.sin_port = htons(cfg.port);
+    if(inet_pton(AF_INET, cfg.host.c_str(), &cfg.addr.sin_addr) != 1) {
+        fprintf(stderr, "--host must be a numeric IPv4 address\n");
+        return false;
+    }
+
+    return !cfg.capture_path.empty();
+}
+
+static void s_print_row(const char* label, const HDRHistogram& scheduled, const HDRHistogram& service)
+{
+    printf("  %-32s %10" PRIu64 " %10.1f %10.1f %10.1f %10.1f | %10.1f %10.1f %10.1f\n", label, scheduled.m_total, scheduled.quantile(0.5) / 1000.0, scheduled.quantile(0.99) / 1000.0, scheduled.quantile(0.999) / 1000.0, scheduled.m_max / 1000.0, service.quantile(0.5) / 1000.0, service.quantile(0.99) / 1000.0, service.quantile(0.999) / 1000.0);
+}
+
+int main(int argc, char** argv)
+{
+    ReplayConfig cfg;
+    if(!s_parse_args(argc, argv, cfg)) {
+        s_usage();
+        return 1;
+    }
+
+    ReplayCapture capture;
+    if(!s_load_capture(cfg.capture_path.c_str(), capture)) {
+        return 1;
+    }
+
+    int server_ring_fd = -1;
+    std::thread runloop;
+    if(cfg.mode == ReplayMode::Pair) {
+        //the server gets no listener -- every connection arrives through its ring from the driver below
+        std::atomic<bool> ready(false);
+
+        runloop = std::thread([&ready]() {
+            //embedded -- the production snapshot, capture, and access log in the static root stay untouched
+            s_server.startup(0, -1, true);
+            ready.store(true);
+            s_server.runloop();
+            s_server.shutdown();
+        });
+
+        while(!ready.load()) {
+            std::this_thread::yield();
+        }
+        server_ring_fd = s_server.get_ring_fd();
+    }
+
+    uint64_t recorded_us = capture.requests.back().arrival_us - capture.requests.front().arrival_us;
+    char pace[32];
+    if(cfg.speed == 0.0) {
+        snprintf(pace, sizeof(pace), "max speed");
+    }
+    else {
+        snprintf(pace, sizeof(pace), "%gx speed", cfg.speed);
+    }
+    printf("Replaying %zu requests (%zu routes, %.2fs recorded) %s at %s\n", capture.requests.size(), capture.routes.size(), recorded_us / 1000000.0, (cfg.mode == ReplayMode::Pair) ? "in process over socketpairs" : "over loopback", pace);
+
+    ReplayDriver driver(cfg, capture, server_ring_fd);
+    uint64_t start = s_replay_now_ns();
+    if(!driver.run()) {
+        s_stop_server(runloop);
+        return 1;
+    }
+    double elapsed_s = (s_replay_now_ns() - start) / 1000000000.0;
+
+    const ReplayStats& stats = driver.stats;
+    HDRHistogram scheduled_all;
+    HDRHistogram service_all;
+    for(size_t r = 0; r < capture.routes.size(); ++r) {
+        scheduled_all.add(stats.scheduled[r]);
+        service_all.add(stats.service[r]);
+    }
+
+    printf("\nCompleted %" PRIu64 " requests in %.2fs -- %.1f req/s\n", scheduled_all.m_total, elapsed_s, scheduled_all.m_total / elapsed_s);
+    printf("Errors: io %" PRIu64 " timeout %" PRIu64 "\n", stats.io_errors, stats.timeouts);
+    printf("Status:");
+    for(auto it = stats.statuses.begin(); it != stats.statuses.end(); ++it) {
+        printf(" %d x %" PRIu64, it->first, it->second);
+    }
+    printf("\nResponse digest %016" PRIx64 "\n", stats.digest);
+
+    std::vector<size_t> order(capture.routes.size());
+    for(size_t r = 0; r < order.size(); ++r) {
+        order[r] = r;
+    }
+    std::sort(order.begin(), order.end(), [&stats](size_t a, size_t b) { return stats.scheduled[a].m_total > stats.scheduled[b].m_total; });
+
+    printf("\nLatency (us) -- from the recorded arrival | from the send\n");
+    printf("  %-32s %10s %10s %10s %10s %10s | %10s %10s %10s\n", "route", "count", "p50", "p99", "p999", "max", "p50", "p99", "p999");
+    for(size_t i = 0; i < std::min<size_t>(order.size(), REPLAY_MAX_ROUTES); ++i) {
+        s_print_row(capture.routes[order[i]].c_str(), stats.scheduled[order[i]], stats.service[order[i]]);
+    }
+    s_print_row("all", scheduled_all, service_all);
+
+    fflush(stdout);
+    s_stop_server(runloop);
+
+    return 0;
+}
@@ -0,0 +1,228 @@
+#include "../server/trace.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cinttypes>
+
+#include <algorithm>
+
+#include <vector>
+#include <unordered_map>
+
+//the slot event types (kept in sync with RING_EVENT_* in events.h -- that header pulls in the ring so the tool does not include it)
+static const char* s_event_name(uint32_t event_type, uint8_t op)
+{
+    if(op == 0x1) {
+        return "watch";
+    }
+
+    switch(event_type) {
+        case 0x4:
+            return "file_close";
+        case 0x8:
+            return "file_coroutine";
+        case 0x10:
+            return "client_read";
+        case 0x20:
+            return "client_write";
+        case 0x30:
+            return "client_write_vectored";
+        case 0x100:
+            return "job_complete";
+        case 0x200:
+            return "job_signal";
+        case 0x400:
+            return "task_wait";
+        default:
+            return "io";
+    }
+}
+
+class TraceThread
+{
+public:
+    uint32_t thread_id;
+    std::vector<RingTraceRecord> records;
+};
+
+class TraceWriter
+{
+private:
+    FILE* m_out;
+    uint64_t m_base_ns;
+    bool m_first;
+
+public:
+    TraceWriter(FILE* out, uint64_t base_ns): m_out(out), m_base_ns(base_ns), m_first(true) { ; }
+
+    void begin()
+    {
+        fprintf(this->m_out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    }
+
+    void end()
+    {
+        fprintf(this->m_out, "\n]}\n");
+    }
+
+    void event(const char* ph, const char* cat, const char* name, uint32_t tid, uint64_t ts_ns, const RingTraceRecord& rec, bool withid)
+    {
+        fprintf(this->m_out, "%s{\"ph\":\"%s\",\"cat\":\"%s\",\"name\":\"%s\",\"pid\":1,\"tid\":%u,\"ts\":%.3f", this->m_first ? "" : ",\n", ph, cat, name, tid, (ts_ns - this->m_base_ns) / 1000.0);
+        if(withid) {
+            fprintf(this->m_out, ",\"id\":\"0x%" PRIx64 "\"", (((uint64_t)rec.slot_generation) << 32) | rec.slot_index);
+        }
+        if(ph[0] == 'i') {
+            fprintf(this->m_out, ",\"s\":\"t\"");
+        }
+        fprintf(this->m_out, ",\"args\":{\"slot\":%u,\"gen\":%u,\"res\":%d}}", rec.slot_index, rec.slot_generation, rec.res);
+        this->m_first = false;
+    }
+
+    void complete(const char* cat, const char* name, uint32_t tid, uint64_t start_ns, uint64_t end_ns, const RingTraceRecord& rec)
+    {
+        uint64_t tag = (((uint64_t)rec.slot_generation) << 32) | rec.slot_index;
+        fprintf(this->m_out, "%s{\"ph\":\"X\",\"cat\":\"%s\",\"name\":\"%s\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"tag\":\"0x%" PRIx64 "\",\"status\":%d}}", this->m_first ? "" : ",\n", cat, name, tid, (start_ns - this->m_base_ns) / 1000.0, (end_ns - start_ns) / 1000.0, tag, rec.res);
+        this->m_first = false;
+    }
+};
+
+static bool s_read_trace(const char* path, std::vector<TraceThread>& threads)
+{
+    FILE* f = fopen(path, "rb");
+    if(f == nullptr) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return false;
+    }
+
+    RingTraceFileHeader header;
+    if(fread(&header, sizeof(header), 1, f) != 1 || header.magic != RING_TRACE_MAGIC || header.version != RING_TRACE_VERSION || header.record_size != sizeof(RingTraceRecord)) {
+        fprintf(stderr, "%s is not a ring trace (or was written by a different version)\n", path);
+        fclose(f);
+        return false;
+    }
+
+    bool ok = true;
+    for(uint32_t i = 0; i < header.thread_count && ok; ++i) {
+        RingTraceThreadHeader theader;
+        if(fread(&theader, sizeof(theader), 1, f) != 1) {
+            ok = false;
+            break;
+        }
+
+        TraceThread thread;
+        thread.thread_id = theader.thread_id;
+        thread.records.resize(theader.record_count);
+        ok = (fread(thread.records.data(), sizeof(RingTraceRecord), theader.record_count, f) == theader.record_count);
+
+        threads.push_back(std::move(thread));
+    }
+
+    fclose(f);
+    if(!ok) {
+        fprintf(stderr, "%s is truncated\n", path);
+    }
+    return ok;
+}
+
+/**
+ * Slot records become async spans keyed by (generation, index) -- one for the request lifetime (first record to release) with the
+ * ring stages (submit to completion) nested inside it. Job runs become complete events on the worker's track.
+ **/
+static void s_convert(const std::vector<TraceThread>& threads, FILE* out)
+{
+    uint64_t base_ns = UINT64_MAX;
+    for(size_t i = 0; i < threads.size(); ++i) {
+        if(!threads[i].records.empty()) {
+            base_ns = std::min(base_ns, threads[i].records[0].ts_ns);
+        }
+    }
+
+    TraceWriter writer(out, base_ns == UINT64_MAX ? 0 : base_ns);
+    writer.begin();
+
+    for(size_t i = 0; i < threads.size(); ++i) {
+        const TraceThread& thread = threads[i];
+
+        std::unordered_map<uint64_t, bool> live; //slot key -> lifetime span open
+        std::unordered_map<uint64_t, RingTraceRecord> open_stage[2]; //slot key -> submit record, by op
+        std::unordered_map<uint64_t, RingTraceRecord> open_jobs; //job tag -> start record
+
+        for(size_t j = 0; j < thread.records.size(); ++j) {
+            const RingTraceRecord& rec = thread.records[j];
+            uint64_t key = (((uint64_t)rec.slot_generation) << 32) | rec.slot_index;
+
+            if(rec.kind == RingTraceKind::Accept) {
+                writer.event("i", "accept", "accept", thread.thread_id, rec.ts_ns, rec, false);
+                continue;
+            }
+
+            if(rec.kind == RingTraceKind::JobStart) {
+                open_jobs[key] = rec;
+                continue;
+            }
+
+            if(rec.kind == RingTraceKind::JobEnd) {
+                auto start = open_jobs.find(key);
+                if(start != open_jobs.end()) {
+                    writer.complete("job", "job", thread.thread_id, start->second.ts_ns, rec.ts_ns, rec);
+                    open_jobs.erase(start);
+                }
+                continue;
+            }
+
+            if(live.find(key) == live.end()) {
+                writer.event("b", "slot", "request", thread.thread_id, rec.ts_ns, rec, true);
+                live[key] = true;
+            }
+
+            uint8_t op = rec.op & 0x1;
+            if(rec.kind == RingTraceKind::Submit) {
+                open_stage[op][key] = rec;
+                writer.event("b", "slot", s_event_name(rec.event_type, rec.op), thread.thread_id, rec.ts_ns, rec, true);
+            }
+            else if(rec.kind == RingTraceKind::Complete) {
+                auto submit = open_stage[op].find(key);
+                if(submit != open_stage[op].end()) {
+                    //name the end after the submit so the pair matches even if the slot was rearmed in between
+                    writer.event("e", "slot", s_event_name(submit->second.event_type, submit->second.op), thread.thread_id, rec.ts_ns, rec, true);
+                    open_stage[op].erase(submit);
+                }
+            }
+            else if(rec.kind == RingTraceKind::Release) {
+                writer.event("e", "slot", "request", thread.thread_id, rec.ts_ns, rec, true);
+                live.erase(key);
+            }
+        }
+    }
+
+    writer.end();
+}
+
+int main(int argc, char** argv)
+{
+    if(argc < 2) {
+        fprintf(stderr, "Usage: tracetool <rshook-trace.bin> [out.json]\n");
+        return 1;
+    }
+
+    std::vector<TraceThread> threads;
+    if(!s_read_trace(argv[1], threads)) {
+        return 1;
+    }
+
+    FILE* out = stdout;
+    if(argc > 2) {
+        out = fopen(argv[2], "w");
+        if(out == nullptr) {
+            fprintf(stderr, "Cannot open %s\n", argv[2]);
+            return 1;
+        }
+    }
+
+    s_convert(threads, out);
+
+    if(out != stdout) {
+        fclose(out);
+    }
+    return 0;
+}